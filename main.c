@@ -1,10 +1,41 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <gsl/gsl_blas.h>
 #include <gsl/gsl_multifit.h>
+#include <gsl/gsl_linalg.h>
+#include <gsl/gsl_errno.h>
+
+// Per-patient covariates, in the order of the database file columns following the dose.
+// Adding a covariate (e.g. renal function) only requires a new entry here and a new column in the files.
+#define PATIENT_COVARIATES(X) \
+	X(sex) \
+	X(age) \
+	X(weight)
+
+#define COUNT_COVARIATE(name) + 1
+#define NB_COVARIATES (0 PATIENT_COVARIATES(COUNT_COVARIATE))
+
+// Features of a sample: time, dose, then the patient covariates
+#define FEATURE_TIME 0
+#define FEATURE_DOSE 1
+#define FEATURE_COVARIATES 2
+#define NB_FEATURES (FEATURE_COVARIATES + NB_COVARIATES)
 
 struct patientStruct {
 	int num;
@@ -12,9 +43,9 @@ struct patientStruct {
 	float * times;
 	float * doses;
 	int size; // Number of entries in the concentrations, times, and doses arrays
-	float sex;
-	float age;
-	float weight;
+#define DECLARE_COVARIATE(name) float name;
+	PATIENT_COVARIATES(DECLARE_COVARIATE)
+#undef DECLARE_COVARIATE
 };
 
 typedef struct patientStruct Patient;
@@ -26,18 +57,373 @@ struct databaseStruct {
 
 typedef struct databaseStruct Database;
 
+enum kernelType {
+	KERNEL_GAUSSIAN, // exp(-d^2 / (2 * sigma^2))
+	KERNEL_LAPLACIAN, // exp(-d / sigma)
+	KERNEL_MATERN, // Matern nu = 3/2: (1 + sqrt(3) * d / sigma) * exp(-sqrt(3) * d / sigma)
+	KERNEL_WENDLAND // Wendland C2: (1 - d / sigma)^5 * (5 * d / sigma + 1) for d < sigma, 0 beyond (up to 5 features)
+};
+
+// Kernel functions specialized for one kernel type and one number of features
+struct kernelFunctionsStruct {
+	int type; // One of kernelType
+	int dim; // Number of features the functions are specialized for, 0 for any
+	int compact; // k(a, b) = 0 when |a - b| >= sigma
+	double (*eval)(const double * a, const double * b, int dim, double sigma); // k(a, b)
+	void (*row)(const double * x, const gsl_matrix * xTrain, double sigma, double * row); // row[j] = k(x, xTrain(j,:))
+	void (*predict)(const gsl_matrix * xTrain, const gsl_matrix * xTest, const gsl_vector * alpha, double sigma,
+					gsl_vector * y); // y = K(xTest, xTrain) * alpha
+};
+
+typedef struct kernelFunctionsStruct KernelFunctions;
+
+enum solverType {
+	SOLVER_CHOLESKY, // Dense Cholesky factorization of K + I / C, O(N^3)
+	SOLVER_HODLR, // Hierarchical off-diagonal low rank factorization, about O(N log^2 N)
+	SOLVER_SHARDED, // Conjugate gradient over kernel row blocks built by several processes in shared memory
+	SOLVER_SPARSE // Envelope Cholesky of the sparse K + I / C of a compactly supported kernel, in RCM order
+};
+
+enum precisionType {
+	PRECISION_EXACT, // exp() of the C library
+	PRECISION_FAST // Polynomial exp with a relative error below FAST_EXP_MAX_ERROR
+};
+
+enum isaType {
+	ISA_SCALAR,
+	ISA_SSE42, // 2 doubles per instruction
+	ISA_AVX2, // 4 doubles per instruction, with FMA
+	ISA_AVX512 // 8 doubles per instruction
+};
+
+enum svmType {
+	SVM_SINGLE, // One model trained on the whole library
+	SVM_ENSEMBLE, // Average of sub-models trained independently on partitions of the library
+	SVM_CLUSTERED // Local sub-models trained on covariate clusters, queries routed to the nearest clusters
+};
+
+// Replacement of a library sample waiting for the next retraining
+struct pendingSampleStruct {
+	int index; // Library sample replaced
+	double feat[NB_FEATURES]; // New (normalized) features
+	double y; // New concentration
+};
+
+typedef struct pendingSampleStruct PendingSample;
+
 struct svmStruct {
-	double means[5]; // Normalization constants
-	double stds[5]; // Normalization constants
-	double sigma; // Gaussian kernel
+	int type; // Model type (one of svmType)
+	double means[NB_FEATURES]; // Normalization constants
+	double stds[NB_FEATURES]; // Normalization constants
+	int kernel; // Kernel type (one of kernelType)
+	double sigma; // Kernel width
+	int precision; // Exponentials of the Gaussian prediction (one of precisionType)
 	double C; // Regularization
 	gsl_matrix * trainFeat; // Training samples (support vectors) already normalized
 	gsl_vector * trainY; // Training concentration
 	gsl_vector * alpha; // Trained coefficients
+	gsl_vector * weights; // Number of samples each library sample stands for (coreset), NULL for 1. The ridge
+						  // regularization of sample i is 1 / (C * weights[i]).
+	double epsilon; // Width of the insensitive tube (> 0 selects the SMO epsilon-SVR trainer)
+	int * support; // Library samples with a nonzero coefficient (epsilon-SVR), the only ones the Gaussian
+				   // predictions visit; NULL for all of them. The library itself is kept for the retrainings.
+	int nbSupport;
+	double b; // Bias (always 0 for the ridge trainer)
+	double cacheSize; // Size of the SMO kernel row cache in MB
+	gsl_matrix * chol; // Lower Cholesky factor of K + I / C kept by the ridge trainer (NULL if not available)
+	int solver; // Linear solver of the ridge trainer (one of solverType)
+	double tolerance; // Relative accuracy of the low rank blocks (SOLVER_HODLR) or of the residual (SOLVER_SHARDED)
+	int nbWorkers; // Number of worker processes (SOLVER_SHARDED), 0 for one per core
+	int nbModels; // Number of sub-models (partitions) of an ensemble
+	int stratified; // Ensemble partitions stratified on the covariates (1) or random (0)
+	struct svmStruct * models; // Sub-models of an ensemble
+	int * partition; // Sub-model holding each library sample (ensemble)
+	gsl_matrix * centers; // Cluster centers in the normalized covariate space, one per sub-model (clustered)
+	double overlap; // A sample joins every cluster closer than (1 + overlap) times its nearest one (clustered)
+	int nbRoutes; // Number of nearest clusters (1 or 2) blended to answer a query (clustered)
+	struct cellIndexStruct * cells; // Grid of the library used to predict with a compactly supported kernel
+	struct kdTreeStruct * tree; // k-d tree of the library of a Gaussian model, built only if pruning > 0
+	double pruning; // Absolute error allowed to the Gaussian prediction to skip far library samples, 0 for exact
+					// (change it with setSVMPruning, which builds the trees)
+	int nbBootstrap; // Number of residual bootstrap replicates trained along a single ridge model (0 for none)
+	gsl_matrix * bootAlpha; // Coefficients of the bootstrap replicates, one column per replicate
+	gsl_vector * bootNoise; // Residual drawn for each replicate to turn its prediction into an observation
+	int dirty; // The model must be retrained before the next prediction (set by queueSVMSample)
+	PendingSample * pending; // Library replacements not applied yet, at most one per sample
+	int nbPending;
+	int pendingCapacity;
+	unsigned long version; // Unique stamp renewed by every training, 0 if never trained (see SVMWorkspace)
 };
 
 typedef struct svmStruct SVM;
 
+// Size-bounded LRU cache of Gaussian kernel rows used by the SMO solver
+struct kernelCacheStruct {
+	const gsl_matrix * xTrain; // Training samples the rows are computed from
+	const KernelFunctions * kernel;
+	double sigma;
+	long capacity; // Maximum number of cached rows
+	long used; // Number of rows currently cached
+	double ** rows; // rows[i] is the kernel row of sample i, or NULL if not cached
+	int * prev; // LRU doubly linked list, from the most recently used (head) ...
+	int * next; // ... to the least recently used (tail)
+	int head;
+	int tail;
+	long hits;
+	long misses;
+};
+
+typedef struct kernelCacheStruct KernelCache;
+
+// Uniform grid over normalized samples, with cells as large as the support radius of a compactly supported
+// kernel, to find the samples within that radius of a point without visiting the whole library
+struct cellIndexStruct {
+	const gsl_matrix * x; // Indexed samples
+	double cellSize;
+	int dim;
+	int bits; // Bits per coordinate in the cell keys
+	int size;
+	struct cellEntryStruct {
+		unsigned long long key; // Packed cell coordinates
+		int index; // Sample
+	} * entries; // Sorted by cell
+};
+
+typedef struct cellIndexStruct CellIndex;
+
+// Number of library samples below which a node of a k-d tree is not split
+#define KD_LEAF_SIZE 16
+
+// Maximum depth of a k-d tree (the nodes are split at the median)
+#define KD_MAX_DEPTH 64
+
+// k-d tree over normalized library samples, split at the median of the widest dimension of each node. Every node
+// keeps the bounding box of its samples and the sum of their |alpha|, which bounds the contribution of the whole
+// node to a Gaussian sum: |sum_i alpha(i) * k(x, x_i)| <= alphaSum * exp(scale * dmin^2), dmin the distance
+// from x to the box.
+struct kdTreeStruct {
+	int dim;
+	int size; // Library samples
+	int nbNodes;
+	double * points; // Samples in tree order, size x dim
+	double * alpha; // Their coefficients
+	struct kdNodeStruct {
+		int begin; // Samples begin ... end - 1 in tree order
+		int end;
+		int left; // Children, -1 for a leaf
+		int right;
+		double alphaSum; // Sum of |alpha| over the samples
+		double lower[NB_FEATURES]; // Bounding box
+		double upper[NB_FEATURES];
+	} * nodes; // The root is the first one
+};
+
+typedef struct kdTreeStruct KDTree;
+
+// Model updated in the background while it keeps answering predictions. Readers use the published model
+// between acquireLiveSVM and releaseLiveSVM without locking; a worker thread retrains a shadow copy and
+// publishes it with an atomic swap, then waits until no reader can still hold the previous one.
+struct liveSVMStruct {
+	_Atomic(SVM *) current; // Published model
+	SVM * shadow; // Copy of the published model retrained by the worker
+	SVM * allocated; // The one of the two models allocated by createLiveSVM
+	atomic_uint epoch; // Grace period counter
+	atomic_int readers[2]; // Readers inside the current and the previous grace periods (by epoch parity)
+	atomic_ulong version; // Number of models published
+	PendingSample * incoming; // Library replacements waiting for the worker
+	int nbIncoming;
+	int incomingCapacity;
+	PendingSample * training; // Library replacements the worker is training, not published yet
+	int nbTraining;
+	int trainingCapacity;
+	int busy; // The worker is retraining
+	int stop;
+	pthread_mutex_t lock; // Protects incoming, nbTraining, busy and stop
+	pthread_cond_t wake; // Signaled when replacements arrive or on stop
+	pthread_cond_t idle; // Signaled when the worker has published everything
+	pthread_t worker;
+};
+
+typedef struct liveSVMStruct LiveSVM;
+
+// Gaussian prediction of one patient and dose with a single model, for which only the time varies:
+// y(t) = sum_i factors(i) * exp(scale * (t - times(i))^2) + b with the normalized time t, where
+// factors(i) = alpha(i) * exp(scale * |x - x_i|^2) over the dose and the covariates is computed once
+struct timeCurveStruct {
+	unsigned long version; // Version of the model the factors were computed for
+	int size; // Library samples with a nonzero factor
+	int capacity; // Library samples the buffers can hold
+	int precision; // Exponentials (one of precisionType)
+	double scale; // -1 / (2 * sigma^2)
+	double b;
+	double timeMean; // Normalization constants of the time
+	double timeStd;
+	double * times; // Normalized times of the library samples
+	double * timeNorms; // Their squares
+	double * factors;
+};
+
+typedef struct timeCurveStruct TimeCurve;
+
+// Library of a Gaussian model in the layout of the streamed predictions, kept while the model version is the same.
+// Every sub-model of an ensemble or clustered model has its own cache.
+struct libraryCacheStruct {
+	unsigned long version; // Version of the model the cache belongs to (0 for none)
+	int capacity; // Library samples the buffers can hold
+	int nbTrain; // Library samples cached (the support vectors if the model has them)
+	double * norms; // Squared norms of the library samples
+	double * trainT; // Library in feature-major order, NB_FEATURES x nbTrain
+	double * alpha; // Coefficients of the library
+	int nbModels; // Caches of the sub-models
+	struct libraryCacheStruct * models;
+};
+
+// Farthest point clustering of the library of a single Gaussian model for predictFastGaussSVM, kept while the
+// model version is the same, and the expansions of the last clustering it used
+struct gaussTransformStruct {
+	unsigned long version; // Version of the model clustered (0 for none)
+	int maxClusters; // Centers of the clustering
+	int * centers; // Samples chosen as centers, in farthest point order
+	double * radii; // radii[c]: largest distance of a sample to the nearest of the first c centers
+	double tolerance; // Tolerance of the orders (0 for none)
+	double reach; // Distance of a query (scaled by the bandwidth) beyond which a cluster is neglected
+	int * orders; // orders[c]: truncation order precise enough with the first c centers, 0 if none is
+	int nbClusters; // Clusters of the expansions (0 for none)
+	int order; // Truncation order of the expansions
+	double * coefficients; // Expansions of the clusters, nbClusters x terms
+};
+
+// Scratch memory of the predictions, grown to the largest request and then reused so that predicting
+// allocates nothing. It also caches the squared norms and a feature-major copy of the library of the last
+// model it predicted with and of its sub-models, until their versions change. A workspace must not be shared
+// between threads.
+struct svmWorkspaceStruct {
+	int testCapacity; // Test samples the buffers can hold
+	int trainCapacity; // Library samples the neighbor buffer can hold
+	struct libraryCacheStruct library; // Library of the model predicted last (and of its sub-models)
+	double * testNorms; // Squared norms of the test samples
+	double * testFeat; // Features of the test samples, testCapacity x NB_FEATURES
+	double * partial; // Predictions of one sub-model of an ensemble
+	int * neighbors; // Library samples inside the support of a query
+	struct gaussTransformStruct transform; // Clustering of the library of the last fast Gauss transform
+	TimeCurve curve; // Curve of the last patient predicted by predictN (single Gaussian models)
+};
+
+typedef struct svmWorkspaceStruct SVMWorkspace;
+
+// Threads predicting large test batches in parallel. The test samples are split in one contiguous slice per
+// thread (the calling one included); every thread predicts its slice with its own workspace and writes its
+// own part of the output, so that nothing is shared but the model.
+struct predictPoolStruct {
+	int nbThreads; // Threads predicting a batch, the calling one included
+	pthread_t * threads; // nbThreads - 1 workers
+	struct predictThreadStruct {
+		struct predictPoolStruct * pool;
+		int index; // Slice predicted by the thread
+	} * args;
+	SVMWorkspace ** workspaces; // One per thread, the first one is used by the calling thread
+	pthread_mutex_t batch; // Serializes the batches of several calling threads
+	pthread_mutex_t lock; // Protects the fields below
+	pthread_cond_t start; // Signaled when a batch starts or on stop
+	pthread_cond_t done; // Signaled when the last worker finished its slice
+	unsigned long generation; // Number of batches started
+	int remaining; // Workers still predicting the current batch
+	int stop;
+	const SVM * svm; // Current batch
+	const gsl_matrix * xTest;
+	gsl_vector * y;
+};
+
+typedef struct predictPoolStruct PredictPool;
+
+// Query of a batch prediction: concentrations of a patient at arbitrary times after a dose
+struct predictQueryStruct {
+	const Patient * patient; // Covariates
+	float dose;
+	const double * times;
+	int nbTimes;
+};
+
+typedef struct predictQueryStruct PredictQuery;
+
+// Therapeutic window a predicted curve must stay in, and the doses searched by optimizeDose
+struct doseWindowStruct {
+	double low; // Concentrations
+	double high;
+	double start; // Times checked, from start to stop
+	double stop;
+	int nbTimes;
+	double minDose; // Doses searched
+	double maxDose;
+	double tolerance; // Accuracy of the bounds of the dose range, 0 for (maxDose - minDose) / 1000
+};
+
+typedef struct doseWindowStruct DoseWindow;
+
+// Number of independently locked shards of a prediction cache
+#define CACHE_SHARDS 16
+
+// Quantization of the keys of the prediction cache: inputs closer than a step share their curve
+#define CACHE_COVARIATE_STEP 1e-3
+#define CACHE_DOSE_STEP 1e-3 // mg
+#define CACHE_TIME_STEP 1e-4 // h
+
+// Quantized covariates, dose, start, stop and n
+#define CACHE_KEY_SIZE (NB_COVARIATES + 4)
+
+// Bounded LRU cache of predicted curves, keyed by the quantized inputs of predictN and the model version. The
+// curves are spread on CACHE_SHARDS shards by hash, each with its own lock, LRU list and buckets, so that threads
+// looking up different curves rarely wait for each other. A cache serves one model: a shard looked up with
+// another model version (e.g. retrained after leastRelevent) drops its curves.
+struct predictCacheStruct {
+	struct predictShardStruct {
+		pthread_mutex_t lock;
+		unsigned long version; // Version of the model of the cached curves
+		int capacity; // Maximum number of cached curves
+		int used; // Number of entries in use
+		struct predictEntryStruct {
+			long key[CACHE_KEY_SIZE];
+			unsigned long hash;
+			double * values; // Predicted concentrations
+			int size; // Values the buffer can hold
+			int prev; // LRU doubly linked list, from the most recently used (head) ...
+			int next; // ... to the least recently used (tail)
+			int chain; // Next entry of the same bucket, -1 for none
+		} * entries;
+		int * buckets; // First entry of each bucket, -1 for none
+		int nbBuckets; // Power of 2
+		int head;
+		int tail;
+	} shards[CACHE_SHARDS];
+	atomic_long hits; // Curves answered from the cache
+	atomic_long misses; // Curves predicted
+};
+
+typedef struct predictCacheStruct PredictCache;
+
+// Uniform bins of each axis of a surrogate pointing to the interval of knots they start in, so that locating a
+// query takes a few steps whatever the knots
+#define SURROGATE_BINS 256
+
+// Model tabulated on a tensor grid over (time, dose, covariates) in raw units, answering a prediction by
+// multilinear interpolation between the 2^NB_FEATURES surrounding knots. The knots of each axis are refined
+// where the model curves most; features with two distinct values in the library (e.g. sex) are tabulated at
+// these two values only. The table is built in memory by buildSurrogate or mapped from a file by loadSurrogate.
+struct surrogateStruct {
+	double lower[NB_FEATURES]; // Range tabulated along each feature, queries are clamped to it
+	double upper[NB_FEATURES];
+	int maxKnots[NB_FEATURES]; // Knots an axis may be refined to
+	double tolerance; // Interpolation error the axes are refined to, relative to the largest prediction
+	int nbKnots[NB_FEATURES];
+	double * knots[NB_FEATURES]; // Increasing knots of each axis
+	int * bins[NB_FEATURES]; // First interval of each of the SURROGATE_BINS bins of each axis
+	double * values; // Predictions at the knots, the last feature fastest
+	void * map; // Mapped table file (NULL if built in memory)
+	size_t mapSize;
+};
+
+typedef struct surrogateStruct Surrogate;
+
 // Allocate the concentrations, times, and doses arrays
 void createPatient(Patient * p, int size);
 
@@ -50,6 +436,12 @@ Database readDatabase(const char * filename);
 // Print a database
 void printDatabase(const Database * db);
 
+// Fill the NB_FEATURES features (not normalized) of a sample of patient p taken at the given time and dose
+void sampleFeatures(const Patient * p, double time, double dose, double * feat);
+
+// Normalize NB_FEATURES features in place with the normalization constants of the model
+void normalizeFeatures(const SVM * svm, double * feat);
+
 // Free a database
 void deleteDatabase(Database * db);
 
@@ -59,14 +451,315 @@ int ransac(const float * x, const float * y, int size, float threshold, int k, f
 
 void predictGaussianSVM(const gsl_matrix * xTrain, const gsl_matrix * xTest, const gsl_vector * alpha, double sigma, gsl_vector * y);
 
+// Instruction set of the Gaussian prediction kernels: the widest one the processor (and the OS) supports,
+// detected once with CPUID. Always ISA_SCALAR on other architectures.
+int detectISA(void);
+
 void trainGaussianSVM(const gsl_matrix * xTrain, const gsl_vector * y, double * C, double * sigma, gsl_vector * alpha);
 
-// Return predicted concentrations for certain time
-int predictN(double start, double stop, int n, const Patient * p, float dose, const SVM * svm, gsl_vector * out);
+// Return the kernel functions of the given type specialized for dim features if they were instantiated
+// (dim == NB_FEATURES), the generic ones otherwise
+const KernelFunctions * selectKernel(int type, int dim);
+
+// Mean of the squared distances between all the pairs of samples, computed in O(N)
+double meanSquaredDistance(const gsl_matrix * x);
+
+// Matlab: K = kernel(X, X); For the Gaussian kernel of samples with NB_FEATURES features, K is the Hadamard
+// product of a covariate factor, evaluated once per pair of patients (samples with the same covariates), and of
+// a time/dose factor, evaluated per pair of samples or once per pair of distinct (time, dose) if they repeat.
+void buildKernelMatrix(const KernelFunctions * kernel, const gsl_matrix * xTrain, double sigma, gsl_matrix * K);
+
+// Same as trainGaussianSVM for any kernel type
+void trainKernelSVM(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * y, double * C,
+					double * sigma, gsl_vector * alpha);
+
+// Predict the concentrations of normalized test samples with the model
+void predictSVM(const SVM * svm, const gsl_matrix * xTest, gsl_vector * y);
+
+// Allocate an empty prediction workspace, its buffers grow with the first predictions
+SVMWorkspace * createSVMWorkspace(void);
+
+// Free a prediction workspace and its buffers
+void deleteSVMWorkspace(SVMWorkspace * ws);
+
+// Same as predictSVM with the buffers of ws (temporary ones if NULL). Allocates nothing once ws has held as
+// many test and library samples.
+void predictWorkspaceSVM(const SVM * svm, SVMWorkspace * ws, const gsl_matrix * xTest, gsl_vector * y);
+
+// Same as predictWorkspaceSVM for a single Gaussian model within tolerance (absolute) of the exact prediction,
+// with the Improved Fast Gauss Transform: about O(M + N) for M queries and N library samples instead of O(M N).
+// The clustering of the library is kept in ws until the model version changes. Falls back to the direct sum when
+// the clustering or the expansions would not be cheaper. Returns -1 for the other models.
+int predictFastGaussSVM(const SVM * svm, SVMWorkspace * ws, const gsl_matrix * xTest, double tolerance,
+						gsl_vector * y);
+
+// Start a pool of prediction threads (nbThreads - 1 workers besides the calling thread), 0 for one per core.
+// The pool keeps the threads that could be started if the system refuses some.
+PredictPool * createPredictPool(int nbThreads);
+
+// Stop the workers and free the pool
+void deletePredictPool(PredictPool * pool);
+
+// Same as predictSVM with the test samples split between the threads of the pool (NULL for the calling thread
+// only). Batches smaller than PARALLEL_MIN_ROWS samples per thread are predicted by the calling thread alone.
+void predictParallelSVM(const SVM * svm, PredictPool * pool, const gsl_matrix * xTest, gsl_vector * y);
+
+// Allocate a kernel row cache holding at most cacheSize MB (and never less than two rows)
+KernelCache * createKernelCache(const gsl_matrix * xTrain, const KernelFunctions * kernel, double sigma, double cacheSize);
+
+// Free a kernel row cache and all its rows
+void deleteKernelCache(KernelCache * cache);
+
+// Return the kernel row of sample i, computing it (and evicting the least recently used rows) if needed
+const double * getKernelRow(KernelCache * cache, int i);
+
+// Train an epsilon-insensitive SVR with SMO (second order working set selection and shrinking).
+// Returns the number of support vectors; alpha is filled with zeros for all the other samples.
+int trainEpsilonSVR(const gsl_matrix * xTrain, const gsl_vector * y, int kernel, double * C, double * sigma,
+					double epsilon, double cacheSize, gsl_vector * alpha, double * b);
+
+// Set the default parameters of an empty model
+void initSVM(SVM * svm);
+
+// Free the library, the coefficients and the sub-models of a model
+void deleteSVM(SVM * svm);
+
+// Return 1 if the model can be used for prediction
+int isTrainedSVM(const SVM * svm);
+
+// Train the model with the trainer selected by its parameters. Returns -1 if the model or one of its sub-models
+// could not be trained.
+int trainSVM(SVM * svm);
+
+// Split the library in svm->nbModels partitions and train one sub-model per partition in parallel
+int trainEnsembleSVM(SVM * svm);
+
+// Cluster the library on the covariates with k-means in svm->nbModels clusters and train one sub-model per
+// cluster in parallel
+int trainClusteredSVM(SVM * svm);
+
+// Fill members with the clusters of a (normalized) sample, i.e. the clusters closer than (1 + overlap) times
+// the nearest one, and return their number
+int clusterMembership(const SVM * svm, const double * feat, int * members);
+
+// Return the number of clusters (1 or 2) answering a (normalized) query, their indices and blending weights
+int routeQuery(const SVM * svm, const double * feat, int route[2], double weight[2]);
+
+// Save a trained model (including its library and sub-models) to a text file
+int saveSVM(const SVM * svm, const char * filename);
+
+// Load a model saved by saveSVM
+int loadSVM(SVM * svm, const char * filename);
+
+// Ridge trainer factorizing K + I / C with Cholesky and keeping the factor in svm->chol.
+// Returns -1 (svm->chol is then NULL) if K + I / C is not numerically positive definite.
+int trainCholeskySVM(SVM * svm);
+
+// Ridge trainer for several targets (the columns of y) on the same samples: K + I / C is factorized once and all
+// the columns of alpha are solved together with triangular matrix solves. Sample weights as in SVM (or NULL). Returns -1 if K + I / C is not
+// numerically positive definite.
+int trainMultiKernelSVM(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * weights,
+						const gsl_matrix * y, double * C, double * sigma, gsl_matrix * alpha);
+
+// Train svm->nbBootstrap residual bootstrap replicates of a trained single ridge model, reusing its Cholesky
+// factor if it has one. Called by trainSVM when svm->nbBootstrap > 0. Returns -1 for other models, and for the
+// solvers other than SOLVER_CHOLESKY which leave no factor (HODLR, sparse and sharded).
+int trainBootstrapSVM(SVM * svm);
+
+// Predict with a bootstrapped model: y the model prediction, lower and upper the bounds of the prediction
+// interval of the given level (e.g. 0.9) from the bootstrap replicates. Returns -1 without bootstrap.
+int predictIntervalSVM(const SVM * svm, const gsl_matrix * xTest, double level, gsl_vector * y, gsl_vector * lower,
+					   gsl_vector * upper);
+
+// Greedy kernel herding: select at most maxSize samples of x whose empirical kernel mean embedding approaches the
+// one of all the samples, stopping once their maximum mean discrepancy drops below tolerance. O(N^2) kernel
+// evaluations and O(N) memory. Fills selected and returns the number of samples selected.
+int selectCoreset(const KernelFunctions * kernel, const gsl_matrix * x, double sigma, int maxSize, double tolerance,
+				  int * selected);
+
+// Replace the library of an untrained single model by a weighted coreset (selectCoreset) of at most maxSize
+// samples. Each sample of the library is represented by its most similar coreset sample, which gets the total
+// weight and the mean concentration of the samples it represents. Returns the size of the coreset.
+int reduceSVMLibrary(SVM * svm, int maxSize, double tolerance);
+
+// Ridge trainer (same as trainKernelSVM) solving K + I / C with a HODLR factorization in about O(N log^2 N).
+// The off-diagonal blocks are compressed to the given relative tolerance. Returns -1 if a diagonal block is not
+// numerically positive definite or an off-diagonal block needs a rank above HODLR_MAX_RANK.
+int trainHODLRSVM(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * y, double * C,
+				  double * sigma, double tolerance, gsl_vector * alpha);
+
+// Ridge trainer (same as trainKernelSVM) spread over nbWorkers processes (0 for one per core). The library
+// lives in a POSIX shared memory segment, each process builds the kernel rows of its block and the system is
+// solved by conjugate gradient to the given relative residual, the processes meeting at shared barriers.
+// Returns -1 if the workers could not be started, one of them failed or died, or the residual did not reach the
+// tolerance in N iterations.
+int trainShardedSVM(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * y, double * C,
+					double * sigma, int nbWorkers, double tolerance, gsl_vector * alpha);
+
+// Index the samples x (at most NB_FEATURES features) on a grid of the given cell size. Returns NULL on error.
+CellIndex * createCellIndex(const gsl_matrix * x, double cellSize);
+
+// Free a grid index
+void deleteCellIndex(CellIndex * index);
+
+// Fill neighbors with the indexed samples closer than the cell size to point and return their number
+int findCellNeighbors(const CellIndex * index, const double * point, int * neighbors);
+
+// Build a k-d tree over the library samples x with their coefficients alpha. Returns NULL on error.
+KDTree * createKDTree(const gsl_matrix * x, const gsl_vector * alpha);
+
+// Free a k-d tree
+void deleteKDTree(KDTree * tree);
+
+// Gaussian sum sum_i alpha(i) * exp(scale * |point - x_i|^2) over the samples of the tree within maxError of the
+// exact one: nodes whose bound fits in their share of the error budget are skipped (exponentials one of
+// precisionType)
+double kdTreeGaussian(const KDTree * tree, const double * point, double scale, double maxError, int precision);
+
+// Set the error allowed to the Gaussian predictions of a model and its sub-models, building their k-d trees if it
+// is positive and freeing them if it is 0. Returns -1 if pruning is negative.
+int setSVMPruning(SVM * svm, double pruning);
+
+// Ridge trainer (same as trainKernelSVM) for compactly supported kernels: only the pairs closer than sigma are
+// evaluated, the samples are ordered by reverse Cuthill-McKee and K + I / C is factorized inside its envelope.
+// Returns -1 if the kernel is not compactly supported or K + I / C not numerically positive definite.
+int trainSparseSVM(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * y, double * C,
+				   double * sigma, gsl_vector * alpha);
+
+// Replace the library sample r by the (normalized) features feat and concentration y and update the model.
+// With a Cholesky factor this is a symmetric rank 2 update of the factor in O(N^2), otherwise a full retraining.
+// Returns -1 if the retraining failed.
+int updateSVMSample(SVM * svm, int r, const double * feat, double y);
+
+// Queue the replacement of the library sample r without retraining (replaces a pending change of the same sample).
+// The model keeps predicting from the previous library until flushSVM.
+int queueSVMSample(SVM * svm, int r, const double * feat, double y);
+
+// Apply the queued replacements and retrain once if the model is dirty: rank 2 updates of the Cholesky factor if
+// only a few samples changed, otherwise a full retraining (only the affected sub-models of an ensemble or clusters).
+// Returns -1 if the retraining failed; the model then stays dirty and the next flush retrains it whole.
+int flushSVM(SVM * svm);
+
+// Deep copy of a model (including its sub-models and pending changes) into an uninitialized dest
+int copySVM(SVM * dest, const SVM * src);
+
+// Return predicted concentrations for certain time (flushes the pending library changes first)
+int predictN(double start, double stop, int n, const Patient * p, float dose, SVM * svm, gsl_vector * out);
+
+// Same as predictN with the buffers of ws and without the traces: allocates nothing if the model is clean
+int predictWorkspaceN(double start, double stop, int n, const Patient * p, float dose, SVM * svm, SVMWorkspace * ws,
+					  gsl_vector * out);
+
+// Precompute the time curve of p after dose for a single Gaussian model. The curve must be zero-initialized or
+// prepared before (its buffers are then reused). Returns -1 for the other models.
+int prepareTimeCurve(const SVM * svm, const Patient * p, float dose, TimeCurve * curve);
+
+// Predict a prepared curve at n times from start to stop (a single time is start), e.g. for another time window.
+// Costs one exp per time and library sample. Returns -1 if the model was retrained since prepareTimeCurve.
+int predictTimeCurve(const TimeCurve * curve, const SVM * svm, double start, double stop, int n, gsl_vector * out);
+
+// Free the buffers of a time curve
+void deleteTimeCurve(TimeCurve * curve);
+
+// Times from start to stop (increasing) at which a prepared curve crosses threshold, found by safeguarded Newton
+// iterations on the analytic curve and its time derivative. At most maxTimes are stored; returns the number of
+// crossings, -1 if the model was retrained since prepareTimeCurve.
+int thresholdTimeCurve(const TimeCurve * curve, const SVM * svm, double start, double stop, double threshold,
+					   double * times, int maxTimes);
+
+// Largest concentration cmax of a prepared curve from start to stop and its time tmax (a root of the derivative
+// or a bound of the range). Returns -1 if the model was retrained since prepareTimeCurve.
+int peakTimeCurve(const TimeCurve * curve, const SVM * svm, double start, double stop, double * tmax, double * cmax);
+
+// Same as predictN without the traces, the times being split between the threads of the pool
+int predictParallelN(double start, double stop, int n, const Patient * p, float dose, SVM * svm, PredictPool * pool,
+					 gsl_vector * out);
+
+// Predict the concentrations of nbQueries queries in one batch (split between the threads of the pool if not
+// NULL). offsets (nbQueries + 1 entries) is filled with the position of each curve in out: query q is predicted
+// in out[offsets[q]] ... out[offsets[q + 1] - 1]. Returns -1 if a query is invalid or out is too small.
+int predictBatchN(const PredictQuery * queries, int nbQueries, SVM * svm, PredictPool * pool, int * offsets,
+				  gsl_vector * out);
+
+// Same as predictBatchN for every patient of a database at its measurement times and doses
+int predictDatabase(const Database * db, SVM * svm, PredictPool * pool, int * offsets, gsl_vector * out);
+
+// Set the default window: [750, 1500] from 1 to 24 hours (24 times), doses from 100 to 1000
+void initDoseWindow(DoseWindow * window);
+
+// Find the range [doses[0], doses[1]] of doses of p whose predicted curve stays inside the window. The doses are
+// bracketed on DOSE_CANDIDATES + 1 evenly spaced candidates, and the bounds of the widest qualifying run of
+// candidates are refined by bisection. For a single Gaussian model the time and covariate factors are computed
+// once, so that a candidate costs one exp per library sample. Returns 1 if no candidate qualifies (both doses are
+// then the candidate closest to the window), -1 on error.
+int optimizeDose(const DoseWindow * window, const Patient * p, SVM * svm, double doses[2]);
+
+// Create a prediction cache holding up to capacity curves (at least one per shard). Returns NULL on error.
+PredictCache * createPredictCache(int capacity);
+
+// Free a prediction cache
+void deletePredictCache(PredictCache * cache);
+
+// Drop every cached curve (the counters are kept)
+void clearPredictCache(PredictCache * cache);
+
+// Same as predictWorkspaceN (ws may be NULL), answered from the cache when the same quantized query was predicted
+// with the same model version. Safe to call from several threads with their own workspaces once svm is clean.
+int predictCachedN(double start, double stop, int n, const Patient * p, float dose, SVM * svm, PredictCache * cache,
+				   SVMWorkspace * ws, gsl_vector * out);
+
+// Set the ranges of a surrogate to the ones of the library of a trained model, with the default resolution
+// (up to 64 times, 32 doses and 16 values of the other covariates) and tolerance (1%)
+void initSurrogate(Surrogate * surrogate, const SVM * svm);
 
-// Find the "least-relevent" patient and update the training library
+// Refine the knots of every axis until the midpoints of the intervals are interpolated within the tolerance (or
+// the axis has maxKnots knots), then tabulate the model on the grid
+int buildSurrogate(Surrogate * surrogate, SVM * svm);
+
+// Interpolated concentration of p at time after dose
+double predictSurrogate(const Surrogate * surrogate, double time, double dose, const Patient * p);
+
+// Compare the surrogate to the exact prediction at nbPoints random points of its ranges and print a report.
+// errors is filled with the largest absolute error and the same relative to the largest prediction.
+int validateSurrogate(const Surrogate * surrogate, SVM * svm, int nbPoints, double errors[2]);
+
+// Save the table of a surrogate in a binary file
+int saveSurrogate(const Surrogate * surrogate, const char * filename);
+
+// Map the table of a file saved by saveSurrogate (read only, shared with the other processes mapping it)
+int loadSurrogate(Surrogate * surrogate, const char * filename);
+
+// Free (or unmap) the table of a surrogate
+void deleteSurrogate(Surrogate * surrogate);
+
+// Find the "least-relevent" patient and queue its replacement in the training library
 int leastRelevent(SVM * svm, const Patient * p);
 
+// Start the background retraining of a trained model. The structure svm must outlive the live model, which
+// takes over its contents. Returns NULL on error.
+LiveSVM * createLiveSVM(SVM * svm);
+
+// Stop the worker once it published the queued replacements (given up if the memory lacks to copy the published
+// model) and free both models. No reader may hold a model.
+void deleteLiveSVM(LiveSVM * live);
+
+// Enter a read-side critical section and return the published model. Never blocks; token must be passed
+// to releaseLiveSVM, and the model must not be used after it.
+const SVM * acquireLiveSVM(LiveSVM * live, unsigned * token);
+
+// Leave the read-side critical section entered with the given token
+void releaseLiveSVM(LiveSVM * live, unsigned token);
+
+// predictWorkspaceN on the published model, never waiting for a retraining (ws may be NULL)
+int predictLiveN(double start, double stop, int n, const Patient * p, float dose, LiveSVM * live, SVMWorkspace * ws,
+				 gsl_vector * out);
+
+// leastRelevent on the published model; the replacement is retrained and published in the background
+int leastReleventLive(LiveSVM * live, const Patient * p);
+
+// Wait until every queued replacement is published
+void syncLiveSVM(LiveSVM * live);
+
 int main (int argc, const char * argv[]) {
 	
 	if (argc < 3) {
@@ -94,19 +787,16 @@ int main (int argc, const char * argv[]) {
 	for (int i = 0; i < dbtest.size; ++i)
 		nbSamplesTest += dbtest.patients[i].size;
 	
-	gsl_matrix * trainFeat = gsl_matrix_alloc(nbSamplesTrain, 5);
-	gsl_matrix * testFeat = gsl_matrix_alloc(nbSamplesTest, 5);
+	gsl_matrix * trainFeat = gsl_matrix_alloc(nbSamplesTrain, NB_FEATURES);
+	gsl_matrix * testFeat = gsl_matrix_alloc(nbSamplesTest, NB_FEATURES);
 	
 	float * x = malloc(nbSamplesTrain * sizeof(float));
 	float * y = malloc(nbSamplesTrain * sizeof(float));
 	
 	for (int i = 0, j = 0; i < dbtrain.size; ++i) {
 		for (int k = 0; k < dbtrain.patients[i].size; ++k, ++j) {
-			gsl_matrix_set(trainFeat, j, 0, dbtrain.patients[i].times[k]);
-			gsl_matrix_set(trainFeat, j, 1, dbtrain.patients[i].doses[k]);
-			gsl_matrix_set(trainFeat, j, 2, dbtrain.patients[i].sex);
-			gsl_matrix_set(trainFeat, j, 3, dbtrain.patients[i].age);
-			gsl_matrix_set(trainFeat, j, 4, dbtrain.patients[i].weight);
+			sampleFeatures(&dbtrain.patients[i], dbtrain.patients[i].times[k], dbtrain.patients[i].doses[k],
+						   gsl_matrix_ptr(trainFeat, j, 0));
 			
 			x[j] = dbtrain.patients[i].times[k];
 			y[j] = dbtrain.patients[i].concentrations[k];
@@ -115,12 +805,9 @@ int main (int argc, const char * argv[]) {
 	
 	for (int i = 0, j = 0; i < dbtest.size; ++i) {
 		for (int k = 0; k < dbtest.patients[i].size; ++k, ++j) {
-			gsl_matrix_set(testFeat, j, 0, dbtest.patients[i].times[k]);
-			//gsl_matrix_set(testFeat, j, 0, 24);
-			gsl_matrix_set(testFeat, j, 1, dbtest.patients[i].doses[k]);
-			gsl_matrix_set(testFeat, j, 2, dbtest.patients[i].sex);
-			gsl_matrix_set(testFeat, j, 3, dbtest.patients[i].age);
-			gsl_matrix_set(testFeat, j, 4, dbtest.patients[i].weight);
+			sampleFeatures(&dbtest.patients[i], dbtest.patients[i].times[k], dbtest.patients[i].doses[k],
+						   gsl_matrix_ptr(testFeat, j, 0));
+			//gsl_matrix_set(testFeat, j, FEATURE_TIME, 24);
 		}
 	}
 	
@@ -132,16 +819,17 @@ int main (int argc, const char * argv[]) {
 	printf("# inliners = %d / %d, alpha = %f %f %f\n", nbInliners, nbSamplesTrain, alpha[0], alpha[1], alpha[2]);
 	
 	for (int i = 0; i < nbInliners; ++i)
-		for (int j = 0; j < 5; ++j)
+		for (int j = 0; j < NB_FEATURES; ++j)
 			gsl_matrix_set(trainFeat, i, j, gsl_matrix_get(trainFeat, inliners[i], j));
 	
 	trainFeat->size1 = nbInliners;
 	nbSamplesTrain = trainFeat->size1;
 	
 	SVM svm;
+	initSVM(&svm);
 	
 	// Normalize the trainFeat matrix
-	for (int i = 0; i < 5; ++i) {
+	for (int i = 0; i < NB_FEATURES; ++i) {
 		float mean=0;
 		float std=0;
 		
@@ -171,17 +859,17 @@ int main (int argc, const char * argv[]) {
 	}
 	/*
 	printf("First training line:");
-	for (int j = 0; j < 5; ++j)
+	for (int j = 0; j < NB_FEATURES; ++j)
 		printf(" %f", gsl_matrix_get(trainFeat, 0, j));
 	printf("\n");
 	
 	printf("First testing line:");
-	for (int j = 0; j < 5; ++j)
+	for (int j = 0; j < NB_FEATURES; ++j)
 		printf(" %f", gsl_matrix_get(testFeat, 0, j));
 	printf("\n");
 	
 	printf("Second testing line:");
-	for (int j = 0; j < 5; ++j)
+	for (int j = 0; j < NB_FEATURES; ++j)
 		printf(" %f", gsl_matrix_get(testFeat, 1, j));
 	printf("\n");*/
 	
@@ -195,10 +883,17 @@ int main (int argc, const char * argv[]) {
 	for (int j = 0; j < nbSamplesTrain; ++j)
 		gsl_vector_set(svm.trainY, j, y[inliners[j]]);
 	
+	svm.kernel = KERNEL_GAUSSIAN;
 	svm.C = 1;
 	svm.sigma = 1;
+	svm.epsilon = 0; // > 0 trains a sparse epsilon-SVR with SMO instead of the ridge solve
+	svm.type = SVM_SINGLE; // SVM_ENSEMBLE or SVM_CLUSTERED train svm.nbModels sub-models in parallel
+	svm.nbModels = 4;
 	
-	trainGaussianSVM(svm.trainFeat, svm.trainY, &svm.C, &svm.sigma, svm.alpha);
+	if (trainSVM(&svm)) {
+		fprintf(stderr, "Could not train the model.\n");
+		return EXIT_FAILURE;
+	}
     
     
     ////////////////////////////// predictN() //////////////////////////////////////////////////////
@@ -262,11 +957,9 @@ int main (int argc, const char * argv[]) {
 	
 	
 	// free
-	gsl_vector_free(svm.trainY);
-	gsl_vector_free(svm.alpha);
+	deleteSVM(&svm);
 	gsl_vector_free(signal);
 	//gsl_vector_free(out);
-	gsl_matrix_free(trainFeat);
 	gsl_matrix_free(testFeat);
 	free(x);
 	free(y);
@@ -299,7 +992,7 @@ void deletePatient(Patient * p)
 Database readDatabase(const char * filename)
 {
 	Database db = {NULL, 0};
-	Patient p = {-1, NULL, NULL, NULL, 0, 0, 0, 0};
+	Patient p = {-1, NULL, NULL, NULL, 0};
 	FILE * file = fopen(filename, "r");
 	
 	if (file == NULL) {
@@ -313,10 +1006,13 @@ Database readDatabase(const char * filename)
 		float concentration;
 		float time;
 		float dose;
-		float sex;
-		float age;
-		float weight;
-		fscanf(file, "%d %f %f %f %f %f %f\n", &num, &concentration, &time, &dose, &sex, &age, &weight);
+		float covariates[NB_COVARIATES];
+		fscanf(file, "%d %f %f %f", &num, &concentration, &time, &dose);
+		
+		for (int c = 0; c < NB_COVARIATES; ++c)
+			fscanf(file, "%f", &covariates[c]);
+		
+		fscanf(file, "\n");
 		
 		if (!ferror(file)) {
 			if (num == p.num) { // Still the same patient
@@ -342,9 +1038,11 @@ Database readDatabase(const char * filename)
 				p.concentrations[0] = concentration;
 				p.times[0] = time;
 				p.doses[0] = dose;
-				p.sex = sex;
-				p.age = age;
-				p.weight = weight;
+				
+				int c = 0;
+#define READ_COVARIATE(name) p.name = covariates[c++];
+				PATIENT_COVARIATES(READ_COVARIATE)
+#undef READ_COVARIATE
 			}
 		}
 	}
@@ -378,8 +1076,11 @@ void printDatabase(const Database * db)
 	int i, j;
 	
 	for (i = 0; i < db->size; ++i) {
-		printf("Patient %d: sex %f, age %f, weight %f\n    concentrations:", db->patients[i].num,
-			   db->patients[i].sex, db->patients[i].age, db->patients[i].weight);
+		printf("Patient %d:", db->patients[i].num);
+#define PRINT_COVARIATE(name) printf(" " #name " %f,", db->patients[i].name);
+		PATIENT_COVARIATES(PRINT_COVARIATE)
+#undef PRINT_COVARIATE
+		printf("\n    concentrations:");
 		
 		for (j = 0; j < db->patients[i].size; ++j)
 			printf(" %f", db->patients[i].concentrations[j]);
@@ -398,6 +1099,24 @@ void printDatabase(const Database * db)
 	}
 }
 
+void sampleFeatures(const Patient * p, double time, double dose, double * feat)
+{
+	int c = FEATURE_COVARIATES;
+	
+	feat[FEATURE_TIME] = time;
+	feat[FEATURE_DOSE] = dose;
+	
+#define SET_COVARIATE(name) feat[c++] = p->name;
+	PATIENT_COVARIATES(SET_COVARIATE)
+#undef SET_COVARIATE
+}
+
+void normalizeFeatures(const SVM * svm, double * feat)
+{
+	for (int i = 0; i < NB_FEATURES; ++i)
+		feat[i] = (feat[i] - svm->means[i]) / svm->stds[i];
+}
+
 int ransac(const float * x, const float * y, int size, float threshold, int k, float * alpha, int * inliners)
 {
 	gsl_multifit_linear_workspace * work = gsl_multifit_linear_alloc(k, 3); // Required by GSL
@@ -482,110 +1201,298 @@ int ransac(const float * x, const float * y, int size, float threshold, int k, f
 }
 
 
-void predictGaussianSVM(const gsl_matrix * xTrain, const gsl_matrix * xTest, const gsl_vector * alpha, double sigma, gsl_vector * y)
+// Polynomial exp: exp(x) = 2^n * exp(r) with n = round(x / log(2)) and |r| <= log(2) / 2 (log(2) split in two
+// parts so that r is exact), exp(r) by its Taylor series to degree 12. The relative error is below
+// FAST_EXP_MAX_ERROR over [-708, 709] (measured against exp() on 10^8 points); exp(x) = 0 below -708.
+#define FAST_EXP_MAX_ERROR 5e-16 // About 2 ulp
+#define FAST_EXP_MIN -708.0
+#define FAST_EXP_SHIFT 0x1.8p52 // Adding it rounds to an integer held by the low bits of the mantissa
+#define FAST_EXP_LOG2E 1.4426950408889634
+#define FAST_EXP_LN2_HI 6.93147180369123816490e-01
+#define FAST_EXP_LN2_LO 1.90821492927058770002e-10
+#define FAST_EXP_POLYNOMIAL(r) (1.0 + (r) * (1.0 + (r) * (1.0 / 2 + (r) * (1.0 / 6 + (r) * (1.0 / 24 + \
+	(r) * (1.0 / 120 + (r) * (1.0 / 720 + (r) * (1.0 / 5040 + (r) * (1.0 / 40320 + (r) * (1.0 / 362880 + \
+	(r) * (1.0 / 3628800 + (r) * (1.0 / 39916800 + (r) * (1.0 / 479001600)))))))))))))
+
+static inline double fastExp(double x)
 {
-	gsl_vector * xTrain2 = gsl_vector_calloc(xTrain->size1);
-	gsl_matrix * kernel = gsl_matrix_alloc(xTest->size1, xTrain->size1);
+	union { double d; unsigned long long u; } k, scale;
 	
-	int i, j;
+	if (x < FAST_EXP_MIN)
+		return 0.0;
 	
-	assert(xTrain->size2 == xTest->size2); // Same number of features
+	k.d = x * FAST_EXP_LOG2E + FAST_EXP_SHIFT;
+	
+	double n = k.d - FAST_EXP_SHIFT;
+	double r = x - n * FAST_EXP_LN2_HI - n * FAST_EXP_LN2_LO;
+	
+	// Matlab: scale = 2^n;
+	scale.u = (k.u + 1023) << 52;
 	
-	// Matlab: Xtrain2 = sum(Xtrain.^2, 2);
-	for (i = 0; i < xTrain->size1; ++i) {
+	return FAST_EXP_POLYNOMIAL(r) * scale.d;
+}
+
+// Sum of alpha(j) * exp(scale * (x2 + norms(j) - 2 * x * train(j,:)')) over the library samples [begin, end),
+// the library being stored in feature-major order with a leading dimension ld
+typedef double (* GaussianSum)(const double * x, double x2, const double * trainT, int ld, int dim,
+							   const double * norms, const double * alpha, int begin, int end, double scale);
+
+static inline double gaussianSumScalar(const double * x, double x2, const double * trainT, int ld, int dim,
+									   const double * norms, const double * alpha, int begin, int end, double scale,
+									   int exact)
+{
+	double sum = 0.0;
+	
+	for (int j = begin; j < end; ++j) {
 		double dot = 0.0;
-		gsl_vector_const_view row = gsl_matrix_const_row(xTrain, i);
-		gsl_blas_ddot(&row.vector, &row.vector, &dot);
-		gsl_vector_set(xTrain2, i, dot);
+		
+		for (int k = 0; k < dim; ++k)
+			dot += x[k] * trainT[(size_t) k * ld + j];
+		
+		double t = (x2 + norms[j] - 2.0 * dot) * scale;
+		sum += alpha[j] * (exact ? exp(t) : fastExp(t));
 	}
 	
-	// Matlab: Xtest2 = sum(Xtest.^2, 2);
-	for (i = 0; i < xTest->size1; ++i) {
-		double dot = 0.0;
-		gsl_vector_const_view row = gsl_matrix_const_row(xTest, i);
-		gsl_blas_ddot(&row.vector, &row.vector, &dot);
+	return sum;
+}
+
+static double gaussianSumScalarExact(const double * x, double x2, const double * trainT, int ld, int dim,
+									 const double * norms, const double * alpha, int begin, int end, double scale)
+{
+	return gaussianSumScalar(x, x2, trainT, ld, dim, norms, alpha, begin, end, scale, 1);
+}
+
+static double gaussianSumScalarFast(const double * x, double x2, const double * trainT, int ld, int dim,
+									const double * norms, const double * alpha, int begin, int end, double scale)
+{
+	return gaussianSumScalar(x, x2, trainT, ld, dim, norms, alpha, begin, end, scale, 0);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS 1
+
+// Instantiate the Gaussian sums for WIDTH doubles per vector, compiled for the TARGET instruction set with the
+// vector extensions of GCC and Clang. The exact ones vectorize the distances only.
+#define DEFINE_GAUSSIAN_SUM(NAME, TARGET, WIDTH) \
+typedef double NAME##Vector __attribute__((vector_size(8 * (WIDTH)))); \
+typedef long long NAME##Integer __attribute__((vector_size(8 * (WIDTH)))); \
+\
+__attribute__((target(TARGET))) static inline NAME##Vector NAME##Exp(NAME##Vector x) \
+{ \
+	NAME##Integer under = (x < FAST_EXP_MIN); \
+	NAME##Vector k = x * FAST_EXP_LOG2E + FAST_EXP_SHIFT; \
+	NAME##Vector n = k - FAST_EXP_SHIFT; \
+	NAME##Vector r = x - n * FAST_EXP_LN2_HI - n * FAST_EXP_LN2_LO; \
+	NAME##Vector e = FAST_EXP_POLYNOMIAL(r) * (NAME##Vector) (((NAME##Integer) k + 1023) << 52); \
+	\
+	return (NAME##Vector) ((NAME##Integer) e & ~under); \
+} \
+\
+__attribute__((target(TARGET))) static inline double NAME##Sum(const double * x, double x2, const double * trainT, \
+															  int ld, int dim, const double * norms, \
+															  const double * alpha, int begin, int end, \
+															  double scale, int exact) \
+{ \
+	NAME##Vector acc = {0}; \
+	double sum = 0.0; \
+	int j = begin; \
+	\
+	for (; j + (WIDTH) <= end; j += (WIDTH)) { \
+		NAME##Vector dot = {0}, t, e; \
+		\
+		for (int k = 0; k < dim; ++k) { \
+			__builtin_memcpy(&t, trainT + (size_t) k * ld + j, sizeof(t)); \
+			dot += x[k] * t; \
+		} \
+		\
+		__builtin_memcpy(&t, norms + j, sizeof(t)); \
+		t = (x2 + t - 2.0 * dot) * scale; \
+		\
+		if (exact) { \
+			for (int l = 0; l < (WIDTH); ++l) \
+				e[l] = exp(t[l]); \
+		} \
+		else { \
+			e = NAME##Exp(t); \
+		} \
+		\
+		__builtin_memcpy(&t, alpha + j, sizeof(t)); \
+		acc += t * e; \
+	} \
+	\
+	for (int l = 0; l < (WIDTH); ++l) \
+		sum += acc[l]; \
+	\
+	return sum + gaussianSumScalar(x, x2, trainT, ld, dim, norms, alpha, j, end, scale, exact); \
+} \
+\
+__attribute__((target(TARGET))) static double NAME##Exact(const double * x, double x2, const double * trainT, \
+														 int ld, int dim, const double * norms, \
+														 const double * alpha, int begin, int end, double scale) \
+{ \
+	return NAME##Sum(x, x2, trainT, ld, dim, norms, alpha, begin, end, scale, 1); \
+} \
+\
+__attribute__((target(TARGET))) static double NAME##Fast(const double * x, double x2, const double * trainT, \
+														int ld, int dim, const double * norms, \
+														const double * alpha, int begin, int end, double scale) \
+{ \
+	return NAME##Sum(x, x2, trainT, ld, dim, norms, alpha, begin, end, scale, 0); \
+}
+
+DEFINE_GAUSSIAN_SUM(gaussianSumSSE42, "sse4.2", 2)
+DEFINE_GAUSSIAN_SUM(gaussianSumAVX2, "avx2,fma", 4)
+DEFINE_GAUSSIAN_SUM(gaussianSumAVX512, "avx512f", 8)
+#endif
+
+// Gaussian sums of each instruction set (isaType), exact and fast (precisionType)
+static const GaussianSum gaussianSums[][2] = {
+	{gaussianSumScalarExact, gaussianSumScalarFast},
+#ifdef X86_KERNELS
+	{gaussianSumSSE42Exact, gaussianSumSSE42Fast},
+	{gaussianSumAVX2Exact, gaussianSumAVX2Fast},
+	{gaussianSumAVX512Exact, gaussianSumAVX512Fast}
+#endif
+};
+
+static int detectedISA = ISA_SCALAR;
+static pthread_once_t detectedISAOnce = PTHREAD_ONCE_INIT;
+
+static void detectISAOnce(void)
+{
+#ifdef X86_KERNELS
+	// The checks include the OS support of the wider registers (XGETBV)
+	__builtin_cpu_init();
+	
+	if (__builtin_cpu_supports("avx512f"))
+		detectedISA = ISA_AVX512;
+	else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		detectedISA = ISA_AVX2;
+	else if (__builtin_cpu_supports("sse4.2"))
+		detectedISA = ISA_SSE42;
+#endif
+}
+
+int detectISA(void)
+{
+	pthread_once(&detectedISAOnce, detectISAOnce);
+	
+	return detectedISA;
+}
+
+// Library samples streamed at once by the Gaussian predictor, with their norms and coefficients they fit in the
+// L1 cache and are reused by every test sample
+#define PREDICT_BLOCK 256
+
+// Matlab: y = exp(scale * D) * alpha; with D = repmat(Xtest2, [1 N]) + repmat(Xtrain2', [M 1]) - 2 * (Xtest * Xtrain')
+// computed, exponentiated and accumulated in one pass per block of the library, so that D is never stored. The
+// library (n samples) is given in feature-major order.
+static void streamGaussianPredict(const double * trainT, const double * trainNorms, const double * alpha, int n,
+								  int dim, const gsl_matrix * xTest, const double * testNorms, double scale,
+								  int precision, gsl_vector * y)
+{
+	const GaussianSum gaussianSum = gaussianSums[detectISA()][precision == PRECISION_FAST];
+	
+	gsl_vector_set_zero(y);
+	
+	for (int begin = 0; begin < n; begin += PREDICT_BLOCK) {
+		const int end = (begin + PREDICT_BLOCK < n) ? begin + PREDICT_BLOCK : n;
+		
+		for (int i = 0; i < xTest->size1; ++i)
+			*gsl_vector_ptr(y, i) += gaussianSum(gsl_matrix_const_ptr(xTest, i, 0), testNorms[i], trainT, n, dim,
+												 trainNorms, alpha, begin, end, scale);
+	}
+}
+
+// Matlab: X2 = sum(X.^2, 2);
+static void squaredNorms(const gsl_matrix * x, double * norms)
+{
+	for (int i = 0; i < x->size1; ++i) {
+		gsl_vector_const_view row = gsl_matrix_const_row(x, i);
+		gsl_blas_ddot(&row.vector, &row.vector, &norms[i]);
+	}
+}
+
+// Matlab: xT = X(:); alphaT = alpha; with X in feature-major order
+static void featureMajor(const gsl_matrix * x, const gsl_vector * alpha, double * xT, double * alphaT)
+{
+	for (int i = 0; i < x->size1; ++i) {
+		for (int k = 0; k < x->size2; ++k)
+			xT[(size_t) k * x->size1 + i] = gsl_matrix_get(x, i, k);
 		
-		// Matlab: D = repmat(Xtest2, [1 N]) + repmat(Xtrain2', [M 1])
-		for (j = 0; j < xTrain->size1; ++j)
-			gsl_matrix_set(kernel, i, j, gsl_vector_get(xTrain2, j) + dot);
+		alphaT[i] = gsl_vector_get(alpha, i);
 	}
+}
+
+void predictGaussianSVM(const gsl_matrix * xTrain, const gsl_matrix * xTest, const gsl_vector * alpha, double sigma, gsl_vector * y)
+{
+	double * xTrain2 = malloc(xTrain->size1 * sizeof(double));
+	double * xTest2 = malloc(xTest->size1 * sizeof(double));
+	double * xTrainT = malloc(xTrain->size1 * xTrain->size2 * sizeof(double));
+	double * alphaT = malloc(xTrain->size1 * sizeof(double));
+	int i, j;
+	
+	assert(xTrain->size2 == xTest->size2); // Same number of features
 	
-	// Matlab: - 2 * (Xtest * Xtrain');
-	gsl_blas_dgemm(CblasNoTrans, CblasTrans,-2.0, xTest, xTrain, 1.0, kernel);
+	squaredNorms(xTrain, xTrain2);
+	squaredNorms(xTest, xTest2);
+	featureMajor(xTrain, alpha, xTrainT, alphaT);
 	
 	if (sigma <= 0.0) {
-		// Matlab: sigma = sqrt(1 / mean(mean(D)));
-		double sum = 0.0;
+		// Matlab: sigma = mean(mean(D)) = mean(Xtest2) + mean(Xtrain2) - 2 * mean(Xtest) * mean(Xtrain)'
+		sigma = 0.0;
 		
 		for (i = 0; i < xTest->size1; ++i)
-			for (j = 0; j < xTrain->size1; ++j)
-				sum += gsl_matrix_get(kernel, i, j);
+			sigma += xTest2[i] / xTest->size1;
 		
-		sigma = sum / (xTest->size1 * xTrain->size1);
+		for (i = 0; i < xTrain->size1; ++i)
+			sigma += xTrain2[i] / xTrain->size1;
+		
+		for (j = 0; j < xTrain->size2; ++j) {
+			double meanTest = 0.0, meanTrain = 0.0;
+			
+			for (i = 0; i < xTest->size1; ++i)
+				meanTest += gsl_matrix_get(xTest, i, j) / xTest->size1;
+			
+			for (i = 0; i < xTrain->size1; ++i)
+				meanTrain += gsl_matrix_get(xTrain, i, j) / xTrain->size1;
+			
+			sigma -= 2.0 * meanTest * meanTrain;
+		}
 	}
 	
-	// Matlab: K = exp(-D / (2 * sigma^2));
-	sigma =-1.0 / (2.0 * sigma * sigma);
-	
-	for (i = 0; i < xTest->size1; ++i)
-		for (j = 0; j < xTrain->size1; ++j)
-			gsl_matrix_set(kernel, i, j, exp(gsl_matrix_get(kernel, i, j) * sigma));
-	
-	// Matlab: y = K * alpha;
-	gsl_blas_dgemv(CblasNoTrans, 1.0, kernel, alpha, 0.0, y);
+	// Matlab: y = exp(-D / (2 * sigma^2)) * alpha;
+	streamGaussianPredict(xTrainT, xTrain2, alphaT, xTrain->size1, xTrain->size2, xTest, xTest2,
+						  -1.0 / (2.0 * sigma * sigma), PRECISION_EXACT, y);
 	
-	gsl_vector_free(xTrain2);
-	gsl_matrix_free(kernel);
+	free(xTrain2);
+	free(xTest2);
+	free(xTrainT);
+	free(alphaT);
 }
 
 void trainGaussianSVM(const gsl_matrix * xTrain, const gsl_vector * y, double * C, double * sigma, gsl_vector * alpha)
 {
-	gsl_matrix * kernel = gsl_matrix_calloc(xTrain->size1, xTrain->size1);
+	gsl_matrix * kernel = gsl_matrix_alloc(xTrain->size1, xTrain->size1);
 	gsl_multifit_linear_workspace * work = gsl_multifit_linear_alloc(xTrain->size1, xTrain->size1);
 	gsl_matrix * cov = gsl_matrix_alloc(xTrain->size1, xTrain->size1);
 	double chisq;
-	int i, j;
+	int i;
 	
 	assert(y->size == xTrain->size1);
 	
-	// Matlab: X2 = sum(X.^2, 2);
-	// Matlab: D = repmat(X2, [1 N]) + repmat(X2', [N 1])
-	for (i = 0; i < xTrain->size1; ++i) {
-		double dot = 0.0;
-		gsl_vector_const_view row = gsl_matrix_const_row(xTrain, i);
-		gsl_blas_ddot(&row.vector, &row.vector, &dot);
-		
-		for (j = 0; j < xTrain->size1; ++j) {
-			gsl_matrix_set(kernel, i, j, gsl_matrix_get(kernel, i, j) + dot);
-			gsl_matrix_set(kernel, j, i, gsl_matrix_get(kernel, j, i) + dot);
-		}
-	}
-	
-	// Matlab: - 2 * (X * X');
-	gsl_blas_dgemm(CblasNoTrans, CblasTrans,-2.0, xTrain, xTrain, 1.0, kernel);
-	
 	if (*C <= 0.0)
 		*C = 1000.0;
 	
-	if (*sigma <= 0.0) {
-		double sum = 0.0;
-		
-		for (i = 0; i < xTrain->size1; ++i)
-			for (j = 0; j < xTrain->size1; ++j)
-				sum += gsl_matrix_get(kernel, i, j);
-		
-		*sigma = sum / (xTrain->size1 * xTrain->size1);
-	}
+	// Matlab: sigma = mean(D(:));
+	if (*sigma <= 0.0)
+		*sigma = meanSquaredDistance(xTrain);
 	
-	double sigmaInv =-1.0 / (2.0 * (*sigma) * (*sigma));
-	double Cinv = 1.0 / *C;
+	// Matlab: K = exp(-D / (2 * sigma^2)) + I / C; built per patient (see buildKernelMatrix)
+	buildKernelMatrix(selectKernel(KERNEL_GAUSSIAN, xTrain->size2), xTrain, *sigma, kernel);
 	
-	for (i = 0; i < xTrain->size1; ++i) {
-		for (j = 0; j < xTrain->size1; ++j)
-			gsl_matrix_set(kernel, i, j, exp(gsl_matrix_get(kernel, i, j) * sigmaInv));
-		
-		gsl_matrix_set(kernel, i, i, gsl_matrix_get(kernel, i, i) + Cinv);
-	}
+	for (i = 0; i < xTrain->size1; ++i)
+		gsl_matrix_set(kernel, i, i, gsl_matrix_get(kernel, i, i) + 1.0 / *C);
 	
 	gsl_multifit_linear(kernel, y, alpha, cov, &chisq, work);
 	
@@ -594,74 +1501,6091 @@ void trainGaussianSVM(const gsl_matrix * xTrain, const gsl_vector * y, double *
 	gsl_matrix_free(cov);
 }
 
-int predictN(double start, double stop, int n, const Patient * p, float dose, const SVM * svm, gsl_vector * out)
+// Kernel profiles, as functions of the squared distance d2 and of a scale precomputed from sigma
+#define GAUSSIAN_SCALE(sigma) (-1.0 / (2.0 * (sigma) * (sigma)))
+#define GAUSSIAN_PROFILE(d2, scale) exp((d2) * (scale))
+#define LAPLACIAN_SCALE(sigma) (-1.0 / (sigma))
+#define LAPLACIAN_PROFILE(d2, scale) exp(sqrt(d2) * (scale))
+#define MATERN_SCALE(sigma) (sqrt(3.0) / (sigma))
+#define MATERN_PROFILE(d2, scale) ((1.0 + sqrt(d2) * (scale)) * exp(-sqrt(d2) * (scale)))
+#define WENDLAND_SCALE(sigma) (1.0 / ((sigma) * (sigma)))
+#define WENDLAND_PROFILE(d2, scale) wendlandProfile((d2) * (scale))
+
+// Matlab: r = sqrt(r2); k = max(1 - r, 0)^5 * (5 * r + 1);
+static inline double wendlandProfile(double r2)
 {
-	if ((start < 0) || (start >= stop) || (n < 1) || !p || !svm || !svm->trainFeat || !svm->alpha ||
-		(svm->trainFeat->size1 != svm->alpha->size) || (svm->sigma <= 0) || !out)
-		return -1;
+	if (r2 >= 1.0)
+		return 0.0;
 	
-	gsl_matrix * testFeat = gsl_matrix_alloc(n, 5);
-	
-	// Normalize the testFeat matrix
-	for (int j = 0; j < n; ++j)
-		gsl_matrix_set(testFeat, j, 0, (start + j * (stop - start) / (n-1) - svm->means[0]) / svm->stds[0]);
+	double r = sqrt(r2);
+	double u2 = (1.0 - r) * (1.0 - r);
 	
-	for (int j = 0; j < n; ++j)
-		gsl_matrix_set(testFeat, j, 1, (dose - svm->means[1]) / svm->stds[1]);
+	return u2 * u2 * (1.0 - r) * (5.0 * r + 1.0);
+}
+
+// Define the kernel functions NAME##Eval, NAME##Row and NAME##Predict of the kernel KIND for DIM features.
+// DIM must be a constant so that the distance loops get fully unrolled, or 0 to use the runtime dimension.
+#define DEFINE_KERNEL_FUNCTIONS(NAME, KIND, DIM) \
+static double NAME##Eval(const double * a, const double * b, int dim, double sigma) \
+{ \
+	double d2 = 0.0; \
+	\
+	for (int k = 0; k < ((DIM) ? (DIM) : dim); ++k) \
+		d2 += (a[k] - b[k]) * (a[k] - b[k]); \
+	\
+	return KIND##_PROFILE(d2, KIND##_SCALE(sigma)); \
+} \
+\
+static void NAME##Row(const double * x, const gsl_matrix * xTrain, double sigma, double * row) \
+{ \
+	const int dim = (DIM) ? (DIM) : xTrain->size2; \
+	const double scale = KIND##_SCALE(sigma); \
+	\
+	for (int j = 0; j < xTrain->size1; ++j) { \
+		const double * xj = gsl_matrix_const_ptr(xTrain, j, 0); \
+		double d2 = 0.0; \
+		\
+		for (int k = 0; k < dim; ++k) \
+			d2 += (x[k] - xj[k]) * (x[k] - xj[k]); \
+		\
+		row[j] = KIND##_PROFILE(d2, scale); \
+	} \
+} \
+\
+static void NAME##Predict(const gsl_matrix * xTrain, const gsl_matrix * xTest, const gsl_vector * alpha, \
+						  double sigma, gsl_vector * y) \
+{ \
+	const int dim = (DIM) ? (DIM) : xTrain->size2; \
+	const double scale = KIND##_SCALE(sigma); \
+	\
+	assert(xTrain->size2 == xTest->size2); \
+	\
+	for (int i = 0; i < xTest->size1; ++i) { \
+		const double * xi = gsl_matrix_const_ptr(xTest, i, 0); \
+		double sum = 0.0; \
+		\
+		for (int j = 0; j < xTrain->size1; ++j) { \
+			const double * xj = gsl_matrix_const_ptr(xTrain, j, 0); \
+			double d2 = 0.0; \
+			\
+			for (int k = 0; k < dim; ++k) \
+				d2 += (xi[k] - xj[k]) * (xi[k] - xj[k]); \
+			\
+			sum += gsl_vector_get(alpha, j) * KIND##_PROFILE(d2, scale); \
+		} \
+		\
+		gsl_vector_set(y, i, sum); \
+	} \
+}
+
+DEFINE_KERNEL_FUNCTIONS(gaussianFixed, GAUSSIAN, NB_FEATURES)
+DEFINE_KERNEL_FUNCTIONS(gaussianAny, GAUSSIAN, 0)
+DEFINE_KERNEL_FUNCTIONS(laplacianFixed, LAPLACIAN, NB_FEATURES)
+DEFINE_KERNEL_FUNCTIONS(laplacianAny, LAPLACIAN, 0)
+DEFINE_KERNEL_FUNCTIONS(maternFixed, MATERN, NB_FEATURES)
+DEFINE_KERNEL_FUNCTIONS(maternAny, MATERN, 0)
+DEFINE_KERNEL_FUNCTIONS(wendlandFixed, WENDLAND, NB_FEATURES)
+DEFINE_KERNEL_FUNCTIONS(wendlandAny, WENDLAND, 0)
+
+static const KernelFunctions kernelFunctions[] = {
+	{KERNEL_GAUSSIAN, NB_FEATURES, 0, gaussianFixedEval, gaussianFixedRow, gaussianFixedPredict},
+	{KERNEL_GAUSSIAN, 0, 0, gaussianAnyEval, gaussianAnyRow, gaussianAnyPredict},
+	{KERNEL_LAPLACIAN, NB_FEATURES, 0, laplacianFixedEval, laplacianFixedRow, laplacianFixedPredict},
+	{KERNEL_LAPLACIAN, 0, 0, laplacianAnyEval, laplacianAnyRow, laplacianAnyPredict},
+	{KERNEL_MATERN, NB_FEATURES, 0, maternFixedEval, maternFixedRow, maternFixedPredict},
+	{KERNEL_MATERN, 0, 0, maternAnyEval, maternAnyRow, maternAnyPredict},
+	{KERNEL_WENDLAND, NB_FEATURES, 1, wendlandFixedEval, wendlandFixedRow, wendlandFixedPredict},
+	{KERNEL_WENDLAND, 0, 1, wendlandAnyEval, wendlandAnyRow, wendlandAnyPredict}
+};
+
+const KernelFunctions * selectKernel(int type, int dim)
+{
+	const KernelFunctions * generic = NULL;
 	
-	for (int j = 0; j < n; ++j)
-		gsl_matrix_set(testFeat, j, 2, (p->sex - svm->means[2]) / svm->stds[2]);
+	for (int i = 0; i < sizeof(kernelFunctions) / sizeof(kernelFunctions[0]); ++i) {
+		if (kernelFunctions[i].type != type)
+			continue;
+		
+		if (kernelFunctions[i].dim == dim)
+			return &kernelFunctions[i];
+		
+		if (kernelFunctions[i].dim == 0)
+			generic = &kernelFunctions[i];
+	}
 	
-	for (int j = 0; j < n; ++j)
-		gsl_matrix_set(testFeat, j, 3, (p->age - svm->means[3]) / svm->stds[3]);
+	return generic;
+}
+
+double meanSquaredDistance(const gsl_matrix * x)
+{
+	// Matlab: mean(D(:)) = 2 * (mean(X2) - norm(mean(X))^2)
+	double sum2 = 0.0, norm = 0.0;
+	int i, j;
 	
-	for (int j = 0; j < n; ++j)
-		gsl_matrix_set(testFeat, j, 4, (p->weight - svm->means[4]) / svm->stds[4]);
+	for (i = 0; i < x->size1; ++i)
+		for (j = 0; j < x->size2; ++j)
+			sum2 += gsl_matrix_get(x, i, j) * gsl_matrix_get(x, i, j);
 	
-	printf("\nsigma: %f\n", svm->sigma);
+	for (j = 0; j < x->size2; ++j) {
+		double mean = 0.0;
+		
+		for (i = 0; i < x->size1; ++i)
+			mean += gsl_matrix_get(x, i, j);
+		
+		mean /= x->size1;
+		norm += mean * mean;
+	}
+	
+	return 2.0 * (sum2 / x->size1 - norm);
+}
+
+// Row of the library and its index, sorted to group the samples of a patient or to stratify the partitions on
+// the covariates
+struct stratumStruct {
+	const double * row;
+	int index;
+};
+
+static int compareCovariates(const void * a, const void * b)
+{
+	const struct stratumStruct * sa = a;
+	const struct stratumStruct * sb = b;
+	
+	for (int j = FEATURE_COVARIATES; j < NB_FEATURES; ++j)
+		if (sa->row[j] != sb->row[j])
+			return (sa->row[j] < sb->row[j]) ?-1 : 1;
+	
+	return 0;
+}
+
+static int compareTimeDose(const void * a, const void * b)
+{
+	const struct stratumStruct * sa = a;
+	const struct stratumStruct * sb = b;
+	
+	for (int j = FEATURE_TIME; j < FEATURE_COVARIATES; ++j)
+		if (sa->row[j] != sb->row[j])
+			return (sa->row[j] < sb->row[j]) ?-1 : 1;
+	
+	return 0;
+}
+
+// Number the groups of samples of x equal according to compare in group, fill first with the first sample of
+// each group and return the number of groups
+static int groupSamples(const gsl_matrix * x, int (* compare)(const void *, const void *), int * group, int * first)
+{
+	struct stratumStruct * rows = malloc(x->size1 * sizeof(struct stratumStruct));
+	int nbGroups = 0;
+	
+	for (int i = 0; i < x->size1; ++i) {
+		rows[i].row = gsl_matrix_const_ptr(x, i, 0);
+		rows[i].index = i;
+	}
+	
+	qsort(rows, x->size1, sizeof(struct stratumStruct), compare);
+	
+	for (int i = 0; i < x->size1; ++i) {
+		if ((i == 0) || compare(&rows[i - 1], &rows[i]))
+			first[nbGroups++] = rows[i].index;
+		
+		group[rows[i].index] = nbGroups - 1;
+	}
+	
+	free(rows);
+	
+	return nbGroups;
+}
+
+// Squared distance between two samples over the features [begin, end)
+static inline double partialDistance(const double * a, const double * b, int begin, int end)
+{
+	double d2 = 0.0;
+	
+	for (int j = begin; j < end; ++j)
+		d2 += (a[j] - b[j]) * (a[j] - b[j]);
+	
+	return d2;
+}
+
+// Matlab: F = exp(-D(first, first) / (2 * sigma^2)) over the features [begin, end), size x size row-major
+static void gaussianFactor(const gsl_matrix * x, const int * first, int size, int begin, int end, double scale,
+						   double * F)
+{
+	for (int a = 0; a < size; ++a) {
+		const double * xa = gsl_matrix_const_ptr(x, first[a], 0);
+		
+		F[a * size + a] = 1.0;
+		
+		for (int b = 0; b < a; ++b) {
+			double f = GAUSSIAN_PROFILE(partialDistance(xa, gsl_matrix_const_ptr(x, first[b], 0), begin, end), scale);
+			F[a * size + b] = f;
+			F[b * size + a] = f;
+		}
+	}
+}
+
+void buildKernelMatrix(const KernelFunctions * kernel, const gsl_matrix * xTrain, double sigma, gsl_matrix * K)
+{
+	const int n = xTrain->size1;
+	
+	assert((K->size1 == n) && (K->size2 == n));
+	
+	if ((kernel->type != KERNEL_GAUSSIAN) || (xTrain->size2 != NB_FEATURES)) {
+		for (int i = 0; i < n; ++i)
+			kernel->row(gsl_matrix_const_ptr(xTrain, i, 0), xTrain, sigma, gsl_matrix_ptr(K, i, 0));
+		
+		return;
+	}
+	
+	// exp(-|a - b|^2 / (2 * sigma^2)) = exp(-|a_cov - b_cov|^2 / (2 * sigma^2)) * exp(-|a_td - b_td|^2 / (2 * sigma^2))
+	const double scale = GAUSSIAN_SCALE(sigma);
+	int * patient = malloc(n * sizeof(int));
+	int * firstPatient = malloc(n * sizeof(int));
+	int * point = malloc(n * sizeof(int));
+	int * firstPoint = malloc(n * sizeof(int));
+	int nbPatients = groupSamples(xTrain, compareCovariates, patient, firstPatient);
+	int nbPoints = groupSamples(xTrain, compareTimeDose, point, firstPoint);
+	
+	// Tabulate the time/dose factor only if the (time, dose) pairs repeat enough (scheduled sampling times)
+	int tabulated = ((double) nbPoints * nbPoints <= 0.5 * (double) n * n);
+	double * Kcov = malloc((size_t) nbPatients * nbPatients * sizeof(double));
+	double * Ktd = tabulated ? malloc((size_t) nbPoints * nbPoints * sizeof(double)) : NULL;
+	
+	gaussianFactor(xTrain, firstPatient, nbPatients, FEATURE_COVARIATES, NB_FEATURES, scale, Kcov);
+	
+	if (tabulated)
+		gaussianFactor(xTrain, firstPoint, nbPoints, FEATURE_TIME, FEATURE_COVARIATES, scale, Ktd);
+	
+	// Matlab: K = Kcov(patient, patient) .* Ktd(point, point);
+	for (int i = 0; i < n; ++i) {
+		const double * xi = gsl_matrix_const_ptr(xTrain, i, 0);
+		const double * cov = Kcov + (size_t) patient[i] * nbPatients;
+		double * Ki = gsl_matrix_ptr(K, i, 0);
+		
+		Ki[i] = 1.0;
+		
+		for (int j = 0; j < i; ++j) {
+			double td = tabulated ? Ktd[(size_t) point[i] * nbPoints + point[j]] :
+						GAUSSIAN_PROFILE(partialDistance(xi, gsl_matrix_const_ptr(xTrain, j, 0), FEATURE_TIME,
+														 FEATURE_COVARIATES), scale);
+			
+			Ki[j] = cov[patient[j]] * td;
+			gsl_matrix_set(K, j, i, Ki[j]);
+		}
+	}
+	
+	free(patient);
+	free(firstPatient);
+	free(point);
+	free(firstPoint);
+	free(Kcov);
+	free(Ktd);
+}
+
+void trainKernelSVM(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * y, double * C,
+					double * sigma, gsl_vector * alpha)
+{
+	gsl_matrix * K = gsl_matrix_alloc(xTrain->size1, xTrain->size1);
+	gsl_multifit_linear_workspace * work = gsl_multifit_linear_alloc(xTrain->size1, xTrain->size1);
+	gsl_matrix * cov = gsl_matrix_alloc(xTrain->size1, xTrain->size1);
+	double chisq;
+	int i;
+	
+	assert(y->size == xTrain->size1);
+	
+	if (*C <= 0.0)
+		*C = 1000.0;
+	
+	if (*sigma <= 0.0)
+		*sigma = meanSquaredDistance(xTrain);
+	
+	// Matlab: K = kernel(X, X) + I / C;
+	buildKernelMatrix(kernel, xTrain, *sigma, K);
+	
+	for (i = 0; i < xTrain->size1; ++i)
+		gsl_matrix_set(K, i, i, gsl_matrix_get(K, i, i) + 1.0 / *C);
+	
+	gsl_multifit_linear(K, y, alpha, cov, &chisq, work);
+	
+	gsl_matrix_free(K);
+	gsl_multifit_linear_free(work);
+	gsl_matrix_free(cov);
+}
+
+void predictSVM(const SVM * svm, const gsl_matrix * xTest, gsl_vector * y)
+{
+	predictWorkspaceSVM(svm, NULL, xTest, y);
+}
+
+SVMWorkspace * createSVMWorkspace(void)
+{
+	return calloc(1, sizeof(SVMWorkspace));
+}
+
+// Free the buffers of a library cache and of the caches of its sub-models
+static void freeLibraryCache(struct libraryCacheStruct * library)
+{
+	for (int k = 0; k < library->nbModels; ++k)
+		freeLibraryCache(&library->models[k]);
+	
+	free(library->models);
+	free(library->norms);
+	free(library->trainT);
+	free(library->alpha);
+}
+
+// Caches of the nbModels sub-models of the model of library (created empty)
+static struct libraryCacheStruct * subLibraryCaches(struct libraryCacheStruct * library, int nbModels)
+{
+	if (library->nbModels < nbModels) {
+		library->models = realloc(library->models, nbModels * sizeof(struct libraryCacheStruct));
+		memset(library->models + library->nbModels, 0,
+			   (nbModels - library->nbModels) * sizeof(struct libraryCacheStruct));
+		library->nbModels = nbModels;
+	}
+	
+	return library->models;
+}
+
+// Free the buffers of the clustering of a fast Gauss transform
+static void freeGaussTransform(struct gaussTransformStruct * transform)
+{
+	free(transform->centers);
+	free(transform->radii);
+	free(transform->orders);
+	free(transform->coefficients);
+}
+
+// Free the buffers of a workspace
+static void freeWorkspaceBuffers(SVMWorkspace * ws)
+{
+	freeLibraryCache(&ws->library);
+	freeGaussTransform(&ws->transform);
+	free(ws->testNorms);
+	free(ws->testFeat);
+	free(ws->partial);
+	free(ws->neighbors);
+	deleteTimeCurve(&ws->curve);
+}
+
+void deleteSVMWorkspace(SVMWorkspace * ws)
+{
+	if (!ws)
+		return;
+	
+	freeWorkspaceBuffers(ws);
+	free(ws);
+}
+
+// Grow the buffers of a workspace to hold at least nbTest test and nbTrain library samples
+static void reserveSVMWorkspace(SVMWorkspace * ws, int nbTest, int nbTrain)
+{
+	if ((nbTest <= ws->testCapacity) && (nbTrain <= ws->trainCapacity))
+		return;
+	
+	if (nbTest < ws->testCapacity)
+		nbTest = ws->testCapacity;
+	
+	if (nbTrain < ws->trainCapacity)
+		nbTrain = ws->trainCapacity;
+	
+	ws->testNorms = realloc(ws->testNorms, nbTest * sizeof(double));
+	ws->testFeat = realloc(ws->testFeat, (size_t) nbTest * NB_FEATURES * sizeof(double));
+	ws->partial = realloc(ws->partial, nbTest * sizeof(double));
+	ws->neighbors = realloc(ws->neighbors, nbTrain * sizeof(int));
+	ws->testCapacity = nbTest;
+	ws->trainCapacity = nbTrain;
+}
+
+// Gaussian prediction of a single model, with the library norms and its feature-major copy cached in library
+static void predictGaussianWorkspace(const SVM * svm, SVMWorkspace * ws, struct libraryCacheStruct * library,
+									 const gsl_matrix * xTest, gsl_vector * y)
+{
+	const gsl_matrix * xTrain = svm->trainFeat;
+	
+	if (!svm->version || (library->version != svm->version)) {
+		const int n = svm->support ? svm->nbSupport : xTrain->size1;
+		
+		if (n > library->capacity) {
+			library->norms = realloc(library->norms, n * sizeof(double));
+			library->trainT = realloc(library->trainT, (size_t) n * NB_FEATURES * sizeof(double));
+			library->alpha = realloc(library->alpha, n * sizeof(double));
+			library->capacity = n;
+		}
+		
+		// Matlab: trainT = X(support,:)(:); with X in feature-major order
+		for (int i = 0; i < n; ++i) {
+			const int r = svm->support ? svm->support[i] : i;
+			const double * xi = gsl_matrix_const_ptr(xTrain, r, 0);
+			
+			library->norms[i] = 0.0;
+			
+			for (int k = 0; k < xTrain->size2; ++k) {
+				library->trainT[(size_t) k * n + i] = xi[k];
+				library->norms[i] += xi[k] * xi[k];
+			}
+			
+			library->alpha[i] = gsl_vector_get(svm->alpha, r);
+		}
+		
+		library->nbTrain = n;
+		library->version = svm->version;
+	}
+	
+	squaredNorms(xTest, ws->testNorms);
+	streamGaussianPredict(library->trainT, library->norms, library->alpha, library->nbTrain, xTrain->size2, xTest,
+						  ws->testNorms, GAUSSIAN_SCALE(svm->sigma), svm->precision, y);
+}
+
+// predictSVM with the buffers of a workspace large enough for xTest and the library, and the library cache of
+// the model
+static void predictModel(const SVM * svm, SVMWorkspace * ws, struct libraryCacheStruct * library,
+						 const gsl_matrix * xTest, gsl_vector * y)
+{
+	if (svm->type == SVM_ENSEMBLE) {
+		gsl_vector_view yk = gsl_vector_view_array(ws->partial, y->size);
+		struct libraryCacheStruct * models = subLibraryCaches(library, svm->nbModels);
+		
+		// Matlab: y = mean([predict(model1, X) ... predict(modelm, X)], 2);
+		gsl_vector_set_zero(y);
+		
+		for (int k = 0; k < svm->nbModels; ++k) {
+			predictModel(&svm->models[k], ws, &models[k], xTest, &yk.vector);
+			gsl_blas_daxpy(1.0 / svm->nbModels, &yk.vector, y);
+		}
+		
+		return;
+	}
+	
+	if (svm->type == SVM_CLUSTERED) {
+		struct libraryCacheStruct * models = subLibraryCaches(library, svm->nbModels);
+		int route[2];
+		double weight[2];
+		
+		for (int i = 0; i < xTest->size1; ++i) {
+			gsl_matrix_const_view row = gsl_matrix_const_submatrix(xTest, i, 0, 1, xTest->size2);
+			gsl_vector_view yi = gsl_vector_subvector(y, i, 1);
+			int nbRoutes = routeQuery(svm, gsl_matrix_const_ptr(xTest, i, 0), route, weight);
+			double sum = 0.0;
+			
+			for (int r = 0; r < nbRoutes; ++r) {
+				predictModel(&svm->models[route[r]], ws, &models[route[r]], &row.matrix, &yi.vector);
+				sum += weight[r] * gsl_vector_get(y, i);
+			}
+			
+			gsl_vector_set(y, i, sum);
+		}
+		
+		return;
+	}
+	
+	const KernelFunctions * kernel = selectKernel(svm->kernel, xTest->size2);
+	
+	if (svm->cells) {
+		// Only the library samples inside the support contribute
+		for (int i = 0; i < xTest->size1; ++i) {
+			const double * xi = gsl_matrix_const_ptr(xTest, i, 0);
+			int count = findCellNeighbors(svm->cells, xi, ws->neighbors);
+			double sum = 0.0;
+			
+			for (int k = 0; k < count; ++k)
+				sum += gsl_vector_get(svm->alpha, ws->neighbors[k]) *
+					   kernel->eval(xi, gsl_matrix_const_ptr(svm->trainFeat, ws->neighbors[k], 0), xTest->size2,
+									svm->sigma);
+			
+			gsl_vector_set(y, i, sum);
+		}
+	}
+	else if (svm->tree && (svm->pruning > 0.0)) {
+		const double scale = GAUSSIAN_SCALE(svm->sigma);
+		
+		for (int i = 0; i < xTest->size1; ++i)
+			gsl_vector_set(y, i, kdTreeGaussian(svm->tree, gsl_matrix_const_ptr(xTest, i, 0), scale, svm->pruning,
+												svm->precision));
+	}
+	else if ((svm->kernel == KERNEL_GAUSSIAN) && (xTest->size1 > 1)) {
+		// A single query (clustered models) would not amortize the library norms
+		predictGaussianWorkspace(svm, ws, library, xTest, y);
+	}
+	else {
+		kernel->predict(svm->trainFeat, xTest, svm->alpha, svm->sigma, y);
+	}
+	
+	gsl_vector_add_constant(y, svm->b);
+}
+
+void predictWorkspaceSVM(const SVM * svm, SVMWorkspace * ws, const gsl_matrix * xTest, gsl_vector * y)
+{
+	SVMWorkspace temporary = {0};
+	SVMWorkspace * w = ws ? ws : &temporary;
+	
+	// The library of an ensemble or clustered model holds the samples of all its sub-models
+	reserveSVMWorkspace(w, xTest->size1, svm->trainFeat->size1);
+	predictModel(svm, w, &w->library, xTest, y);
+	
+	if (!ws)
+		freeWorkspaceBuffers(&temporary);
+}
+
+// Largest number of clusters of the library
+#define IFGT_MAX_CLUSTERS 256
+
+// Cost of a direct kernel evaluation in expansion terms
+#define IFGT_DIRECT_COST 8
+
+// Highest truncation order of the Taylor expansions
+#define IFGT_MAX_ORDER 16
+
+// Monomials of v (dim coordinates) of degree < order in graded lexicographic order, returns their number. The
+// term t is the product of the term parent[t] and v[var[t]] (heads[i] is the first term of the current degree
+// ending with the variable i).
+static int ifgtMonomials(const double * v, int dim, int order, double * monomials)
+{
+	int heads[NB_FEATURES];
+	int t = 1;
+	
+	monomials[0] = 1.0;
+	
+	for (int i = 0; i < dim; ++i)
+		heads[i] = 0;
+	
+	for (int k = 1, tail = 1; k < order; ++k, tail = t) {
+		for (int i = 0; i < dim; ++i) {
+			int head = heads[i];
+			
+			heads[i] = t;
+			
+			for (int j = head; j < tail; ++j)
+				monomials[t++] = v[i] * monomials[j];
+		}
+	}
+	
+	return t;
+}
+
+// Constants 2^|a| / a! of the monomials x^a of ifgtMonomials
+static void ifgtConstants(int dim, int order, double * constants)
+{
+	int heads[NB_FEATURES];
+	int (* exponents)[NB_FEATURES] = calloc(1, sizeof(int[NB_FEATURES]));
+	int t = 1, size = 1;
+	
+	constants[0] = 1.0;
+	
+	for (int i = 0; i < dim; ++i)
+		heads[i] = 0;
+	
+	for (int k = 1, tail = 1; k < order; ++k, tail = t) {
+		for (int i = 0; i < dim; ++i) {
+			int head = heads[i];
+			
+			heads[i] = t;
+			
+			for (int j = head; j < tail; ++j, ++t) {
+				if (t >= size) {
+					size *= 2;
+					exponents = realloc(exponents, size * sizeof(int[NB_FEATURES]));
+				}
+				
+				for (int l = 0; l < dim; ++l)
+					exponents[t][l] = exponents[j][l];
+				
+				++exponents[t][i];
+				constants[t] = 2.0 * constants[j] / exponents[t][i];
+			}
+		}
+	}
+	
+	free(exponents);
+}
+
+// Number of monomials of degree < order in dim variables: (order - 1 + dim)! / ((order - 1)! dim!)
+static long ifgtTerms(int dim, int order)
+{
+	long terms = 1;
+	
+	for (int i = 1; i <= dim; ++i)
+		terms = terms * (order - 1 + i) / i;
+	
+	return terms;
+}
+
+// Bound of the truncation error of a sample of weight 1, at distance a * h of its center, to a query at distance
+// b * h <= rb * h of it: 2^p / p! * (a b)^p * exp(-(a - b)^2), largest at b = (a + sqrt(a^2 + 2p)) / 2
+static double ifgtTruncation(double a, double rb, int order)
+{
+	double b = fmin(0.5 * (a + sqrt(a * a + 2.0 * order)), rb);
+	
+	return exp(order * log(2.0 * a * b) - lgamma(order + 1.0) - (a - b) * (a - b));
+}
+
+// Farthest point clustering of the library with maxClusters centers into cache, with the radii unscaled by the
+// bandwidth. Returns -1 if the memory is lacking.
+static int ifgtCluster(const gsl_matrix * xTrain, int maxClusters, struct gaussTransformStruct * cache)
+{
+	const int n = xTrain->size1;
+	const int dim = xTrain->size2;
+	int * centers = malloc(maxClusters * sizeof(int));
+	double * radii = malloc((maxClusters + 1) * sizeof(double));
+	int * orders = malloc((maxClusters + 1) * sizeof(int));
+	double * dist = malloc(n * sizeof(double));
+	int farthest = 0;
+	
+	if (!centers || !radii || !orders || !dist) {
+		free(centers);
+		free(radii);
+		free(orders);
+		free(dist);
+		
+		return -1;
+	}
+	
+	for (int i = 0; i < n; ++i)
+		dist[i] = INFINITY;
+	
+	// Matlab: centers = kcenter(X, K); radii(K) is the largest distance of a sample to the nearest of the
+	// first K centers
+	for (int c = 0; c < maxClusters; ++c) {
+		centers[c] = farthest;
+		
+		for (int i = 0; i < n; ++i) {
+			double d2 = 0.0;
+			
+			for (int k = 0; k < dim; ++k)
+				d2 += (gsl_matrix_get(xTrain, i, k) - gsl_matrix_get(xTrain, centers[c], k)) *
+					  (gsl_matrix_get(xTrain, i, k) - gsl_matrix_get(xTrain, centers[c], k));
+			
+			if (d2 < dist[i])
+				dist[i] = d2;
+		}
+		
+		farthest = 0;
+		
+		for (int i = 0; i < n; ++i)
+			if (dist[i] > dist[farthest])
+				farthest = i;
+		
+		radii[c + 1] = sqrt(dist[farthest]);
+	}
+	
+	free(dist);
+	free(cache->centers);
+	free(cache->radii);
+	free(cache->orders);
+	cache->centers = centers;
+	cache->radii = radii;
+	cache->orders = orders;
+	cache->maxClusters = maxClusters;
+	
+	return 0;
+}
+
+// Expansions of order order around the first nbClusters centers of the clustering of cache into cache. Returns -1
+// if the memory is lacking.
+static int ifgtExpand(const SVM * svm, double h, int nbClusters, int order, struct gaussTransformStruct * cache)
+{
+	const gsl_matrix * xTrain = svm->trainFeat;
+	const int n = xTrain->size1;
+	const int dim = xTrain->size2;
+	const long terms = ifgtTerms(dim, order);
+	int * assign = malloc(n * sizeof(int));
+	double * coefficients = calloc((size_t) nbClusters * terms, sizeof(double));
+	double * constants = malloc(terms * sizeof(double));
+	double * monomials = malloc(terms * sizeof(double));
+	double v[NB_FEATURES];
+	int i, k, t;
+	
+	if (!assign || !coefficients || !constants || !monomials) {
+		free(assign);
+		free(coefficients);
+		free(constants);
+		free(monomials);
+		
+		return -1;
+	}
+	
+	// Nearest of the first nbClusters centers
+	for (i = 0; i < n; ++i) {
+		double best = INFINITY;
+		
+		for (int c = 0; c < nbClusters; ++c) {
+			double d2 = 0.0;
+			
+			for (k = 0; k < dim; ++k)
+				d2 += (gsl_matrix_get(xTrain, i, k) - gsl_matrix_get(xTrain, cache->centers[c], k)) *
+					  (gsl_matrix_get(xTrain, i, k) - gsl_matrix_get(xTrain, cache->centers[c], k));
+			
+			if (d2 < best) {
+				best = d2;
+				assign[i] = c;
+			}
+		}
+	}
+	
+	// Matlab: C(k,a) = 2^|a| / a! * sum(alpha(i) * exp(-|dx(i)|^2) * dx(i)^a) over the samples of cluster k,
+	// dx(i) = (X(i,:) - center(k,:)) / h;
+	for (i = 0; i < n; ++i) {
+		const int c = cache->centers[assign[i]];
+		double * ck = &coefficients[(size_t) assign[i] * terms];
+		double d2 = 0.0;
+		
+		for (k = 0; k < dim; ++k) {
+			v[k] = (gsl_matrix_get(xTrain, i, k) - gsl_matrix_get(xTrain, c, k)) / h;
+			d2 += v[k] * v[k];
+		}
+		
+		double weight = gsl_vector_get(svm->alpha, i) * exp(-d2);
+		
+		ifgtMonomials(v, dim, order, monomials);
+		
+		for (t = 0; t < terms; ++t)
+			ck[t] += weight * monomials[t];
+	}
+	
+	ifgtConstants(dim, order, constants);
+	
+	for (k = 0; k < nbClusters; ++k)
+		for (t = 0; t < terms; ++t)
+			coefficients[(size_t) k * terms + t] *= constants[t];
+	
+	free(assign);
+	free(constants);
+	free(monomials);
+	free(cache->coefficients);
+	cache->coefficients = coefficients;
+	cache->nbClusters = nbClusters;
+	cache->order = order;
+	
+	return 0;
+}
+
+int predictFastGaussSVM(const SVM * svm, SVMWorkspace * ws, const gsl_matrix * xTest, double tolerance,
+						gsl_vector * y)
+{
+	if (!isTrainedSVM(svm) || (svm->type != SVM_SINGLE) || (svm->kernel != KERNEL_GAUSSIAN) || !xTest || !y ||
+		(tolerance <= 0.0) || (xTest->size2 != svm->trainFeat->size2) || (xTest->size2 > NB_FEATURES) ||
+		(y->size != xTest->size1))
+		return -1;
+	
+	const gsl_matrix * xTrain = svm->trainFeat;
+	const int n = xTrain->size1;
+	const int m = xTest->size1;
+	const int dim = xTrain->size2;
+	const double h = sqrt(2.0) * svm->sigma; // exp(-|x - y|^2 / h^2)
+	const int maxClusters = (n < IFGT_MAX_CLUSTERS) ? n : IFGT_MAX_CLUSTERS;
+	struct gaussTransformStruct temporary = {0};
+	struct gaussTransformStruct * cache = ws ? &ws->transform : &temporary;
+	int i, j, k, t;
+	
+	if (!svm->version || (cache->version != svm->version)) {
+		cache->version = 0;
+		cache->tolerance = 0.0;
+		cache->nbClusters = 0;
+		
+		// Clustering the library costs about as much as predicting maxClusters queries directly, and the
+		// expansions at least one term per sample and query: the direct sum of a few queries is cheaper
+		if (((double) m * n * IFGT_DIRECT_COST <= (double) maxClusters * n * IFGT_DIRECT_COST + n + m) ||
+			ifgtCluster(xTrain, maxClusters, cache)) {
+			predictWorkspaceSVM(svm, ws, xTest, y);
+			
+			return 0;
+		}
+		
+		cache->version = svm->version;
+	}
+	
+	// Half of the tolerance for the clusters too far from a query, half for the truncation of the expansions
+	if (cache->tolerance != tolerance) {
+		double total = 0.0;
+		
+		for (i = 0; i < n; ++i)
+			total += fabs(gsl_vector_get(svm->alpha, i));
+		
+		cache->reach = sqrt(fmax(log(2.0 * total / tolerance), 0.0));
+		cache->tolerance = tolerance;
+		
+		for (int c = 1; c <= cache->maxClusters; ++c) {
+			const double radius = cache->radii[c] / h;
+			int p;
+			
+			for (p = 1; p <= IFGT_MAX_ORDER; ++p)
+				if (total * ifgtTruncation(radius, radius + cache->reach, p) <= 0.5 * tolerance)
+					break;
+			
+			cache->orders[c] = (p <= IFGT_MAX_ORDER) ? p : 0;
+		}
+	}
+	
+	// Matlab: [~, K] = min(terms(K) * (N + M * K)); over the clusterings precise enough, the expansions of the
+	// previous call cost nothing more to reuse
+	double cost = (double) IFGT_DIRECT_COST * m * n;
+	int nbClusters = 0, order = 0;
+	
+	for (int c = 1; c <= cache->maxClusters; ++c) {
+		const int p = cache->orders[c];
+		const double expand = ((c == cache->nbClusters) && (p == cache->order)) ? 0.0 : (double) n;
+		
+		if (p && ((double) ifgtTerms(dim, p) * (expand + (double) m * c) < cost)) {
+			cost = (double) ifgtTerms(dim, p) * (expand + (double) m * c);
+			nbClusters = c;
+			order = p;
+		}
+	}
+	
+	// The direct sum is cheaper
+	if ((nbClusters == 0) ||
+		(((nbClusters != cache->nbClusters) || (order != cache->order)) &&
+		 ifgtExpand(svm, h, nbClusters, order, cache))) {
+		predictWorkspaceSVM(svm, ws, xTest, y);
+		
+		if (!ws)
+			freeGaussTransform(&temporary);
+		
+		return 0;
+	}
+	
+	const double cutoff = cache->radii[nbClusters] / h + cache->reach;
+	const long terms = ifgtTerms(dim, order);
+	double * monomials = malloc(terms * sizeof(double));
+	double v[NB_FEATURES];
+	
+	if (!monomials) {
+		predictWorkspaceSVM(svm, ws, xTest, y);
+		
+		if (!ws)
+			freeGaussTransform(&temporary);
+		
+		return 0;
+	}
+	
+	// Matlab: y(j) = sum(exp(-|dy|^2) * C(k,:) * dy.^a) over the clusters k with |dy| <= cutoff,
+	// dy = (Y(j,:) - center(k,:)) / h;
+	for (j = 0; j < m; ++j) {
+		double sum = 0.0;
+		
+		for (int c = 0; c < nbClusters; ++c) {
+			double d2 = 0.0;
+			
+			for (k = 0; k < dim; ++k) {
+				v[k] = (gsl_matrix_get(xTest, j, k) - gsl_matrix_get(xTrain, cache->centers[c], k)) / h;
+				d2 += v[k] * v[k];
+			}
+			
+			if (d2 > cutoff * cutoff)
+				continue;
+			
+			const double * ck = &cache->coefficients[(size_t) c * terms];
+			double expansion = 0.0;
+			
+			ifgtMonomials(v, dim, order, monomials);
+			
+			for (t = 0; t < terms; ++t)
+				expansion += ck[t] * monomials[t];
+			
+			sum += exp(-d2) * expansion;
+		}
+		
+		gsl_vector_set(y, j, sum + svm->b);
+	}
+	
+	free(monomials);
+	
+	if (!ws)
+		freeGaussTransform(&temporary);
+	
+	return 0;
+}
+
+// Test samples per thread below which a batch is not worth splitting
+#define PARALLEL_MIN_ROWS 64
+
+// Predict the slice of the current batch of the pool assigned to a thread
+static void predictSlice(PredictPool * pool, int index)
+{
+	const int m = pool->xTest->size1;
+	const int begin = (int) ((long) index * m / pool->nbThreads);
+	const int end = (int) ((long) (index + 1) * m / pool->nbThreads);
+	
+	if (end == begin)
+		return;
+	
+	gsl_matrix_const_view xSlice = gsl_matrix_const_submatrix(pool->xTest, begin, 0, end - begin, pool->xTest->size2);
+	gsl_vector_view ySlice = gsl_vector_subvector(pool->y, begin, end - begin);
+	
+	predictWorkspaceSVM(pool->svm, pool->workspaces[index], &xSlice.matrix, &ySlice.vector);
+}
+
+static void * predictPoolWorker(void * arg)
+{
+	struct predictThreadStruct * thread = arg;
+	PredictPool * pool = thread->pool;
+	unsigned long seen = 0;
+	
+	pthread_mutex_lock(&pool->lock);
+	
+	for (;;) {
+		while (!pool->stop && (pool->generation == seen))
+			pthread_cond_wait(&pool->start, &pool->lock);
+		
+		if (pool->stop)
+			break;
+		
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+		
+		// The batch fields do not change until every worker is done
+		predictSlice(pool, thread->index);
+		
+		pthread_mutex_lock(&pool->lock);
+		
+		if (--pool->remaining == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	
+	pthread_mutex_unlock(&pool->lock);
+	
+	return NULL;
+}
+
+PredictPool * createPredictPool(int nbThreads)
+{
+	PredictPool * pool = calloc(1, sizeof(PredictPool));
+	int i;
+	
+	if (nbThreads < 1)
+		nbThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	if (nbThreads < 1)
+		nbThreads = 1;
+	
+	pool->threads = malloc(nbThreads * sizeof(pthread_t));
+	pool->args = malloc(nbThreads * sizeof(struct predictThreadStruct));
+	pool->workspaces = malloc(nbThreads * sizeof(SVMWorkspace *));
+	pthread_mutex_init(&pool->batch, NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	
+	for (i = 0; i < nbThreads; ++i) {
+		pool->args[i].pool = pool;
+		pool->args[i].index = i;
+		pool->workspaces[i] = createSVMWorkspace();
+	}
+	
+	// Predict with the threads that could be started
+	for (i = 1; i < nbThreads; ++i)
+		if (pthread_create(&pool->threads[i], NULL, predictPoolWorker, &pool->args[i]))
+			break;
+	
+	pool->nbThreads = i;
+	
+	for (; i < nbThreads; ++i)
+		deleteSVMWorkspace(pool->workspaces[i]);
+	
+	return pool;
+}
+
+void deletePredictPool(PredictPool * pool)
+{
+	int i;
+	
+	if (!pool)
+		return;
+	
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	
+	for (i = 1; i < pool->nbThreads; ++i)
+		pthread_join(pool->threads[i], NULL);
+	
+	for (i = 0; i < pool->nbThreads; ++i)
+		deleteSVMWorkspace(pool->workspaces[i]);
+	
+	pthread_mutex_destroy(&pool->batch);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool->args);
+	free(pool->workspaces);
+	free(pool);
+}
+
+void predictParallelSVM(const SVM * svm, PredictPool * pool, const gsl_matrix * xTest, gsl_vector * y)
+{
+	if (!pool || (xTest->size1 < (size_t) PARALLEL_MIN_ROWS * pool->nbThreads)) {
+		if (pool)
+			pthread_mutex_lock(&pool->batch);
+		
+		predictWorkspaceSVM(svm, pool ? pool->workspaces[0] : NULL, xTest, y);
+		
+		if (pool)
+			pthread_mutex_unlock(&pool->batch);
+		
+		return;
+	}
+	
+	pthread_mutex_lock(&pool->batch);
+	pthread_mutex_lock(&pool->lock);
+	pool->svm = svm;
+	pool->xTest = xTest;
+	pool->y = y;
+	pool->remaining = pool->nbThreads - 1;
+	++pool->generation;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	
+	predictSlice(pool, 0);
+	
+	pthread_mutex_lock(&pool->lock);
+	
+	while (pool->remaining > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	
+	pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&pool->batch);
+}
+
+KernelCache * createKernelCache(const gsl_matrix * xTrain, const KernelFunctions * kernel, double sigma, double cacheSize)
+{
+	KernelCache * cache = malloc(sizeof(KernelCache));
+	
+	cache->xTrain = xTrain;
+	cache->kernel = kernel;
+	cache->sigma = sigma;
+	cache->capacity = (long)(cacheSize * 1024.0 * 1024.0 / (xTrain->size1 * sizeof(double)));
+	
+	// The SMO solver needs the rows of both variables of the working set at the same time
+	if (cache->capacity < 2)
+		cache->capacity = 2;
+	
+	cache->used = 0;
+	cache->rows = calloc(xTrain->size1, sizeof(double *));
+	cache->prev = malloc(xTrain->size1 * sizeof(int));
+	cache->next = malloc(xTrain->size1 * sizeof(int));
+	cache->head = -1;
+	cache->tail = -1;
+	cache->hits = 0;
+	cache->misses = 0;
+	
+	return cache;
+}
+
+void deleteKernelCache(KernelCache * cache)
+{
+	int i;
+	
+	if (!cache)
+		return;
+	
+	for (i = 0; i < cache->xTrain->size1; ++i)
+		free(cache->rows[i]);
+	
+	free(cache->rows);
+	free(cache->prev);
+	free(cache->next);
+	free(cache);
+}
+
+static void unlinkKernelRow(KernelCache * cache, int i)
+{
+	if (cache->prev[i] != -1)
+		cache->next[cache->prev[i]] = cache->next[i];
+	else
+		cache->head = cache->next[i];
+	
+	if (cache->next[i] != -1)
+		cache->prev[cache->next[i]] = cache->prev[i];
+	else
+		cache->tail = cache->prev[i];
+}
+
+static void pushKernelRow(KernelCache * cache, int i)
+{
+	cache->prev[i] = -1;
+	cache->next[i] = cache->head;
+	
+	if (cache->head != -1)
+		cache->prev[cache->head] = i;
+	else
+		cache->tail = i;
+	
+	cache->head = i;
+}
+
+const double * getKernelRow(KernelCache * cache, int i)
+{
+	const gsl_matrix * x = cache->xTrain;
+	double * row;
+	
+	if (cache->rows[i]) {
+		++cache->hits;
+		unlinkKernelRow(cache, i);
+		pushKernelRow(cache, i);
+		return cache->rows[i];
+	}
+	
+	++cache->misses;
+	
+	if (cache->used >= cache->capacity) {
+		// Recycle the least recently used row
+		int lru = cache->tail;
+		unlinkKernelRow(cache, lru);
+		row = cache->rows[lru];
+		cache->rows[lru] = NULL;
+	}
+	else {
+		row = malloc(x->size1 * sizeof(double));
+		++cache->used;
+	}
+	
+	cache->kernel->row(gsl_matrix_const_ptr(x, i, 0), x, cache->sigma, row);
+	cache->rows[i] = row;
+	pushKernelRow(cache, i);
+	
+	return row;
+}
+
+// State of the SMO solver. The dual of the epsilon-SVR has 2n variables: 0..n-1 are the alpha+
+// (label +1) and n..2n-1 the alpha- (label -1) of the n training samples, so that
+// Q(t,u) = y(t) * y(u) * K(t % n, u % n) (LIBSVM formulation).
+typedef struct {
+	int n;
+	int l;
+	double C;
+	double * a; // Dual variables
+	double * G; // Gradient p + Q * a
+	double * Gbar; // Part of the gradient due to the variables at the upper bound C
+	double * p; // Linear term [epsilon - y; epsilon + y]
+	int * active; // Indices of the variables which are not shrunk
+	int nbActive;
+	int unshrunk;
+	KernelCache * cache;
+} SMOState;
+
+static double smoLabel(const SMOState * s, int t)
+{
+	return (t < s->n) ? 1.0 : -1.0;
+}
+
+// Select the working set (i, j) using second order information (Fan et al., 2005).
+// Returns 1 if the active variables are already optimal.
+static int smoSelectWorkingSet(SMOState * s, int * outI, int * outJ)
+{
+	const double tau = 1e-12;
+	const double tol = 1e-3;
+	double Gmax =-INFINITY;
+	double Gmax2 =-INFINITY;
+	double objMin = INFINITY;
+	int i =-1, j =-1;
+	int k;
+	
+	for (k = 0; k < s->nbActive; ++k) {
+		int t = s->active[k];
+		
+		if (smoLabel(s, t) > 0) {
+			if ((s->a[t] < s->C) && (-s->G[t] >= Gmax)) {
+				Gmax =-s->G[t];
+				i = t;
+			}
+		}
+		else if ((s->a[t] > 0) && (s->G[t] >= Gmax)) {
+			Gmax = s->G[t];
+			i = t;
+		}
+	}
+	
+	if (i == -1)
+		return 1;
+	
+	const double * Ki = getKernelRow(s->cache, i % s->n);
+	
+	for (k = 0; k < s->nbActive; ++k) {
+		int t = s->active[k];
+		double gradDiff;
+		
+		if (smoLabel(s, t) > 0) {
+			if (s->a[t] <= 0)
+				continue;
+			
+			if (s->G[t] >= Gmax2)
+				Gmax2 = s->G[t];
+			
+			gradDiff = Gmax + s->G[t];
+		}
+		else {
+			if (s->a[t] >= s->C)
+				continue;
+			
+			if (-s->G[t] >= Gmax2)
+				Gmax2 =-s->G[t];
+			
+			gradDiff = Gmax - s->G[t];
+		}
+		
+		if (gradDiff > 0) {
+			// K(i,i) = K(t,t) = 1 for all the kernel types
+			double quad = 2.0 - 2.0 * Ki[t % s->n];
+			double obj =-(gradDiff * gradDiff) / ((quad > 0) ? quad : tau);
+			
+			if (obj <= objMin) {
+				objMin = obj;
+				j = t;
+			}
+		}
+	}
+	
+	if ((Gmax + Gmax2 < tol) || (j == -1))
+		return 1;
+	
+	*outI = i;
+	*outJ = j;
+	
+	return 0;
+}
+
+// Recompute the gradient of the shrunk variables from Gbar and the free variables
+static void smoReconstructGradient(SMOState * s)
+{
+	char * isActive = calloc(s->l, 1);
+	int k, t, u;
+	
+	if (s->nbActive == s->l) {
+		free(isActive);
+		return;
+	}
+	
+	for (k = 0; k < s->nbActive; ++k)
+		isActive[s->active[k]] = 1;
+	
+	for (t = 0; t < s->l; ++t)
+		if (!isActive[t])
+			s->G[t] = s->Gbar[t] + s->p[t];
+	
+	for (u = 0; u < s->l; ++u) {
+		if ((s->a[u] <= 0) || (s->a[u] >= s->C))
+			continue;
+		
+		const double * Ku = getKernelRow(s->cache, u % s->n);
+		
+		for (t = 0; t < s->l; ++t)
+			if (!isActive[t])
+				s->G[t] += smoLabel(s, t) * smoLabel(s, u) * s->a[u] * Ku[t % s->n];
+	}
+	
+	for (t = 0; t < s->l; ++t)
+		s->active[t] = t;
+	
+	s->nbActive = s->l;
+	free(isActive);
+}
+
+static int smoBeShrunk(const SMOState * s, int t, double Gmax1, double Gmax2)
+{
+	if (s->a[t] >= s->C)
+		return (smoLabel(s, t) > 0) ? (-s->G[t] > Gmax1) : (-s->G[t] > Gmax2);
+	
+	if (s->a[t] <= 0)
+		return (smoLabel(s, t) > 0) ? (s->G[t] > Gmax2) : (s->G[t] > Gmax1);
+	
+	return 0;
+}
+
+// Remove from the active set the variables stuck at a bound
+static void smoShrink(SMOState * s)
+{
+	const double tol = 1e-3;
+	double Gmax1 =-INFINITY; // max { -y_t G_t | t in I_up }
+	double Gmax2 =-INFINITY; // max { y_t G_t | t in I_low }
+	int k, m;
+	
+	for (k = 0; k < s->nbActive; ++k) {
+		int t = s->active[k];
+		
+		if (smoLabel(s, t) > 0) {
+			if (s->a[t] < s->C)
+				Gmax1 = fmax(Gmax1,-s->G[t]);
+			
+			if (s->a[t] > 0)
+				Gmax2 = fmax(Gmax2, s->G[t]);
+		}
+		else {
+			if (s->a[t] < s->C)
+				Gmax2 = fmax(Gmax2,-s->G[t]);
+			
+			if (s->a[t] > 0)
+				Gmax1 = fmax(Gmax1, s->G[t]);
+		}
+	}
+	
+	// Close to the solution, unshrink everything once to avoid stopping on a wrongly shrunk set
+	if (!s->unshrunk && (Gmax1 + Gmax2 <= tol * 10)) {
+		s->unshrunk = 1;
+		smoReconstructGradient(s);
+	}
+	
+	for (k = 0, m = 0; k < s->nbActive; ++k)
+		if (!smoBeShrunk(s, s->active[k], Gmax1, Gmax2))
+			s->active[m++] = s->active[k];
+	
+	s->nbActive = m;
+}
+
+// Solve the two variables sub-problem and update the gradients
+static void smoUpdate(SMOState * s, int i, int j)
+{
+	const double tau = 1e-12;
+	const double C = s->C;
+	const double * Ki = getKernelRow(s->cache, i % s->n);
+	const double * Kj = getKernelRow(s->cache, j % s->n);
+	double oldAi = s->a[i];
+	double oldAj = s->a[j];
+	double quad = 2.0 - 2.0 * Ki[j % s->n];
+	int k, t;
+	
+	if (quad <= 0)
+		quad = tau;
+	
+	if (smoLabel(s, i) != smoLabel(s, j)) {
+		double delta = (-s->G[i] - s->G[j]) / quad;
+		double diff = s->a[i] - s->a[j];
+		
+		s->a[i] += delta;
+		s->a[j] += delta;
+		
+		if (diff > 0) {
+			if (s->a[j] < 0) {
+				s->a[j] = 0;
+				s->a[i] = diff;
+			}
+		}
+		else if (s->a[i] < 0) {
+			s->a[i] = 0;
+			s->a[j] =-diff;
+		}
+		
+		if (diff > 0) {
+			if (s->a[i] > C) {
+				s->a[i] = C;
+				s->a[j] = C - diff;
+			}
+		}
+		else if (s->a[j] > C) {
+			s->a[j] = C;
+			s->a[i] = C + diff;
+		}
+	}
+	else {
+		double delta = (s->G[i] - s->G[j]) / quad;
+		double sum = s->a[i] + s->a[j];
+		
+		s->a[i] -= delta;
+		s->a[j] += delta;
+		
+		if (sum > C) {
+			if (s->a[i] > C) {
+				s->a[i] = C;
+				s->a[j] = sum - C;
+			}
+		}
+		else if (s->a[j] < 0) {
+			s->a[j] = 0;
+			s->a[i] = sum;
+		}
+		
+		if (sum > C) {
+			if (s->a[j] > C) {
+				s->a[j] = C;
+				s->a[i] = sum - C;
+			}
+		}
+		else if (s->a[i] < 0) {
+			s->a[i] = 0;
+			s->a[j] = sum;
+		}
+	}
+	
+	double dAi = (s->a[i] - oldAi) * smoLabel(s, i);
+	double dAj = (s->a[j] - oldAj) * smoLabel(s, j);
+	
+	for (k = 0; k < s->nbActive; ++k) {
+		t = s->active[k];
+		s->G[t] += smoLabel(s, t) * (Ki[t % s->n] * dAi + Kj[t % s->n] * dAj);
+	}
+	
+	// Keep Gbar up to date for the variables entering or leaving the upper bound
+	if ((oldAi >= C) != (s->a[i] >= C)) {
+		double c = ((oldAi >= C) ?-C : C) * smoLabel(s, i);
+		
+		for (t = 0; t < s->l; ++t)
+			s->Gbar[t] += c * smoLabel(s, t) * Ki[t % s->n];
+	}
+	
+	if ((oldAj >= C) != (s->a[j] >= C)) {
+		double c = ((oldAj >= C) ?-C : C) * smoLabel(s, j);
+		
+		for (t = 0; t < s->l; ++t)
+			s->Gbar[t] += c * smoLabel(s, t) * Kj[t % s->n];
+	}
+}
+
+int trainEpsilonSVR(const gsl_matrix * xTrain, const gsl_vector * y, int kernel, double * C, double * sigma,
+					double epsilon, double cacheSize, gsl_vector * alpha, double * b)
+{
+	SMOState s;
+	long iter, maxIter;
+	int counter;
+	int i, j, t, nbSV;
+	
+	assert(y->size == xTrain->size1);
+	assert(alpha->size == xTrain->size1);
+	
+	if (*C <= 0.0)
+		*C = 1000.0;
+	
+	if (*sigma <= 0.0)
+		*sigma = meanSquaredDistance(xTrain); // Same heuristic as trainGaussianSVM
+	
+	s.n = xTrain->size1;
+	s.l = 2 * s.n;
+	s.C = *C;
+	s.a = calloc(s.l, sizeof(double));
+	s.G = malloc(s.l * sizeof(double));
+	s.Gbar = calloc(s.l, sizeof(double));
+	s.p = malloc(s.l * sizeof(double));
+	s.active = malloc(s.l * sizeof(int));
+	s.nbActive = s.l;
+	s.unshrunk = 0;
+	s.cache = createKernelCache(xTrain, selectKernel(kernel, xTrain->size2), *sigma, cacheSize);
+	
+	// Matlab: p = [epsilon - y; epsilon + y]; G = p;
+	for (i = 0; i < s.n; ++i) {
+		s.p[i] = epsilon - gsl_vector_get(y, i);
+		s.p[i + s.n] = epsilon + gsl_vector_get(y, i);
+	}
+	
+	for (t = 0; t < s.l; ++t) {
+		s.G[t] = s.p[t];
+		s.active[t] = t;
+	}
+	
+	maxIter = (s.l > 100000) ? 100L * s.l : 10000000L;
+	counter = ((s.l < 1000) ? s.l : 1000) + 1;
+	
+	for (iter = 0; iter < maxIter; ++iter) {
+		if (--counter == 0) {
+			counter = (s.l < 1000) ? s.l : 1000;
+			smoShrink(&s);
+		}
+		
+		if (smoSelectWorkingSet(&s, &i, &j)) {
+			// Optimal on the active set, check again on the whole problem
+			smoReconstructGradient(&s);
+			
+			if (smoSelectWorkingSet(&s, &i, &j))
+				break;
+			
+			counter = 1; // Shrink again at the next iteration
+		}
+		
+		smoUpdate(&s, i, j);
+	}
+	
+	// Bias: average of y_t * G_t over the free variables (LIBSVM calculate_rho)
+	double ub = INFINITY, lb =-INFINITY, sumFree = 0.0;
+	int nbFree = 0;
+	
+	for (t = 0; t < s.l; ++t) {
+		double yG = smoLabel(&s, t) * s.G[t];
+		
+		if (s.a[t] >= s.C) {
+			if (smoLabel(&s, t) < 0)
+				ub = fmin(ub, yG);
+			else
+				lb = fmax(lb, yG);
+		}
+		else if (s.a[t] <= 0) {
+			if (smoLabel(&s, t) > 0)
+				ub = fmin(ub, yG);
+			else
+				lb = fmax(lb, yG);
+		}
+		else {
+			++nbFree;
+			sumFree += yG;
+		}
+	}
+	
+	*b =-((nbFree > 0) ? sumFree / nbFree : (ub + lb) / 2.0);
+	
+	// Matlab: alpha = a(1:n) - a(n+1:2n);
+	nbSV = 0;
+	
+	for (i = 0; i < s.n; ++i) {
+		gsl_vector_set(alpha, i, s.a[i] - s.a[i + s.n]);
+		
+		if (s.a[i] != s.a[i + s.n])
+			++nbSV;
+	}
+	
+	deleteKernelCache(s.cache);
+	free(s.a);
+	free(s.G);
+	free(s.Gbar);
+	free(s.p);
+	free(s.active);
+	
+	return nbSV;
+}
+
+static atomic_ulong svmVersions;
+
+// Give a (re)trained model a new version, so that the workspaces drop what they cached about the previous one
+static void stampSVM(SVM * svm)
+{
+	svm->version = atomic_fetch_add(&svmVersions, 1) + 1;
+}
+
+void initSVM(SVM * svm)
+{
+	for (int i = 0; i < NB_FEATURES; ++i) {
+		svm->means[i] = 0.0;
+		svm->stds[i] = 1.0;
+	}
+	
+	svm->type = SVM_SINGLE;
+	svm->kernel = KERNEL_GAUSSIAN;
+	svm->sigma = 1.0;
+	svm->precision = PRECISION_EXACT;
+	svm->C = 1.0;
+	svm->trainFeat = NULL;
+	svm->trainY = NULL;
+	svm->alpha = NULL;
+	svm->weights = NULL;
+	svm->epsilon = 0.0;
+	svm->support = NULL;
+	svm->nbSupport = 0;
+	svm->b = 0.0;
+	svm->cacheSize = 100.0;
+	svm->chol = NULL;
+	svm->solver = SOLVER_CHOLESKY;
+	svm->tolerance = 1e-6;
+	svm->nbWorkers = 0;
+	svm->nbModels = 0;
+	svm->stratified = 0;
+	svm->models = NULL;
+	svm->partition = NULL;
+	svm->centers = NULL;
+	svm->overlap = 0.2;
+	svm->nbRoutes = 1;
+	svm->cells = NULL;
+	svm->tree = NULL;
+	svm->pruning = 0.0;
+	svm->nbBootstrap = 0;
+	svm->bootAlpha = NULL;
+	svm->bootNoise = NULL;
+	svm->dirty = 0;
+	svm->pending = NULL;
+	svm->nbPending = 0;
+	svm->pendingCapacity = 0;
+	svm->version = 0;
+}
+
+// Free the sub-models of an ensemble
+static void deleteSubModels(SVM * svm)
+{
+	for (int k = 0; k < svm->nbModels && svm->models; ++k)
+		deleteSVM(&svm->models[k]);
+	
+	free(svm->models);
+	free(svm->partition);
+	
+	if (svm->centers)
+		gsl_matrix_free(svm->centers);
+	
+	svm->models = NULL;
+	svm->partition = NULL;
+	svm->centers = NULL;
+}
+
+void deleteSVM(SVM * svm)
+{
+	deleteSubModels(svm);
+	
+	if (svm->trainFeat)
+		gsl_matrix_free(svm->trainFeat);
+	
+	if (svm->trainY)
+		gsl_vector_free(svm->trainY);
+	
+	if (svm->alpha)
+		gsl_vector_free(svm->alpha);
+	
+	if (svm->weights)
+		gsl_vector_free(svm->weights);
+	
+	if (svm->chol)
+		gsl_matrix_free(svm->chol);
+	
+	if (svm->bootAlpha)
+		gsl_matrix_free(svm->bootAlpha);
+	
+	if (svm->bootNoise)
+		gsl_vector_free(svm->bootNoise);
+	
+	free(svm->pending);
+	free(svm->support);
+	deleteCellIndex(svm->cells);
+	deleteKDTree(svm->tree);
+	
+	svm->trainFeat = NULL;
+	svm->trainY = NULL;
+	svm->alpha = NULL;
+	svm->weights = NULL;
+	svm->support = NULL;
+	svm->nbSupport = 0;
+	svm->chol = NULL;
+	svm->bootAlpha = NULL;
+	svm->bootNoise = NULL;
+	svm->cells = NULL;
+	svm->tree = NULL;
+	svm->nbModels = 0;
+	svm->pending = NULL;
+	svm->nbPending = 0;
+	svm->pendingCapacity = 0;
+	svm->dirty = 0;
+}
+
+int isTrainedSVM(const SVM * svm)
+{
+	if (!svm || (svm->sigma <= 0))
+		return 0;
+	
+	if ((svm->type == SVM_ENSEMBLE) || (svm->type == SVM_CLUSTERED)) {
+		if ((svm->nbModels < 1) || !svm->models || ((svm->type == SVM_CLUSTERED) && !svm->centers))
+			return 0;
+		
+		for (int k = 0; k < svm->nbModels; ++k)
+			if (!isTrainedSVM(&svm->models[k]))
+				return 0;
+		
+		return 1;
+	}
+	
+	return svm->trainFeat && svm->alpha && (svm->trainFeat->size1 == svm->alpha->size);
+}
+
+// Index the library of a single model on a grid if its kernel is compactly supported, or in a k-d tree if it is
+// Gaussian and pruned (the tree depends on the coefficients, so the model must be indexed again when they change)
+static void indexSVM(SVM * svm)
+{
+	deleteCellIndex(svm->cells);
+	deleteKDTree(svm->tree);
+	free(svm->support);
+	svm->cells = NULL;
+	svm->tree = NULL;
+	svm->support = NULL;
+	svm->nbSupport = 0;
+	
+	if ((svm->type != SVM_SINGLE) || !svm->trainFeat)
+		return;
+	
+	// Matlab: support = find(alpha ~= 0); (the other samples of an epsilon-SVR lie inside the tube)
+	if ((svm->epsilon > 0.0) && svm->alpha) {
+		svm->support = malloc(svm->alpha->size * sizeof(int));
+		
+		for (int i = 0; i < svm->alpha->size; ++i)
+			if (gsl_vector_get(svm->alpha, i) != 0.0)
+				svm->support[svm->nbSupport++] = i;
+	}
+	
+	if (selectKernel(svm->kernel, svm->trainFeat->size2)->compact)
+		svm->cells = createCellIndex(svm->trainFeat, svm->sigma);
+	else if ((svm->kernel == KERNEL_GAUSSIAN) && svm->alpha && (svm->pruning > 0.0))
+		svm->tree = createKDTree(svm->trainFeat, svm->alpha);
+}
+
+static gsl_matrix * duplicateMatrix(const gsl_matrix * m)
+{
+	gsl_matrix * copy = m ? gsl_matrix_alloc(m->size1, m->size2) : NULL;
+	
+	if (copy)
+		gsl_matrix_memcpy(copy, m);
+	
+	return copy;
+}
+
+int copySVM(SVM * dest, const SVM * src)
+{
+	int n = src->trainFeat ? src->trainFeat->size1 : 0;
+	int status = 0;
+	
+	*dest = *src;
+	dest->trainFeat = duplicateMatrix(src->trainFeat);
+	dest->trainY = src->trainY ? gsl_vector_alloc(src->trainY->size) : NULL;
+	dest->alpha = src->alpha ? gsl_vector_alloc(src->alpha->size) : NULL;
+	dest->weights = src->weights ? gsl_vector_alloc(src->weights->size) : NULL;
+	dest->support = NULL;
+	dest->chol = duplicateMatrix(src->chol);
+	dest->bootAlpha = duplicateMatrix(src->bootAlpha);
+	dest->bootNoise = src->bootNoise ? gsl_vector_alloc(src->bootNoise->size) : NULL;
+	dest->centers = duplicateMatrix(src->centers);
+	dest->nbModels = 0;
+	dest->models = NULL;
+	dest->partition = NULL;
+	dest->cells = NULL;
+	dest->tree = NULL;
+	dest->pending = NULL;
+	dest->pendingCapacity = 0;
+	dest->nbPending = 0;
+	
+	// Leave dest empty (as deleteSVM does) if any copy is missing
+	if ((src->trainFeat && !dest->trainFeat) || (src->trainY && !dest->trainY) || (src->alpha && !dest->alpha) ||
+		(src->weights && !dest->weights) || (src->chol && !dest->chol) || (src->bootAlpha && !dest->bootAlpha) ||
+		(src->bootNoise && !dest->bootNoise) || (src->centers && !dest->centers)) {
+		deleteSVM(dest);
+		return -1;
+	}
+	
+	if (src->trainY)
+		gsl_vector_memcpy(dest->trainY, src->trainY);
+	
+	if (src->alpha)
+		gsl_vector_memcpy(dest->alpha, src->alpha);
+	
+	if (src->weights)
+		gsl_vector_memcpy(dest->weights, src->weights);
+	
+	if (src->bootNoise)
+		gsl_vector_memcpy(dest->bootNoise, src->bootNoise);
+	
+	if (src->cells && !(dest->cells = createCellIndex(dest->trainFeat, src->cells->cellSize)))
+		status = -1;
+	
+	if (src->tree && !(dest->tree = createKDTree(dest->trainFeat, dest->alpha)))
+		status = -1;
+	
+	if (src->support) {
+		dest->support = malloc(src->nbSupport * sizeof(int));
+		
+		for (int i = 0; dest->support && (i < src->nbSupport); ++i)
+			dest->support[i] = src->support[i];
+		
+		if (!dest->support)
+			status = -1;
+	}
+	
+	if (src->partition) {
+		dest->partition = malloc(n * sizeof(int));
+		
+		for (int i = 0; dest->partition && (i < n); ++i)
+			dest->partition[i] = src->partition[i];
+		
+		if (!dest->partition)
+			status = -1;
+	}
+	
+	if (src->nbPending > 0) {
+		dest->pending = malloc(src->nbPending * sizeof(PendingSample));
+		dest->pendingCapacity = dest->pending ? src->nbPending : 0;
+		dest->nbPending = dest->pendingCapacity;
+		
+		for (int i = 0; i < dest->nbPending; ++i)
+			dest->pending[i] = src->pending[i];
+		
+		if (!dest->pending)
+			status = -1;
+	}
+	
+	// The sub-models start empty, so that deleting a partial copy is safe
+	if (src->models) {
+		dest->models = calloc(src->nbModels, sizeof(SVM));
+		dest->nbModels = dest->models ? src->nbModels : 0;
+		
+		for (int k = 0; k < dest->nbModels; ++k)
+			if (copySVM(&dest->models[k], &src->models[k]))
+				status = -1;
+		
+		if (!dest->models)
+			status = -1;
+	}
+	
+	if (status)
+		deleteSVM(dest);
+	
+	return status;
+}
+
+// Covariates, then dose, then index: a total order, so that the stratified partitions do not depend on qsort
+static int compareStrata(const void * a, const void * b)
+{
+	const struct stratumStruct * sa = a;
+	const struct stratumStruct * sb = b;
+	int order = compareCovariates(a, b);
+	
+	if (order)
+		return order;
+	
+	if (sa->row[FEATURE_DOSE] != sb->row[FEATURE_DOSE])
+		return (sa->row[FEATURE_DOSE] < sb->row[FEATURE_DOSE]) ?-1 : 1;
+	
+	return sa->index - sb->index;
+}
+
+// Set up a sub-model of svm with the same parameters and an uninitialized library of the given size
+static void initSubModel(const SVM * svm, SVM * sub, int size)
+{
+	initSVM(sub);
+	
+	for (int j = 0; j < NB_FEATURES; ++j) {
+		sub->means[j] = svm->means[j];
+		sub->stds[j] = svm->stds[j];
+	}
+	
+	sub->kernel = svm->kernel;
+	sub->sigma = svm->sigma;
+	sub->precision = svm->precision;
+	sub->pruning = svm->pruning;
+	sub->C = svm->C;
+	sub->epsilon = svm->epsilon;
+	sub->solver = svm->solver;
+	sub->tolerance = svm->tolerance;
+	sub->nbWorkers = svm->nbWorkers;
+	sub->cacheSize = svm->cacheSize / svm->nbModels;
+	sub->trainFeat = gsl_matrix_alloc(size, svm->trainFeat->size2);
+	sub->trainY = gsl_vector_alloc(size);
+	sub->alpha = gsl_vector_calloc(size);
+	sub->weights = svm->weights ? gsl_vector_alloc(size) : NULL;
+}
+
+// Copy the library sample i of svm to the row r of the library of sub
+static void copySubModelSample(const SVM * svm, int i, SVM * sub, int r)
+{
+	for (int j = 0; j < svm->trainFeat->size2; ++j)
+		gsl_matrix_set(sub->trainFeat, r, j, gsl_matrix_get(svm->trainFeat, i, j));
+	
+	gsl_vector_set(sub->trainY, r, gsl_vector_get(svm->trainY, i));
+	
+	if (sub->weights)
+		gsl_vector_set(sub->weights, r, svm->weights ? gsl_vector_get(svm->weights, i) : 1.0);
+}
+
+// Training threads running in this process (sub-models and live models), fork() is only safe while there are none
+static atomic_int trainingThreads;
+
+// Queue of sub-models shared by the training threads
+struct subModelJobStruct {
+	SVM * models;
+	int nbModels;
+	int next;
+	int status; // -1 once a sub-model could not be trained
+	pthread_mutex_t lock;
+};
+
+static void * trainSubModelWorker(void * arg)
+{
+	struct subModelJobStruct * job = arg;
+	
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		int k = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		
+		if (k >= job->nbModels)
+			return NULL;
+		
+		if (trainSVM(&job->models[k])) {
+			pthread_mutex_lock(&job->lock);
+			job->status =-1;
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+}
+
+// Train the sub-models in parallel on all the cores, the calling thread included. Returns -1 if one of them
+// could not be trained.
+static int trainSubModels(SVM * models, int m)
+{
+	struct subModelJobStruct job = {models, m, 0, 0};
+	long nbThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
+	
+	if (nbThreads < 1)
+		nbThreads = 1;
+	
+	if (nbThreads > m)
+		nbThreads = m;
+	
+	pthread_t * threads = malloc(nbThreads * sizeof(pthread_t));
+	int nbStarted = 0;
+	
+	pthread_mutex_init(&job.lock, NULL);
+	atomic_fetch_add(&trainingThreads, nbThreads);
+	
+	// Train with the threads that could be started, the calling one takes the remaining sub-models
+	if (threads)
+		for (; nbStarted < nbThreads - 1; ++nbStarted)
+			if (pthread_create(&threads[nbStarted], NULL, trainSubModelWorker, &job))
+				break;
+	
+	trainSubModelWorker(&job);
+	
+	for (i = 0; i < nbStarted; ++i)
+		pthread_join(threads[i], NULL);
+	
+	atomic_fetch_sub(&trainingThreads, nbThreads);
+	pthread_mutex_destroy(&job.lock);
+	free(threads);
+	
+	return job.status;
+}
+
+int trainEnsembleSVM(SVM * svm)
+{
+	const gsl_matrix * xTrain = svm->trainFeat;
+	int n = xTrain->size1;
+	int m = svm->nbModels;
+	int i, j, k;
+	
+	if ((m < 1) || (m > n))
+		return -1;
+	
+	// Shared hyper-parameters, so that all the sub-models average consistently
+	if (svm->C <= 0.0)
+		svm->C = 1000.0;
+	
+	if (svm->sigma <= 0.0)
+		svm->sigma = meanSquaredDistance(xTrain);
+	
+	deleteSubModels(svm);
+	
+	if (svm->chol) {
+		gsl_matrix_free(svm->chol);
+		svm->chol = NULL;
+	}
+	
+	// Assign the samples to the partitions: round robin over a random permutation, or over the samples
+	// sorted on their covariates so that every partition covers the whole cohort
+	struct stratumStruct * strata = malloc(n * sizeof(struct stratumStruct));
+	int * sizes = calloc(m, sizeof(int));
+	
+	svm->partition = malloc(n * sizeof(int));
+	
+	for (i = 0; i < n; ++i) {
+		strata[i].row = gsl_matrix_const_ptr(xTrain, i, 0);
+		strata[i].index = i;
+	}
+	
+	if (svm->stratified) {
+		qsort(strata, n, sizeof(struct stratumStruct), compareStrata);
+	}
+	else {
+		for (i = n - 1; i > 0; --i) {
+			j = rand() % (i + 1);
+			struct stratumStruct tmp = strata[i];
+			strata[i] = strata[j];
+			strata[j] = tmp;
+		}
+	}
+	
+	for (i = 0; i < n; ++i)
+		svm->partition[strata[i].index] = i % m;
+	
+	free(strata);
+	
+	// Copy the partitions (in library order) into the sub-models
+	svm->models = malloc(m * sizeof(SVM));
+	
+	for (i = 0; i < n; ++i)
+		++sizes[svm->partition[i]];
+	
+	for (k = 0; k < m; ++k) {
+		initSubModel(svm, &svm->models[k], sizes[k]);
+		sizes[k] = 0;
+	}
+	
+	for (i = 0; i < n; ++i)
+		copySubModelSample(svm, i, &svm->models[svm->partition[i]], sizes[svm->partition[i]]++);
+	
+	free(sizes);
+	
+	svm->b = 0.0;
+	
+	return trainSubModels(svm->models, m);
+}
+
+// Distance between the covariates of a sample and a cluster center
+static double covariateDistance(const double * feat, const double * center)
+{
+	double d2 = 0.0;
+	
+	for (int j = 0; j < NB_COVARIATES; ++j)
+		d2 += (feat[FEATURE_COVARIATES + j] - center[j]) * (feat[FEATURE_COVARIATES + j] - center[j]);
+	
+	return sqrt(d2);
+}
+
+// k-means (k-means++ seeding, Lloyd iterations) of the library covariates, centers must have k rows
+static void kmeansCovariates(const gsl_matrix * x, gsl_matrix * centers)
+{
+	int n = x->size1;
+	int m = centers->size1;
+	int * assign = malloc(n * sizeof(int));
+	double * d2 = malloc(n * sizeof(double));
+	int * sizes = malloc(m * sizeof(int));
+	int i, j, k, iter;
+	
+	// k-means++: draw each new center with a probability proportional to the squared distance to the others
+	for (k = 0; k < m; ++k) {
+		double sum = 0.0;
+		int c = rand() % n;
+		
+		for (i = 0; k > 0 && i < n; ++i) {
+			double d = covariateDistance(gsl_matrix_const_ptr(x, i, 0), gsl_matrix_const_ptr(centers, k - 1, 0));
+			d2[i] = (k == 1) ? d * d : fmin(d2[i], d * d);
+			sum += d2[i];
+		}
+		
+		if (sum > 0.0) {
+			double r = sum * rand() / ((double) RAND_MAX + 1.0);
+			
+			for (c = 0; c < n - 1 && r >= d2[c]; ++c)
+				r -= d2[c];
+		}
+		
+		for (j = 0; j < NB_COVARIATES; ++j)
+			gsl_matrix_set(centers, k, j, gsl_matrix_get(x, c, FEATURE_COVARIATES + j));
+	}
+	
+	for (i = 0; i < n; ++i)
+		assign[i] =-1;
+	
+	for (iter = 0; iter < 100; ++iter) {
+		int changed = 0;
+		
+		for (i = 0; i < n; ++i) {
+			int best = 0;
+			double bestDist = INFINITY;
+			
+			for (k = 0; k < m; ++k) {
+				double d = covariateDistance(gsl_matrix_const_ptr(x, i, 0), gsl_matrix_const_ptr(centers, k, 0));
+				
+				if (d < bestDist) {
+					bestDist = d;
+					best = k;
+				}
+			}
+			
+			changed += (assign[i] != best);
+			assign[i] = best;
+			d2[i] = bestDist;
+		}
+		
+		if (!changed)
+			break;
+		
+		// Matlab: C(k,:) = mean(X(assign == k,:));
+		gsl_matrix_set_zero(centers);
+		
+		for (k = 0; k < m; ++k)
+			sizes[k] = 0;
+		
+		for (i = 0; i < n; ++i) {
+			++sizes[assign[i]];
+			
+			for (j = 0; j < NB_COVARIATES; ++j)
+				*gsl_matrix_ptr(centers, assign[i], j) += gsl_matrix_get(x, i, FEATURE_COVARIATES + j);
+		}
+		
+		for (k = 0; k < m; ++k) {
+			if (sizes[k] > 0) {
+				for (j = 0; j < NB_COVARIATES; ++j)
+					*gsl_matrix_ptr(centers, k, j) /= sizes[k];
+				
+				continue;
+			}
+			
+			// Reseed an empty cluster on the sample the farthest from its center
+			int farthest = 0;
+			
+			for (i = 1; i < n; ++i)
+				if (d2[i] > d2[farthest])
+					farthest = i;
+			
+			d2[farthest] = 0.0;
+			
+			for (j = 0; j < NB_COVARIATES; ++j)
+				gsl_matrix_set(centers, k, j, gsl_matrix_get(x, farthest, FEATURE_COVARIATES + j));
+		}
+	}
+	
+	free(assign);
+	free(d2);
+	free(sizes);
+}
+
+int clusterMembership(const SVM * svm, const double * feat, int * members)
+{
+	double nearest = INFINITY;
+	int k, nbMembers = 0;
+	
+	for (k = 0; k < svm->nbModels; ++k)
+		nearest = fmin(nearest, covariateDistance(feat, gsl_matrix_const_ptr(svm->centers, k, 0)));
+	
+	for (k = 0; k < svm->nbModels; ++k)
+		if (covariateDistance(feat, gsl_matrix_const_ptr(svm->centers, k, 0)) <= (1.0 + svm->overlap) * nearest)
+			members[nbMembers++] = k;
+	
+	return nbMembers;
+}
+
+int routeQuery(const SVM * svm, const double * feat, int route[2], double weight[2])
+{
+	double dist[2] = {INFINITY, INFINITY};
+	
+	route[0] = route[1] = 0;
+	
+	for (int k = 0; k < svm->nbModels; ++k) {
+		double d = covariateDistance(feat, gsl_matrix_const_ptr(svm->centers, k, 0));
+		
+		if (d < dist[0]) {
+			dist[1] = dist[0];
+			route[1] = route[0];
+			dist[0] = d;
+			route[0] = k;
+		}
+		else if (d < dist[1]) {
+			dist[1] = d;
+			route[1] = k;
+		}
+	}
+	
+	if ((svm->nbRoutes < 2) || (svm->nbModels < 2) || (dist[0] + dist[1] <= 0.0)) {
+		weight[0] = 1.0;
+		return 1;
+	}
+	
+	// Inverse distance weighting of the two nearest clusters
+	weight[0] = dist[1] / (dist[0] + dist[1]);
+	weight[1] = dist[0] / (dist[0] + dist[1]);
+	
+	return 2;
+}
+
+// Rebuild the library of the sub-model of cluster k from the current library and retrain it, returns -1 if it
+// could not be trained
+static int buildClusterModel(SVM * svm, int k)
+{
+	int * members = malloc(svm->nbModels * sizeof(int));
+	int i, c, size = 0, status = 0;
+	
+	for (i = 0; i < svm->trainFeat->size1; ++i)
+		for (c = clusterMembership(svm, gsl_matrix_const_ptr(svm->trainFeat, i, 0), members); c > 0; --c)
+			size += (members[c - 1] == k);
+	
+	// Keep the previous cluster model if the cluster got empty
+	if (size > 0) {
+		deleteSVM(&svm->models[k]);
+		initSubModel(svm, &svm->models[k], size);
+		size = 0;
+		
+		for (i = 0; i < svm->trainFeat->size1; ++i)
+			for (c = clusterMembership(svm, gsl_matrix_const_ptr(svm->trainFeat, i, 0), members); c > 0; --c)
+				if (members[c - 1] == k)
+					copySubModelSample(svm, i, &svm->models[k], size++);
+		
+		status = trainSVM(&svm->models[k]);
+	}
+	
+	free(members);
+	
+	return status;
+}
+
+int trainClusteredSVM(SVM * svm)
+{
+	const gsl_matrix * xTrain = svm->trainFeat;
+	int n = xTrain->size1;
+	int m = svm->nbModels;
+	int i, k, c;
+	
+	if ((m < 1) || (m > n))
+		return -1;
+	
+	if (svm->C <= 0.0)
+		svm->C = 1000.0;
+	
+	if (svm->sigma <= 0.0)
+		svm->sigma = meanSquaredDistance(xTrain);
+	
+	deleteSubModels(svm);
+	
+	if (svm->chol) {
+		gsl_matrix_free(svm->chol);
+		svm->chol = NULL;
+	}
+	
+	svm->centers = gsl_matrix_alloc(m, NB_COVARIATES);
+	kmeansCovariates(xTrain, svm->centers);
+	
+	// Assign the samples to every cluster within the overlap margin, and drop the empty clusters
+	int * members = malloc(m * sizeof(int));
+	int * sizes = calloc(m, sizeof(int));
+	
+	for (i = 0; i < n; ++i)
+		for (c = clusterMembership(svm, gsl_matrix_const_ptr(xTrain, i, 0), members); c > 0; --c)
+			++sizes[members[c - 1]];
+	
+	for (k = 0, c = 0; k < m; ++k) {
+		if (sizes[k] == 0)
+			continue;
+		
+		gsl_vector_const_view center = gsl_matrix_const_row(svm->centers, k);
+		gsl_vector_view dest = gsl_matrix_row(svm->centers, c);
+		gsl_vector_memcpy(&dest.vector, &center.vector);
+		sizes[c++] = sizes[k];
+	}
+	
+	svm->centers->size1 = c;
+	svm->nbModels = c;
+	svm->models = malloc(c * sizeof(SVM));
+	
+	for (k = 0; k < svm->nbModels; ++k) {
+		initSubModel(svm, &svm->models[k], sizes[k]);
+		sizes[k] = 0;
+	}
+	
+	for (i = 0; i < n; ++i) {
+		for (c = clusterMembership(svm, gsl_matrix_const_ptr(xTrain, i, 0), members); c > 0; --c) {
+			k = members[c - 1];
+			copySubModelSample(svm, i, &svm->models[k], sizes[k]++);
+		}
+	}
+	
+	free(members);
+	free(sizes);
+	
+	svm->b = 0.0;
+	
+	return trainSubModels(svm->models, svm->nbModels);
+}
+
+// Write a model, and recursively its sub-models
+static void writeSVM(FILE * file, const SVM * svm)
+{
+	int i, j;
+	int n = svm->trainFeat ? svm->trainFeat->size1 : 0;
+	
+	fprintf(file, "%d %d %d %d %d\n", svm->type, svm->kernel, NB_FEATURES, n, svm->nbModels);
+	fprintf(file, "%.17g %.17g %.17g %.17g\n", svm->sigma, svm->C, svm->epsilon, svm->b);
+	fprintf(file, "%d %.17g %d %.17g %d %.17g\n", svm->precision, svm->pruning, svm->solver, svm->tolerance,
+			svm->stratified, svm->cacheSize);
+	
+	for (j = 0; j < NB_FEATURES; ++j)
+		fprintf(file, "%.17g %.17g\n", svm->means[j], svm->stds[j]);
+	
+	// One sample per line: features, concentration, and coefficient
+	for (i = 0; i < n; ++i) {
+		for (j = 0; j < NB_FEATURES; ++j)
+			fprintf(file, "%.17g ", gsl_matrix_get(svm->trainFeat, i, j));
+		
+		fprintf(file, "%.17g %.17g\n", gsl_vector_get(svm->trainY, i),
+				(svm->type == SVM_SINGLE) ? gsl_vector_get(svm->alpha, i) : 0.0);
+	}
+	
+	// Weights of a coreset library, one per line
+	fprintf(file, "%d\n", svm->weights != NULL);
+	
+	if (svm->weights)
+		for (i = 0; i < n; ++i)
+			fprintf(file, "%.17g\n", gsl_vector_get(svm->weights, i));
+	
+	if (svm->type == SVM_ENSEMBLE)
+		for (i = 0; i < n; ++i)
+			fprintf(file, "%d\n", svm->partition[i]);
+	
+	if (svm->type == SVM_CLUSTERED) {
+		fprintf(file, "%.17g %d\n", svm->overlap, svm->nbRoutes);
+		
+		for (i = 0; i < svm->nbModels; ++i) {
+			for (j = 0; j < NB_COVARIATES; ++j)
+				fprintf(file, "%.17g ", gsl_matrix_get(svm->centers, i, j));
+			
+			fprintf(file, "\n");
+		}
+	}
+	
+	if (svm->type != SVM_SINGLE)
+		for (i = 0; i < svm->nbModels; ++i)
+			writeSVM(file, &svm->models[i]);
+}
+
+// Read a model written by writeSVM in the given file format version, returns -1 on a malformed file
+static int readSVM(FILE * file, int version, SVM * svm)
+{
+	int i, j, n, nbFeatures, weighted = 0;
+	double y, alpha;
+	
+	initSVM(svm);
+	
+	if ((fscanf(file, "%d %d %d %d %d", &svm->type, &svm->kernel, &nbFeatures, &n, &svm->nbModels) != 5) ||
+		(nbFeatures != NB_FEATURES) || (n < 0) || (svm->nbModels < 0))
+		return -1;
+	
+	if (fscanf(file, "%lf %lf %lf %lf", &svm->sigma, &svm->C, &svm->epsilon, &svm->b) != 4)
+		return -1;
+	
+	// Older files keep the defaults of initSVM for the prediction and training settings
+	if ((version >= 3) && ((fscanf(file, "%d %lf %d %lf %d %lf", &svm->precision, &svm->pruning, &svm->solver,
+								   &svm->tolerance, &svm->stratified, &svm->cacheSize) != 6) ||
+						   (svm->pruning < 0.0)))
+		return -1;
+	
+	for (j = 0; j < NB_FEATURES; ++j)
+		if (fscanf(file, "%lf %lf", &svm->means[j], &svm->stds[j]) != 2)
+			return -1;
+	
+	if (n > 0) {
+		svm->trainFeat = gsl_matrix_alloc(n, NB_FEATURES);
+		svm->trainY = gsl_vector_alloc(n);
+		svm->alpha = gsl_vector_alloc(n);
+	}
+	
+	for (i = 0; i < n; ++i) {
+		for (j = 0; j < NB_FEATURES; ++j)
+			if (fscanf(file, "%lf", gsl_matrix_ptr(svm->trainFeat, i, j)) != 1)
+				return -1;
+		
+		if (fscanf(file, "%lf %lf", &y, &alpha) != 2)
+			return -1;
+		
+		gsl_vector_set(svm->trainY, i, y);
+		gsl_vector_set(svm->alpha, i, alpha);
+	}
+	
+	// Version 1 files have no weights
+	if ((version >= 2) && (fscanf(file, "%d", &weighted) != 1))
+		return -1;
+	
+	if (weighted && (n > 0)) {
+		svm->weights = gsl_vector_alloc(n);
+		
+		for (i = 0; i < n; ++i)
+			if ((fscanf(file, "%lf", gsl_vector_ptr(svm->weights, i)) != 1) ||
+				!(gsl_vector_get(svm->weights, i) > 0.0))
+				return -1;
+	}
+	
+	if (svm->type == SVM_ENSEMBLE) {
+		svm->partition = malloc(n * sizeof(int));
+		
+		for (i = 0; i < n; ++i)
+			if ((fscanf(file, "%d", &svm->partition[i]) != 1) || (svm->partition[i] < 0) ||
+				(svm->partition[i] >= svm->nbModels))
+				return -1;
+	}
+	
+	if (svm->type == SVM_CLUSTERED) {
+		if ((fscanf(file, "%lf %d", &svm->overlap, &svm->nbRoutes) != 2) || (svm->nbModels < 1))
+			return -1;
+		
+		svm->centers = gsl_matrix_alloc(svm->nbModels, NB_COVARIATES);
+		
+		for (i = 0; i < svm->nbModels; ++i)
+			for (j = 0; j < NB_COVARIATES; ++j)
+				if (fscanf(file, "%lf", gsl_matrix_ptr(svm->centers, i, j)) != 1)
+					return -1;
+	}
+	
+	if (svm->type == SVM_SINGLE)
+		indexSVM(svm);
+	else {
+		int nbModels = svm->nbModels;
+		
+		// Zero the count until the sub-models are read, so that a malformed file is freed safely
+		svm->models = calloc(nbModels, sizeof(SVM));
+		svm->nbModels = 0;
+		
+		for (i = 0; i < nbModels; ++i) {
+			int status = readSVM(file, version, &svm->models[i]);
+			svm->nbModels = i + 1;
+			
+			if (status)
+				return -1;
+		}
+	}
+	
+	stampSVM(svm);
+	
+	return 0;
+}
+
+int saveSVM(const SVM * svm, const char * filename)
+{
+	FILE * file = fopen(filename, "w");
+	
+	if (file == NULL) {
+		fprintf(stderr, "Could not open file %s.\n", filename);
+		return -1;
+	}
+	
+	fprintf(file, "DoseSVM 3\n");
+	writeSVM(file, svm);
+	
+	if (fclose(file))
+		return -1;
+	
+	return 0;
+}
+
+int loadSVM(SVM * svm, const char * filename)
+{
+	FILE * file = fopen(filename, "r");
+	int version = 0;
+	
+	initSVM(svm);
+	
+	if (file == NULL) {
+		fprintf(stderr, "Could not open file %s.\n", filename);
+		return -1;
+	}
+	
+	if ((fscanf(file, "DoseSVM %d", &version) != 1) || (version < 1) || (version > 3) ||
+		readSVM(file, version, svm)) {
+		fprintf(stderr, "Invalid model file %s.\n", filename);
+		fclose(file);
+		deleteSVM(svm);
+		return -1;
+	}
+	
+	fclose(file);
+	
+	return 0;
+}
+
+// Tenfold increases of the regularization tried on a weighted library whose kernel matrix does not factorize
+#define WEIGHTED_MAX_RETRIES 6
+
+// Train a single model (not an ensemble nor clustered), returns -1 if it could not be trained
+static int trainSingleSVM(SVM * svm)
+{
+	if (svm->chol && (svm->epsilon > 0.0) && !svm->weights) {
+		gsl_matrix_free(svm->chol);
+		svm->chol = NULL;
+	}
+	
+	if (svm->weights) {
+		// Only the Cholesky trainer honors the weights of a coreset, the other trainers would fit it as if they
+		// were all 1: regularize more until K + diag(1 ./ (C * w)) factorizes, but never drop the weights
+		svm->b = 0.0;
+		
+		for (int retry = 0; trainCholeskySVM(svm); ++retry) {
+			if (retry == WEIGHTED_MAX_RETRIES) {
+				gsl_vector_set_zero(svm->alpha);
+				return -1;
+			}
+			
+			svm->C /= 10.0;
+		}
+	}
+	else if (svm->epsilon > 0.0) {
+		trainEpsilonSVR(svm->trainFeat, svm->trainY, svm->kernel, &svm->C, &svm->sigma, svm->epsilon,
+						svm->cacheSize, svm->alpha, &svm->b);
+	}
+	else {
+		svm->b = 0.0;
+		
+		// Fall back to the least squares solvers if K + I / C cannot be factorized
+		if (svm->solver != SOLVER_CHOLESKY) {
+			const KernelFunctions * kernel = selectKernel(svm->kernel, svm->trainFeat->size2);
+			int status;
+			
+			if (svm->chol) {
+				gsl_matrix_free(svm->chol);
+				svm->chol = NULL;
+			}
+			
+			if (svm->solver == SOLVER_HODLR)
+				status = trainHODLRSVM(kernel, svm->trainFeat, svm->trainY, &svm->C, &svm->sigma, svm->tolerance,
+									   svm->alpha);
+			else if (svm->solver == SOLVER_SPARSE)
+				status = trainSparseSVM(kernel, svm->trainFeat, svm->trainY, &svm->C, &svm->sigma, svm->alpha);
+			else
+				status = trainShardedSVM(kernel, svm->trainFeat, svm->trainY, &svm->C, &svm->sigma, svm->nbWorkers,
+										 svm->tolerance, svm->alpha);
+			
+			if (status == 0)
+				return 0;
+		}
+		else if (trainCholeskySVM(svm) == 0)
+			return 0;
+		
+		if (svm->kernel == KERNEL_GAUSSIAN)
+			trainGaussianSVM(svm->trainFeat, svm->trainY, &svm->C, &svm->sigma, svm->alpha);
+		else
+			trainKernelSVM(selectKernel(svm->kernel, svm->trainFeat->size2), svm->trainFeat, svm->trainY,
+						   &svm->C, &svm->sigma, svm->alpha);
+	}
+	
+	return 0;
+}
+
+int trainSVM(SVM * svm)
+{
+	int status;
+	
+	if (svm->type == SVM_ENSEMBLE) {
+		status = trainEnsembleSVM(svm);
+	}
+	else if (svm->type == SVM_CLUSTERED) {
+		status = trainClusteredSVM(svm);
+	}
+	else {
+		status = trainSingleSVM(svm);
+		indexSVM(svm);
+		
+		// The replicates are optional, the model is trained without them
+		if ((status == 0) && (svm->nbBootstrap > 0))
+			trainBootstrapSVM(svm);
+	}
+	
+	stampSVM(svm);
+	
+	return status;
+}
+
+// Matlab: [L, p] = chol(A, 'lower'); In place, with L' mirrored in the upper triangle like gsl_linalg_cholesky_decomp.
+// Returns -1 if A is not numerically positive definite. Unlike GSL it reports this without going through the
+// process-wide error handler, so it can run in the sub-model training threads.
+static int choleskyDecompose(gsl_matrix * A)
+{
+	const int n = A->size1;
+	int i, j, k;
+	
+	// Row-oriented Cholesky-Crout: L(i,j) = (A(i,j) - L(i,1:j-1) * L(j,1:j-1)') / L(j,j), both rows contiguous
+	for (i = 0; i < n; ++i) {
+		double * li = gsl_matrix_ptr(A, i, 0);
+		
+		for (j = 0; j <= i; ++j) {
+			const double * lj = gsl_matrix_const_ptr(A, j, 0);
+			double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0, sum;
+			
+			// Four independent partial sums, the dot product is otherwise bound by the add latency
+			for (k = 0; k + 4 <= j; k += 4) {
+				s0 += li[k] * lj[k];
+				s1 += li[k + 1] * lj[k + 1];
+				s2 += li[k + 2] * lj[k + 2];
+				s3 += li[k + 3] * lj[k + 3];
+			}
+			
+			for (; k < j; ++k)
+				s0 += li[k] * lj[k];
+			
+			sum = li[j] - ((s0 + s1) + (s2 + s3));
+			
+			if (j < i)
+				li[j] = sum / lj[j];
+			else if (sum > 0.0)
+				li[i] = sqrt(sum);
+			else
+				return -1;
+		}
+	}
+	
+	for (i = 0; i < n; ++i)
+		for (j = 0; j < i; ++j)
+			gsl_matrix_set(A, j, i, gsl_matrix_get(A, i, j));
+	
+	return 0;
+}
+
+// Matlab: L = chol(K + diag(1 ./ (C * w)), 'lower'); Returns -1 if not numerically positive definite.
+static int factorizeKernelMatrix(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * weights,
+								 double C, double sigma, gsl_matrix * L)
+{
+	buildKernelMatrix(kernel, xTrain, sigma, L);
+	
+	for (int i = 0; i < xTrain->size1; ++i)
+		gsl_matrix_set(L, i, i, gsl_matrix_get(L, i, i) + 1.0 / (C * (weights ? gsl_vector_get(weights, i) : 1.0)));
+	
+	return choleskyDecompose(L);
+}
+
+int trainCholeskySVM(SVM * svm)
+{
+	const gsl_matrix * xTrain = svm->trainFeat;
+	const KernelFunctions * kernel = selectKernel(svm->kernel, xTrain->size2);
+	
+	if (svm->C <= 0.0)
+		svm->C = 1000.0;
+	
+	if (svm->sigma <= 0.0)
+		svm->sigma = meanSquaredDistance(xTrain);
+	
+	if (svm->chol && (svm->chol->size1 != xTrain->size1)) {
+		gsl_matrix_free(svm->chol);
+		svm->chol = NULL;
+	}
+	
+	if (!svm->chol)
+		svm->chol = gsl_matrix_alloc(xTrain->size1, xTrain->size1);
+	
+	if (factorizeKernelMatrix(kernel, xTrain, svm->weights, svm->C, svm->sigma, svm->chol)) {
+		gsl_matrix_free(svm->chol);
+		svm->chol = NULL;
+		return -1;
+	}
+	
+	// Matlab: alpha = L' \ (L \ y);
+	gsl_vector_memcpy(svm->alpha, svm->trainY);
+	gsl_blas_dtrsv(CblasLower, CblasNoTrans, CblasNonUnit, svm->chol, svm->alpha);
+	gsl_blas_dtrsv(CblasLower, CblasTrans, CblasNonUnit, svm->chol, svm->alpha);
+	
+	return 0;
+}
+
+// Node of a HODLR (hierarchical off-diagonal low rank) factorization of K + I / C. A non-leaf node splits its
+// samples in two halves: A = [A11, U * V'; V * U', A22] = D + Z * J * Z' with D = blkdiag(A11, A22),
+// Z = blkdiag(U, V) and J = [0, I; I, 0], so that by Woodbury A^-1 = D^-1 - D^-1 * Z * S^-1 * Z' * D^-1
+// with S = J + Z' * D^-1 * Z.
+struct hodlrNodeStruct {
+	int size; // Number of samples of the node
+	struct hodlrNodeStruct * left; // First half of the samples (NULL for a leaf)
+	struct hodlrNodeStruct * right; // Second half of the samples (NULL for a leaf)
+	gsl_matrix * chol; // Cholesky factor of the diagonal block (leaf)
+	gsl_matrix * U; // A12 ~= U * V', left size x rank (NULL if the rank is 0)
+	gsl_matrix * V; // Right size x rank
+	gsl_matrix * DinvU; // A11^-1 * U
+	gsl_matrix * DinvV; // A22^-1 * V
+	gsl_matrix * S; // LU factors of S = [U' * A11^-1 * U, I; I, V' * A22^-1 * V]
+	gsl_permutation * perm; // Pivots of S
+	gsl_vector * work; // 2 * rank scratch vector
+};
+
+typedef struct hodlrNodeStruct HODLRNode;
+
+// Samples (in tree order) and parameters shared by the HODLR construction
+typedef struct {
+	const gsl_matrix * x;
+	const KernelFunctions * kernel;
+	double sigma;
+	double Cinv;
+	double tolerance;
+} HODLRBuild;
+
+#define HODLR_LEAF_SIZE 64
+
+// Largest rank of an off-diagonal block, a block that needs more is not low rank at this tolerance
+#define HODLR_MAX_RANK 256
+
+// Columns of U and V allocated for the first crosses of a block, doubled as the rank grows
+#define HODLR_INITIAL_RANK 16
+
+// Key of a sample along the split coordinate, to sort the samples of a tree node
+struct splitKeyStruct {
+	double key;
+	int index;
+};
+
+static int compareSplitKeys(const void * a, const void * b)
+{
+	const struct splitKeyStruct * ka = a;
+	const struct splitKeyStruct * kb = b;
+	
+	if (ka->key != kb->key)
+		return (ka->key < kb->key) ?-1 : 1;
+	
+	return ka->index - kb->index;
+}
+
+// Order the samples perm[0..size-1] as a binary tree: split at the median of the coordinate of largest spread,
+// so that the off-diagonal blocks couple distant groups of samples
+static void hodlrOrder(const gsl_matrix * x, int * perm, int size)
+{
+	struct splitKeyStruct * keys;
+	int i, j, dim = 0;
+	double spread =-1.0;
+	
+	if (size <= HODLR_LEAF_SIZE)
+		return;
+	
+	for (j = 0; j < x->size2; ++j) {
+		double lo = INFINITY, hi =-INFINITY;
+		
+		for (i = 0; i < size; ++i) {
+			lo = fmin(lo, gsl_matrix_get(x, perm[i], j));
+			hi = fmax(hi, gsl_matrix_get(x, perm[i], j));
+		}
+		
+		if (hi - lo > spread) {
+			spread = hi - lo;
+			dim = j;
+		}
+	}
+	
+	keys = malloc(size * sizeof(struct splitKeyStruct));
+	
+	for (i = 0; i < size; ++i) {
+		keys[i].key = gsl_matrix_get(x, perm[i], dim);
+		keys[i].index = perm[i];
+	}
+	
+	qsort(keys, size, sizeof(struct splitKeyStruct), compareSplitKeys);
+	
+	for (i = 0; i < size; ++i)
+		perm[i] = keys[i].index;
+	
+	free(keys);
+	
+	hodlrOrder(x, perm, size / 2);
+	hodlrOrder(x, perm + size / 2, size - size / 2);
+}
+
+// Compress the off-diagonal block K(r0:r0+nr, c0:c0+nc) ~= U * V' by adaptive cross approximation with partial
+// pivoting, up to the relative tolerance (Frobenius norm). U and V are left NULL if the block is negligible.
+// Returns -1 if the block needs more than HODLR_MAX_RANK crosses (or memory is short).
+static int hodlrCompress(HODLRBuild * h, int r0, int nr, int c0, int nc, gsl_matrix ** outU, gsl_matrix ** outV)
+{
+	const int dim = h->x->size2;
+	const int fullRank = (nr < nc) ? nr : nc;
+	int maxRank = (fullRank < HODLR_MAX_RANK) ? fullRank : HODLR_MAX_RANK;
+	int capacity = (maxRank < HODLR_INITIAL_RANK) ? maxRank : HODLR_INITIAL_RANK;
+	double * U = malloc((size_t) nr * capacity * sizeof(double)); // Column l of U is U[l * nr ...]
+	double * V = malloc((size_t) nc * capacity * sizeof(double));
+	char * usedRow = calloc(nr, 1);
+	double norm2 = 0.0;
+	int rank = 0, i = 0, ii, j, l, converged = 0;
+	
+	*outU = NULL;
+	*outV = NULL;
+	
+	if (!U || !V || !usedRow) {
+		free(U);
+		free(V);
+		free(usedRow);
+		return -1;
+	}
+	
+	while (rank < maxRank) {
+		if (rank == capacity) {
+			capacity = (2 * capacity < maxRank) ? 2 * capacity : maxRank;
+			
+			double * grownU = realloc(U, (size_t) nr * capacity * sizeof(double));
+			
+			if (grownU)
+				U = grownU;
+			
+			double * grownV = realloc(V, (size_t) nc * capacity * sizeof(double));
+			
+			if (grownV)
+				V = grownV;
+			
+			if (!grownU || !grownV)
+				break;
+		}
+		
+		double * u = U + (size_t) rank * nr;
+		double * v = V + (size_t) rank * nc;
+		int pivot = 0;
+		
+		// Matlab: v = K(i,:) - U(i,:) * V';
+		usedRow[i] = 1;
+		
+		for (j = 0; j < nc; ++j) {
+			v[j] = h->kernel->eval(gsl_matrix_const_ptr(h->x, r0 + i, 0), gsl_matrix_const_ptr(h->x, c0 + j, 0),
+								   dim, h->sigma);
+			
+			for (l = 0; l < rank; ++l)
+				v[j] -= U[(size_t) l * nr + i] * V[(size_t) l * nc + j];
+			
+			if (fabs(v[j]) > fabs(v[pivot]))
+				pivot = j;
+		}
+		
+		if (v[pivot] == 0.0) {
+			// The row is already reproduced exactly, try another one
+			for (i = 0; (i < nr) && usedRow[i]; ++i);
+			
+			if (i == nr) {
+				converged = 1;
+				break;
+			}
+			
+			continue;
+		}
+		
+		for (j = 0; j < nc; ++j)
+			if (j != pivot)
+				v[j] /= v[pivot];
+		
+		v[pivot] = 1.0;
+		
+		// Matlab: u = K(:,pivot) - U * V(pivot,:)';
+		for (ii = 0; ii < nr; ++ii) {
+			u[ii] = h->kernel->eval(gsl_matrix_const_ptr(h->x, r0 + ii, 0), gsl_matrix_const_ptr(h->x, c0 + pivot, 0),
+									dim, h->sigma);
+			
+			for (l = 0; l < rank; ++l)
+				u[ii] -= U[(size_t) l * nr + ii] * V[(size_t) l * nc + pivot];
+		}
+		
+		// Matlab: norm(U * V', 'fro')^2 updated with the new cross
+		double uu = 0.0, vv = 0.0;
+		
+		for (ii = 0; ii < nr; ++ii)
+			uu += u[ii] * u[ii];
+		
+		for (j = 0; j < nc; ++j)
+			vv += v[j] * v[j];
+		
+		for (l = 0; l < rank; ++l) {
+			double uul = 0.0, vvl = 0.0;
+			
+			for (ii = 0; ii < nr; ++ii)
+				uul += u[ii] * U[(size_t) l * nr + ii];
+			
+			for (j = 0; j < nc; ++j)
+				vvl += v[j] * V[(size_t) l * nc + j];
+			
+			norm2 += 2.0 * uul * vvl;
+		}
+		
+		norm2 += uu * vv;
+		++rank;
+		
+		if ((sqrt(uu * vv) <= h->tolerance * sqrt(norm2)) || (rank == fullRank)) {
+			converged = 1;
+			break;
+		}
+		
+		// Next row: largest entry of the new column among the rows not used yet
+		for (i =-1, ii = 0; ii < nr; ++ii)
+			if (!usedRow[ii] && ((i == -1) || (fabs(u[ii]) > fabs(u[i]))))
+				i = ii;
+		
+		if (i == -1) {
+			converged = 1;
+			break;
+		}
+	}
+	
+	if (converged && (rank > 0)) {
+		*outU = gsl_matrix_alloc(nr, rank);
+		*outV = gsl_matrix_alloc(nc, rank);
+		
+		for (l = 0; l < rank; ++l) {
+			for (ii = 0; ii < nr; ++ii)
+				gsl_matrix_set(*outU, ii, l, U[(size_t) l * nr + ii]);
+			
+			for (j = 0; j < nc; ++j)
+				gsl_matrix_set(*outV, j, l, V[(size_t) l * nc + j]);
+		}
+	}
+	
+	free(U);
+	free(V);
+	free(usedRow);
+	
+	return converged ? 0 :-1;
+}
+
+static void hodlrDelete(HODLRNode * node)
+{
+	if (!node)
+		return;
+	
+	hodlrDelete(node->left);
+	hodlrDelete(node->right);
+	
+	if (node->chol) gsl_matrix_free(node->chol);
+	if (node->U) gsl_matrix_free(node->U);
+	if (node->V) gsl_matrix_free(node->V);
+	if (node->DinvU) gsl_matrix_free(node->DinvU);
+	if (node->DinvV) gsl_matrix_free(node->DinvV);
+	if (node->S) gsl_matrix_free(node->S);
+	if (node->perm) gsl_permutation_free(node->perm);
+	if (node->work) gsl_vector_free(node->work);
+	
+	free(node);
+}
+
+// Overwrite x with A^-1 * x, A being the matrix factorized by the node
+static void hodlrSolve(HODLRNode * node, gsl_vector * x)
+{
+	if (!node->left) {
+		// Matlab: x = L' \ (L \ x);
+		gsl_blas_dtrsv(CblasLower, CblasNoTrans, CblasNonUnit, node->chol, x);
+		gsl_blas_dtrsv(CblasLower, CblasTrans, CblasNonUnit, node->chol, x);
+		return;
+	}
+	
+	gsl_vector_view x1 = gsl_vector_subvector(x, 0, node->left->size);
+	gsl_vector_view x2 = gsl_vector_subvector(x, node->left->size, node->right->size);
+	
+	// Matlab: x = D \ x;
+	hodlrSolve(node->left, &x1.vector);
+	hodlrSolve(node->right, &x2.vector);
+	
+	if (!node->U)
+		return;
+	
+	// Matlab: x = x - D^-1 * Z * (S \ (Z' * x));
+	int rank = node->U->size2;
+	gsl_vector_view t1 = gsl_vector_subvector(node->work, 0, rank);
+	gsl_vector_view t2 = gsl_vector_subvector(node->work, rank, rank);
+	
+	gsl_blas_dgemv(CblasTrans, 1.0, node->U, &x1.vector, 0.0, &t1.vector);
+	gsl_blas_dgemv(CblasTrans, 1.0, node->V, &x2.vector, 0.0, &t2.vector);
+	gsl_linalg_LU_svx(node->S, node->perm, node->work);
+	gsl_blas_dgemv(CblasNoTrans,-1.0, node->DinvU, &t1.vector, 1.0, &x1.vector);
+	gsl_blas_dgemv(CblasNoTrans,-1.0, node->DinvV, &t2.vector, 1.0, &x2.vector);
+}
+
+// Factorize the block of the size samples starting at start, returns NULL if a leaf is not positive definite
+static HODLRNode * hodlrFactorize(HODLRBuild * h, int start, int size)
+{
+	HODLRNode * node = calloc(1, sizeof(HODLRNode));
+	int i, j, signum;
+	
+	node->size = size;
+	
+	if (size <= HODLR_LEAF_SIZE) {
+		node->chol = gsl_matrix_alloc(size, size);
+		
+		for (i = 0; i < size; ++i) {
+			for (j = 0; j < size; ++j)
+				gsl_matrix_set(node->chol, i, j, h->kernel->eval(gsl_matrix_const_ptr(h->x, start + i, 0),
+																 gsl_matrix_const_ptr(h->x, start + j, 0),
+																 h->x->size2, h->sigma));
+			
+			gsl_matrix_set(node->chol, i, i, gsl_matrix_get(node->chol, i, i) + h->Cinv);
+		}
+		
+		if (choleskyDecompose(node->chol)) {
+			hodlrDelete(node);
+			return NULL;
+		}
+		
+		return node;
+	}
+	
+	int n1 = size / 2;
+	int n2 = size - n1;
+	
+	node->left = hodlrFactorize(h, start, n1);
+	node->right = hodlrFactorize(h, start + n1, n2);
+	
+	if (!node->left || !node->right) {
+		hodlrDelete(node);
+		return NULL;
+	}
+	
+	if (hodlrCompress(h, start, n1, start + n1, n2, &node->U, &node->V)) {
+		hodlrDelete(node);
+		return NULL;
+	}
+	
+	if (!node->U)
+		return node;
+	
+	int rank = node->U->size2;
+	
+	// Matlab: DinvU = A11 \ U; DinvV = A22 \ V;
+	node->DinvU = gsl_matrix_alloc(n1, rank);
+	node->DinvV = gsl_matrix_alloc(n2, rank);
+	gsl_matrix_memcpy(node->DinvU, node->U);
+	gsl_matrix_memcpy(node->DinvV, node->V);
+	
+	for (j = 0; j < rank; ++j) {
+		gsl_vector_view u = gsl_matrix_column(node->DinvU, j);
+		gsl_vector_view v = gsl_matrix_column(node->DinvV, j);
+		hodlrSolve(node->left, &u.vector);
+		hodlrSolve(node->right, &v.vector);
+	}
+	
+	// Matlab: S = [U' * DinvU, eye(rank); eye(rank), V' * DinvV];
+	node->S = gsl_matrix_calloc(2 * rank, 2 * rank);
+	
+	gsl_matrix_view S11 = gsl_matrix_submatrix(node->S, 0, 0, rank, rank);
+	gsl_matrix_view S22 = gsl_matrix_submatrix(node->S, rank, rank, rank, rank);
+	gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, node->U, node->DinvU, 0.0, &S11.matrix);
+	gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, node->V, node->DinvV, 0.0, &S22.matrix);
+	
+	for (i = 0; i < rank; ++i) {
+		gsl_matrix_set(node->S, i, rank + i, 1.0);
+		gsl_matrix_set(node->S, rank + i, i, 1.0);
+	}
+	
+	node->perm = gsl_permutation_alloc(2 * rank);
+	node->work = gsl_vector_alloc(2 * rank);
+	gsl_linalg_LU_decomp(node->S, node->perm, &signum);
+	
+	return node;
+}
+
+int trainHODLRSVM(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * y, double * C,
+				  double * sigma, double tolerance, gsl_vector * alpha)
+{
+	int n = xTrain->size1;
+	int * perm = malloc(n * sizeof(int));
+	gsl_matrix * x = gsl_matrix_alloc(n, xTrain->size2);
+	gsl_vector * z = gsl_vector_alloc(n);
+	HODLRBuild h;
+	HODLRNode * root;
+	int i, j;
+	
+	assert(y->size == xTrain->size1);
+	
+	if (*C <= 0.0)
+		*C = 1000.0;
+	
+	if (*sigma <= 0.0)
+		*sigma = meanSquaredDistance(xTrain);
+	
+	// Reorder the samples along the tree
+	for (i = 0; i < n; ++i)
+		perm[i] = i;
+	
+	hodlrOrder(xTrain, perm, n);
+	
+	for (i = 0; i < n; ++i) {
+		for (j = 0; j < xTrain->size2; ++j)
+			gsl_matrix_set(x, i, j, gsl_matrix_get(xTrain, perm[i], j));
+		
+		gsl_vector_set(z, i, gsl_vector_get(y, perm[i]));
+	}
+	
+	h.x = x;
+	h.kernel = kernel;
+	h.sigma = *sigma;
+	h.Cinv = 1.0 / *C;
+	h.tolerance = tolerance;
+	
+	root = hodlrFactorize(&h, 0, n);
+	
+	if (root) {
+		// Matlab: alpha(perm) = A \ y(perm);
+		hodlrSolve(root, z);
+		
+		for (i = 0; i < n; ++i)
+			gsl_vector_set(alpha, perm[i], gsl_vector_get(z, i));
+	}
+	
+	hodlrDelete(root);
+	gsl_matrix_free(x);
+	gsl_vector_free(z);
+	free(perm);
+	
+	return root ? 0 : -1;
+}
+
+#if defined(_POSIX_SHARED_MEMORY_OBJECTS) && (_POSIX_SHARED_MEMORY_OBJECTS > 0)
+
+// Spins of a worker waiting at a barrier between two checks that the other workers are still alive
+#define SHARD_POLL_SPINS 1024
+
+// Control block at the start of the shared memory segment of a sharded training, followed by the arrays
+// X (n x dim), y, x, r, p, Ap (n each) and the per-worker partial sums
+struct shardHeaderStruct {
+	atomic_int arrived; // Workers waiting at the current barrier
+	atomic_int generation; // Barriers passed
+	atomic_int failed; // Set once a worker failed or died, every worker then gives up
+	pid_t parent; // Worker 0, which forked the others
+	int n;
+	int dim;
+	int nbWorkers;
+};
+
+// Group of workers of a sharded training. The barrier and the sum reduction are the only communication
+// primitives, so another transport (e.g. MPI across nodes) can replace the shared memory one.
+typedef struct {
+	int rank; // Index of this worker
+	int size; // Number of workers
+	struct shardHeaderStruct * header;
+	double * partials; // One slot per worker and per reduction
+	const pid_t * children; // Workers forked by worker 0, indexed by rank (NULL in the other workers)
+} ShardGroup;
+
+// Whether a worker the calling one depends on is gone: worker 0 watches its children, the others their parent
+static int shardWorkerDied(ShardGroup * group)
+{
+	if (group->rank != 0)
+		return getppid() != group->header->parent;
+	
+	for (int w = 1; w < group->size; ++w) {
+		siginfo_t info;
+		
+		// Do not reap the child, trainShardedSVM collects its status
+		info.si_pid = 0;
+		
+		if ((waitid(P_PID, group->children[w], &info, WEXITED | WNOHANG | WNOWAIT) < 0) || (info.si_pid != 0))
+			return 1;
+	}
+	
+	return 0;
+}
+
+// Wait until every worker arrives. Returns -1 if a worker failed or died meanwhile, so that nobody waits
+// forever on a worker that is gone.
+static int shardBarrier(ShardGroup * group)
+{
+	struct shardHeaderStruct * header = group->header;
+	int generation = atomic_load(&header->generation);
+	
+	// The last worker to arrive resets the count before it releases the others
+	if (atomic_fetch_add(&header->arrived, 1) == group->size - 1) {
+		atomic_store(&header->arrived, 0);
+		atomic_fetch_add(&header->generation, 1);
+	}
+	else {
+		for (long spin = 1; (atomic_load(&header->generation) == generation) && !atomic_load(&header->failed);
+			 ++spin) {
+			if ((spin % SHARD_POLL_SPINS == 0) && shardWorkerDied(group))
+				atomic_store(&header->failed, 1);
+			
+			sched_yield();
+		}
+	}
+	
+	return atomic_load(&header->failed) ?-1 : 0;
+}
+
+// Sum *value over all the workers, in place; slot selects one of the two reduction buffers so that a new
+// reduction cannot overwrite partial sums still being read. Returns -1 if a worker failed.
+static int shardAllreduce(ShardGroup * group, int slot, double * value)
+{
+	double * partials = group->partials + slot * group->size;
+	
+	partials[group->rank] = *value;
+	
+	if (shardBarrier(group))
+		return -1;
+	
+	// Same summation order in every worker, so that all take the same convergence decisions
+	*value = 0.0;
+	
+	for (int w = 0; w < group->size; ++w)
+		*value += partials[w];
+	
+	return 0;
+}
+
+// Conjugate gradient on the rows [lo, hi) owned by the worker, with its block of kernel rows. Returns -1 if a
+// worker failed or the residual did not reach the tolerance in n iterations (the same decision in every worker).
+static int shardConjugateGradient(ShardGroup * group, const KernelFunctions * kernel, double sigma, double Cinv,
+								  double tolerance, double * shared)
+{
+	int n = group->header->n;
+	int dim = group->header->dim;
+	int lo = (long) n * group->rank / group->size;
+	int hi = (long) n * (group->rank + 1) / group->size;
+	double * X = shared;
+	double * y = X + (long) n * dim;
+	double * x = y + n;
+	double * r = x + n;
+	double * p = r + n;
+	double * Ap = p + n;
+	int i, j, iter;
+	
+	// Build the kernel block K(lo:hi,:) + I / C of the worker in private memory
+	gsl_matrix_const_view xTrain = gsl_matrix_const_view_array(X, n, dim);
+	double * K = malloc((long) (hi - lo) * n * sizeof(double));
+	
+	// The others find out at their first barrier
+	if (!K) {
+		atomic_store(&group->header->failed, 1);
+		return -1;
+	}
+	
+	for (i = lo; i < hi; ++i) {
+		kernel->row(X + (long) i * dim, &xTrain.matrix, sigma, K + (long) (i - lo) * n);
+		K[(long) (i - lo) * n + i] += Cinv;
+	}
+	
+	double yy = 0.0, rr = 0.0;
+	
+	for (i = lo; i < hi; ++i) {
+		yy += y[i] * y[i];
+		rr += r[i] * r[i];
+	}
+	
+	if (shardAllreduce(group, 0, &yy) || shardAllreduce(group, 1, &rr)) {
+		free(K);
+		return -1;
+	}
+	
+	for (iter = 0; (iter < n) && (sqrt(rr) > tolerance * sqrt(yy)); ++iter) {
+		// Matlab: Ap = A * p; a = rr / (p' * Ap);
+		double pAp = 0.0;
+		
+		for (i = lo; i < hi; ++i) {
+			const double * Ki = K + (long) (i - lo) * n;
+			double sum = 0.0;
+			
+			for (j = 0; j < n; ++j)
+				sum += Ki[j] * p[j];
+			
+			Ap[i] = sum;
+			pAp += p[i] * sum;
+		}
+		
+		if (shardAllreduce(group, 0, &pAp)) {
+			free(K);
+			return -1;
+		}
+		
+		double a = rr / pAp;
+		double rrNew = 0.0;
+		
+		// Matlab: x = x + a * p; r = r - a * Ap;
+		for (i = lo; i < hi; ++i) {
+			x[i] += a * p[i];
+			r[i] -= a * Ap[i];
+			rrNew += r[i] * r[i];
+		}
+		
+		if (shardAllreduce(group, 1, &rrNew)) {
+			free(K);
+			return -1;
+		}
+		
+		// Matlab: p = r + (rrNew / rr) * p;
+		for (i = lo; i < hi; ++i)
+			p[i] = r[i] + (rrNew / rr) * p[i];
+		
+		rr = rrNew;
+		
+		// The whole p must be updated before the next products
+		if (shardBarrier(group)) {
+			free(K);
+			return -1;
+		}
+	}
+	
+	free(K);
+	
+	return (sqrt(rr) <= tolerance * sqrt(yy)) ? 0 :-1;
+}
+
+int trainShardedSVM(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * y, double * C,
+					double * sigma, int nbWorkers, double tolerance, gsl_vector * alpha)
+{
+	static atomic_int segments;
+	int n = xTrain->size1;
+	int dim = xTrain->size2;
+	char name[64];
+	int i, j, w;
+	
+	assert(y->size == xTrain->size1);
+	
+	if (*C <= 0.0)
+		*C = 1000.0;
+	
+	if (*sigma <= 0.0)
+		*sigma = meanSquaredDistance(xTrain);
+	
+	if (nbWorkers < 1)
+		nbWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	if (nbWorkers < 1)
+		nbWorkers = 1;
+	
+	if (nbWorkers > n)
+		nbWorkers = n;
+	
+	// A child forked from a threaded process may find the heap locked by another thread: the conjugate gradient
+	// runs in the calling process alone when the model is trained by the sub-model or live training threads
+	if (atomic_load(&trainingThreads) > 0)
+		nbWorkers = 1;
+	
+	// Shared segment: header, X, y, x, r, p, Ap, and two reduction buffers
+	size_t headerSize = (sizeof(struct shardHeaderStruct) + 63) / 64 * 64;
+	size_t size = headerSize + ((size_t) n * dim + 5 * (size_t) n + 2 * (size_t) nbWorkers) * sizeof(double);
+	
+	snprintf(name, sizeof(name), "/dosesvm-%ld-%d", (long) getpid(), atomic_fetch_add(&segments, 1));
+	
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	
+	if (fd < 0) {
+		fprintf(stderr, "Could not create the shared memory segment %s.\n", name);
+		return -1;
+	}
+	
+	void * segment = MAP_FAILED;
+	
+	if (ftruncate(fd, size) == 0)
+		segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	
+	// The mapping survives the name and the descriptor, and is inherited by the workers
+	close(fd);
+	shm_unlink(name);
+	
+	if (segment == MAP_FAILED) {
+		fprintf(stderr, "Could not map the shared memory segment %s.\n", name);
+		return -1;
+	}
+	
+	struct shardHeaderStruct * header = segment;
+	double * shared = (double *) ((char *) segment + headerSize);
+	double * ys = shared + (size_t) n * dim;
+	
+	atomic_init(&header->arrived, 0);
+	atomic_init(&header->generation, 0);
+	atomic_init(&header->failed, 0);
+	header->parent = getpid();
+	header->n = n;
+	header->dim = dim;
+	header->nbWorkers = nbWorkers;
+	
+	// Matlab: x = 0; r = y; p = y;
+	for (i = 0; i < n; ++i) {
+		for (j = 0; j < dim; ++j)
+			shared[(size_t) i * dim + j] = gsl_matrix_get(xTrain, i, j);
+		
+		ys[i] = gsl_vector_get(y, i);
+		ys[n + i] = 0.0;
+		ys[2 * n + i] = ys[i];
+		ys[3 * n + i] = ys[i];
+	}
+	
+	pid_t * pids = malloc(nbWorkers * sizeof(pid_t));
+	ShardGroup group = {0, nbWorkers, header, ys + 5 * (size_t) n, pids};
+	int status = 0;
+	
+	if (!pids) {
+		munmap(segment, size);
+		return -1;
+	}
+	
+	fflush(stdout);
+	
+	// The calling process is worker 0
+	for (w = 1; w < nbWorkers; ++w) {
+		pids[w] = fork();
+		
+		if (pids[w] == 0) {
+			group.rank = w;
+			group.children = NULL;
+			_exit(shardConjugateGradient(&group, kernel, *sigma, 1.0 / *C, tolerance, shared) ? 1 : 0);
+		}
+		
+		if (pids[w] < 0) {
+			// The barrier expects every worker: the ones already forked give up at their first barrier
+			fprintf(stderr, "Could not fork the training worker %d.\n", w);
+			atomic_store(&header->failed, 1);
+			nbWorkers = w;
+			status =-1;
+			break;
+		}
+	}
+	
+	if (status == 0)
+		status = shardConjugateGradient(&group, kernel, *sigma, 1.0 / *C, tolerance, shared);
+	
+	for (w = 1; w < nbWorkers; ++w) {
+		int childStatus;
+		
+		if ((waitpid(pids[w], &childStatus, 0) < 0) || !WIFEXITED(childStatus) || WEXITSTATUS(childStatus))
+			status =-1;
+	}
+	
+	if (status == 0) {
+		for (i = 0; i < n; ++i)
+			gsl_vector_set(alpha, i, ys[n + i]);
+	}
+	
+	munmap(segment, size);
+	free(pids);
+	
+	return status;
+}
+
+#else
+
+int trainShardedSVM(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * y, double * C,
+					double * sigma, int nbWorkers, double tolerance, gsl_vector * alpha)
+{
+	// No shared memory objects on this platform
+	return -1;
+}
+
+#endif
+
+// Cells around a point: 3^NB_FEATURES, a factor 3 for the time, the dose and every covariate
+#define CELL_TRIPLE_COVARIATE(name) * 3
+#define NB_CELL_NEIGHBORS (3 * 3 PATIENT_COVARIATES(CELL_TRIPLE_COVARIATE))
+
+_Static_assert(FEATURE_COVARIATES == 2, "NB_CELL_NEIGHBORS counts two features before the covariates");
+
+// Key of the cell of coordinates coords, bits bits per coordinate. Coordinates are clamped to the range of the
+// key, which keeps neighbor cells at most one step apart.
+static unsigned long long cellKey(const long * coords, int dim, int bits)
+{
+	const long half = 1L << (bits - 1);
+	unsigned long long key = 0;
+	
+	for (int k = 0; k < dim; ++k) {
+		long c = coords[k] < -half ? -half : (coords[k] >= half ? half - 1 : coords[k]);
+		key = (key << bits) | (unsigned long long) (c + half);
+	}
+	
+	return key;
+}
+
+static void cellCoords(const CellIndex * index, const double * x, long * coords)
+{
+	for (int k = 0; k < index->dim; ++k)
+		coords[k] = (long) floor(x[k] / index->cellSize);
+}
+
+static int compareCellEntries(const void * a, const void * b)
+{
+	const struct cellEntryStruct * ea = a;
+	const struct cellEntryStruct * eb = b;
+	
+	if (ea->key != eb->key)
+		return (ea->key < eb->key) ?-1 : 1;
+	
+	return ea->index - eb->index;
+}
+
+CellIndex * createCellIndex(const gsl_matrix * x, double cellSize)
+{
+	int n = x->size1;
+	int dim = x->size2;
+	long coords[NB_FEATURES];
+	
+	if ((dim > NB_FEATURES) || (cellSize <= 0.0))
+		return NULL;
+	
+	CellIndex * index = malloc(sizeof(CellIndex));
+	
+	if (!index)
+		return NULL;
+	
+	index->x = x;
+	index->cellSize = cellSize;
+	index->dim = dim;
+	index->bits = 64 / dim < 21 ? 64 / dim : 21;
+	index->size = n;
+	index->entries = malloc(n * sizeof(struct cellEntryStruct));
+	
+	if (!index->entries) {
+		free(index);
+		return NULL;
+	}
+	
+	for (int i = 0; i < n; ++i) {
+		cellCoords(index, gsl_matrix_const_ptr(x, i, 0), coords);
+		index->entries[i].key = cellKey(coords, dim, index->bits);
+		index->entries[i].index = i;
+	}
+	
+	qsort(index->entries, n, sizeof(struct cellEntryStruct), compareCellEntries);
+	
+	return index;
+}
+
+void deleteCellIndex(CellIndex * index)
+{
+	if (index) {
+		free(index->entries);
+		free(index);
+	}
+}
+
+int findCellNeighbors(const CellIndex * index, const double * point, int * neighbors)
+{
+	const int dim = index->dim;
+	const double radius2 = index->cellSize * index->cellSize;
+	unsigned long long keys[NB_CELL_NEIGHBORS];
+	long center[NB_FEATURES], coords[NB_FEATURES];
+	int offsets[NB_FEATURES];
+	int nbKeys = 0, nbNeighbors = 0;
+	int i, k;
+	
+	cellCoords(index, point, center);
+	
+	// Enumerate the 3^dim cells around the point, the last coordinate (least significant in the key) fastest so
+	// that the keys come sorted
+	for (k = 0; k < dim; ++k)
+		offsets[k] = -1;
+	
+	for (;;) {
+		for (k = 0; k < dim; ++k)
+			coords[k] = center[k] + offsets[k];
+		
+		keys[nbKeys++] = cellKey(coords, dim, index->bits);
+		
+		for (k = dim - 1; (k >= 0) && (offsets[k] == 1); --k)
+			offsets[k] = -1;
+		
+		if (k < 0)
+			break;
+		
+		++offsets[k];
+	}
+	
+	int lo = 0;
+	
+	for (int c = 0; c < nbKeys; ++c) {
+		// Clamped cells may share a key, visit each one once
+		if ((c > 0) && (keys[c] == keys[c - 1]))
+			continue;
+		
+		// Matlab: lo = find(entries.key >= keys(c), 1); (the keys are increasing, keep searching from lo)
+		int hi = index->size;
+		
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			
+			if (index->entries[mid].key < keys[c])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		
+		for (i = lo; (i < index->size) && (index->entries[i].key == keys[c]); ++i) {
+			const double * xj = gsl_matrix_const_ptr(index->x, index->entries[i].index, 0);
+			double d2 = 0.0;
+			
+			for (k = 0; k < dim; ++k)
+				d2 += (point[k] - xj[k]) * (point[k] - xj[k]);
+			
+			if (d2 < radius2)
+				neighbors[nbNeighbors++] = index->entries[i].index;
+		}
+	}
+	
+	return nbNeighbors;
+}
+
+// Reorder order[begin ... end - 1] so that the sample of rank k along dimension d is at k, the smaller ones
+// before it and the larger ones after it (quickselect)
+static void selectKDSamples(const gsl_matrix * x, int * order, int begin, int end, int k, int d)
+{
+	while (end - begin > 1) {
+		double pivot = gsl_matrix_get(x, order[(begin + end) / 2], d);
+		int i = begin, j = end - 1;
+		
+		while (i <= j) {
+			while (gsl_matrix_get(x, order[i], d) < pivot)
+				++i;
+			
+			while (gsl_matrix_get(x, order[j], d) > pivot)
+				--j;
+			
+			if (i <= j) {
+				int swap = order[i];
+				order[i++] = order[j];
+				order[j--] = swap;
+			}
+		}
+		
+		if (k <= j)
+			end = j + 1;
+		else if (k >= i)
+			begin = i;
+		else
+			return;
+	}
+}
+
+// Build the node of the samples order[begin ... end - 1] and its subtree, returns its index
+static int buildKDNode(KDTree * tree, const gsl_matrix * x, const gsl_vector * alpha, int * order, int begin,
+					   int end)
+{
+	const int node = tree->nbNodes++;
+	struct kdNodeStruct * nd = &tree->nodes[node];
+	int widest = 0;
+	
+	nd->begin = begin;
+	nd->end = end;
+	nd->left = -1;
+	nd->right = -1;
+	nd->alphaSum = 0.0;
+	
+	for (int d = 0; d < tree->dim; ++d) {
+		nd->lower[d] = INFINITY;
+		nd->upper[d] = -INFINITY;
+	}
+	
+	for (int i = begin; i < end; ++i) {
+		const double * xi = gsl_matrix_const_ptr(x, order[i], 0);
+		
+		for (int d = 0; d < tree->dim; ++d) {
+			nd->lower[d] = fmin(nd->lower[d], xi[d]);
+			nd->upper[d] = fmax(nd->upper[d], xi[d]);
+		}
+		
+		nd->alphaSum += fabs(gsl_vector_get(alpha, order[i]));
+	}
+	
+	for (int d = 1; d < tree->dim; ++d)
+		if (nd->upper[d] - nd->lower[d] > nd->upper[widest] - nd->lower[widest])
+			widest = d;
+	
+	// Duplicated samples cannot be separated
+	if ((end - begin <= KD_LEAF_SIZE) || (nd->upper[widest] == nd->lower[widest]))
+		return node;
+	
+	int middle = (begin + end) / 2;
+	
+	selectKDSamples(x, order, begin, end, middle, widest);
+	
+	// The nodes are allocated once, nd stays valid
+	nd->left = buildKDNode(tree, x, alpha, order, begin, middle);
+	nd->right = buildKDNode(tree, x, alpha, order, middle, end);
+	
+	return node;
+}
+
+KDTree * createKDTree(const gsl_matrix * x, const gsl_vector * alpha)
+{
+	const int n = x->size1;
+	const int dim = x->size2;
+	
+	if ((dim > NB_FEATURES) || (n < 1) || (alpha->size != n))
+		return NULL;
+	
+	KDTree * tree = calloc(1, sizeof(KDTree));
+	int * order = malloc(n * sizeof(int));
+	
+	if (!tree || !order) {
+		free(tree);
+		free(order);
+		return NULL;
+	}
+	
+	tree->dim = dim;
+	tree->size = n;
+	tree->nbNodes = 0;
+	tree->points = malloc((size_t) n * dim * sizeof(double));
+	tree->alpha = malloc(n * sizeof(double));
+	
+	// A binary tree whose leaves hold at least one sample has less than 2n nodes
+	tree->nodes = malloc(2 * n * sizeof(struct kdNodeStruct));
+	
+	if (!tree->points || !tree->alpha || !tree->nodes) {
+		deleteKDTree(tree);
+		free(order);
+		return NULL;
+	}
+	
+	for (int i = 0; i < n; ++i)
+		order[i] = i;
+	
+	buildKDNode(tree, x, alpha, order, 0, n);
+	
+	// Copy the samples in tree order, so that a leaf reads contiguous memory
+	for (int i = 0; i < n; ++i) {
+		for (int d = 0; d < dim; ++d)
+			tree->points[i * dim + d] = gsl_matrix_get(x, order[i], d);
+		
+		tree->alpha[i] = gsl_vector_get(alpha, order[i]);
+	}
+	
+	free(order);
+	
+	return tree;
+}
+
+void deleteKDTree(KDTree * tree)
+{
+	if (tree) {
+		free(tree->points);
+		free(tree->alpha);
+		free(tree->nodes);
+		free(tree);
+	}
+}
+
+// Squared distance from a point to the bounding box of a node
+static double kdBoxDistance(const struct kdNodeStruct * node, const double * point, int dim)
+{
+	double d2 = 0.0;
+	
+	for (int d = 0; d < dim; ++d) {
+		double gap = fmax(node->lower[d] - point[d], point[d] - node->upper[d]);
+		
+		if (gap > 0.0)
+			d2 += gap * gap;
+	}
+	
+	return d2;
+}
+
+double kdTreeGaussian(const KDTree * tree, const double * point, double scale, double maxError, int precision)
+{
+	const int dim = tree->dim;
+	int stack[KD_MAX_DEPTH + 1];
+	int top = 0;
+	double sum = 0.0;
+	double budget = maxError; // Error left to spend
+	double remaining = tree->nodes[0].alphaSum; // Sum of |alpha| not visited yet
+	
+	stack[top++] = 0;
+	
+	// Depth first, nearest child first: the exact leaves near the point leave more budget to the far nodes.
+	// A node is skipped if its bound fits in the share of the budget of its |alpha|, so the total error stays
+	// below maxError.
+	while (top > 0) {
+		const struct kdNodeStruct * node = &tree->nodes[stack[--top]];
+		double bound = node->alphaSum * exp(scale * kdBoxDistance(node, point, dim));
+		
+		if (bound <= budget * fmin(node->alphaSum / remaining, 1.0)) {
+			budget -= bound;
+			remaining -= node->alphaSum;
+			continue;
+		}
+		
+		if (node->left != -1) {
+			const struct kdNodeStruct * left = &tree->nodes[node->left];
+			const struct kdNodeStruct * right = &tree->nodes[node->right];
+			int near = (kdBoxDistance(left, point, dim) <= kdBoxDistance(right, point, dim));
+			
+			stack[top++] = near ? node->right : node->left;
+			stack[top++] = near ? node->left : node->right;
+			continue;
+		}
+		
+		for (int i = node->begin; i < node->end; ++i) {
+			const double * xi = &tree->points[i * dim];
+			double d2 = 0.0;
+			
+			for (int d = 0; d < dim; ++d)
+				d2 += (point[d] - xi[d]) * (point[d] - xi[d]);
+			
+			sum += tree->alpha[i] * ((precision == PRECISION_FAST) ? fastExp(scale * d2) : exp(scale * d2));
+		}
+		
+		remaining -= node->alphaSum;
+	}
+	
+	return sum;
+}
+
+int setSVMPruning(SVM * svm, double pruning)
+{
+	if (pruning < 0.0)
+		return -1;
+	
+	for (int k = 0; k < svm->nbModels; ++k)
+		setSVMPruning(&svm->models[k], pruning);
+	
+	svm->pruning = pruning;
+	
+	if (!pruning) {
+		deleteKDTree(svm->tree);
+		svm->tree = NULL;
+	}
+	else if (!svm->tree && (svm->type == SVM_SINGLE) && (svm->kernel == KERNEL_GAUSSIAN) && svm->trainFeat &&
+			 svm->alpha && !svm->cells) {
+		svm->tree = createKDTree(svm->trainFeat, svm->alpha);
+	}
+	
+	// The cached curves and predictions were computed with the previous error
+	stampSVM(svm);
+	
+	return 0;
+}
+
+// Breadth first search from root over the nodes not ordered yet. Fills queue with the nodes reached (by level)
+// and level with their distance to root; returns their number.
+static int rcmLevels(const int * ptr, const int * adj, const char * ordered, int root, int * level, int * queue)
+{
+	int head = 0, tail = 0;
+	
+	level[root] = 0;
+	queue[tail++] = root;
+	
+	while (head < tail) {
+		int u = queue[head++];
+		
+		for (int e = ptr[u]; e < ptr[u + 1]; ++e) {
+			if (!ordered[adj[e]] && (level[adj[e]] < 0)) {
+				level[adj[e]] = level[u] + 1;
+				queue[tail++] = adj[e];
+			}
+		}
+	}
+	
+	return tail;
+}
+
+// Reverse Cuthill-McKee ordering of a symmetric graph (adjacency lists ptr / adj), perm[new] = old.
+// Each connected component starts from a pseudo-peripheral node (George and Liu).
+static void reverseCuthillMcKee(int n, const int * ptr, const int * adj, int * perm)
+{
+	char * ordered = calloc(n, 1);
+	int * level = malloc(n * sizeof(int));
+	int * queue = malloc(n * sizeof(int));
+	int nbOrdered = 0;
+	int i, e;
+	
+	for (i = 0; i < n; ++i)
+		level[i] = -1;
+	
+	while (nbOrdered < n) {
+		int root = -1;
+		
+		for (i = 0; i < n; ++i)
+			if (!ordered[i] && ((root < 0) || (ptr[i + 1] - ptr[i] < ptr[root + 1] - ptr[root])))
+				root = i;
+		
+		// Move the root to a node of minimum degree in the last level while the eccentricity grows
+		for (int iter = 0; iter < 8; ++iter) {
+			int size = rcmLevels(ptr, adj, ordered, root, level, queue);
+			int depth = level[queue[size - 1]];
+			int next = root;
+			
+			for (i = size - 1; (i >= 0) && (level[queue[i]] == depth); --i)
+				if ((next == root) || (ptr[queue[i] + 1] - ptr[queue[i]] < ptr[next + 1] - ptr[next]))
+					next = queue[i];
+			
+			for (i = 0; i < size; ++i)
+				level[queue[i]] = -1;
+			
+			if (next == root)
+				break;
+			
+			size = rcmLevels(ptr, adj, ordered, next, level, queue);
+			int nextDepth = level[queue[size - 1]];
+			
+			for (i = 0; i < size; ++i)
+				level[queue[i]] = -1;
+			
+			if (nextDepth <= depth)
+				break;
+			
+			root = next;
+		}
+		
+		// Cuthill-McKee: breadth first, the neighbors of each node by increasing degree
+		int head = nbOrdered;
+		
+		perm[nbOrdered++] = root;
+		ordered[root] = 1;
+		
+		while (head < nbOrdered) {
+			int u = perm[head++];
+			int first = nbOrdered;
+			
+			for (e = ptr[u]; e < ptr[u + 1]; ++e) {
+				if (!ordered[adj[e]]) {
+					ordered[adj[e]] = 1;
+					perm[nbOrdered++] = adj[e];
+				}
+			}
+			
+			for (i = first + 1; i < nbOrdered; ++i) {
+				int v = perm[i], j = i;
+				
+				for (; (j > first) && (ptr[perm[j - 1] + 1] - ptr[perm[j - 1]] > ptr[v + 1] - ptr[v]); --j)
+					perm[j] = perm[j - 1];
+				
+				perm[j] = v;
+			}
+		}
+	}
+	
+	// Reverse
+	for (i = 0; i < n / 2; ++i) {
+		int tmp = perm[i];
+		perm[i] = perm[n - 1 - i];
+		perm[n - 1 - i] = tmp;
+	}
+	
+	free(ordered);
+	free(level);
+	free(queue);
+}
+
+int trainSparseSVM(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * y, double * C,
+				   double * sigma, gsl_vector * alpha)
+{
+	int n = xTrain->size1;
+	int dim = xTrain->size2;
+	int i, j, k, e;
+	
+	assert(y->size == xTrain->size1);
+	
+	if (!kernel->compact)
+		return -1;
+	
+	if (*C <= 0.0)
+		*C = 1000.0;
+	
+	if (*sigma <= 0.0)
+		*sigma = meanSquaredDistance(xTrain);
+	
+	CellIndex * index = createCellIndex(xTrain, *sigma);
+	
+	if (!index)
+		return -1;
+	
+	// Adjacency lists of the nonzeros of K (the samples within the support radius)
+	int * ptr = malloc((n + 1) * sizeof(int));
+	int * neighbors = malloc(n * sizeof(int));
+	long capacity = 16L * n, nnz = 0;
+	int * adj = malloc(capacity * sizeof(int));
+	
+	for (i = 0; i < n; ++i) {
+		int count = findCellNeighbors(index, gsl_matrix_const_ptr(xTrain, i, 0), neighbors);
+		
+		ptr[i] = nnz;
+		
+		if (nnz + count > capacity) {
+			capacity = 2 * (nnz + count);
+			adj = realloc(adj, capacity * sizeof(int));
+		}
+		
+		for (k = 0; k < count; ++k)
+			if (neighbors[k] != i)
+				adj[nnz++] = neighbors[k];
+	}
+	
+	ptr[n] = nnz;
+	deleteCellIndex(index);
+	free(neighbors);
+	
+	// Fill-reducing (envelope) ordering, and the first column of each row of the envelope of the permuted matrix
+	int * perm = malloc(n * sizeof(int));
+	int * inverse = malloc(n * sizeof(int));
+	int * first = malloc(n * sizeof(int));
+	long * start = malloc((n + 1) * sizeof(long));
+	
+	reverseCuthillMcKee(n, ptr, adj, perm);
+	
+	for (i = 0; i < n; ++i)
+		inverse[perm[i]] = i;
+	
+	for (i = 0, start[0] = 0; i < n; ++i) {
+		first[i] = i;
+		
+		for (e = ptr[perm[i]]; e < ptr[perm[i] + 1]; ++e)
+			if (inverse[adj[e]] < first[i])
+				first[i] = inverse[adj[e]];
+		
+		start[i + 1] = start[i] + (i - first[i] + 1);
+	}
+	
+	// Envelope storage: L(i, j) = env[start[i] + j - first[i]] for first[i] <= j <= i
+	double * env = calloc(start[n], sizeof(double));
+	const double Cinv = 1.0 / *C;
+	
+	for (i = 0; i < n; ++i) {
+		const double * xi = gsl_matrix_const_ptr(xTrain, perm[i], 0);
+		
+		for (e = ptr[perm[i]]; e < ptr[perm[i] + 1]; ++e) {
+			j = inverse[adj[e]];
+			
+			if (j < i)
+				env[start[i] + j - first[i]] = kernel->eval(xi, gsl_matrix_const_ptr(xTrain, adj[e], 0), dim, *sigma);
+		}
+		
+		env[start[i + 1] - 1] = kernel->eval(xi, xi, dim, *sigma) + Cinv;
+	}
+	
+	free(ptr);
+	free(adj);
+	
+	// Matlab: L = chol(K(perm, perm) + eye(n) / C, 'lower'); row by row inside the envelope
+	int status = 0;
+	
+	for (i = 0; (i < n) && (status == 0); ++i) {
+		double * Li = env + start[i] - first[i];
+		
+		for (j = first[i]; j < i; ++j) {
+			const double * Lj = env + start[j] - first[j];
+			double sum = Li[j];
+			
+			for (k = first[i] > first[j] ? first[i] : first[j]; k < j; ++k)
+				sum -= Li[k] * Lj[k];
+			
+			Li[j] = sum / Lj[j];
+		}
+		
+		double diag = Li[i];
+		
+		for (k = first[i]; k < i; ++k)
+			diag -= Li[k] * Li[k];
+		
+		if (diag <= 0.0)
+			status =-1;
+		else
+			Li[i] = sqrt(diag);
+	}
+	
+	if (status == 0) {
+		// Matlab: x = L' \ (L \ y(perm)); alpha(perm) = x;
+		double * x = malloc(n * sizeof(double));
+		
+		for (i = 0; i < n; ++i) {
+			const double * Li = env + start[i] - first[i];
+			double sum = gsl_vector_get(y, perm[i]);
+			
+			for (k = first[i]; k < i; ++k)
+				sum -= Li[k] * x[k];
+			
+			x[i] = sum / Li[i];
+		}
+		
+		for (i = n - 1; i >= 0; --i) {
+			const double * Li = env + start[i] - first[i];
+			
+			x[i] /= Li[i];
+			
+			for (k = first[i]; k < i; ++k)
+				x[k] -= Li[k] * x[i];
+		}
+		
+		for (i = 0; i < n; ++i)
+			gsl_vector_set(alpha, perm[i], x[i]);
+		
+		free(x);
+	}
+	
+	free(perm);
+	free(inverse);
+	free(first);
+	free(start);
+	free(env);
+	
+	return status;
+}
+
+int trainMultiKernelSVM(const KernelFunctions * kernel, const gsl_matrix * xTrain, const gsl_vector * weights,
+						const gsl_matrix * y, double * C, double * sigma, gsl_matrix * alpha)
+{
+	int n = xTrain->size1;
+	
+	assert((y->size1 == xTrain->size1) && (alpha->size1 == y->size1) && (alpha->size2 == y->size2));
+	
+	if (*C <= 0.0)
+		*C = 1000.0;
+	
+	if (*sigma <= 0.0)
+		*sigma = meanSquaredDistance(xTrain);
+	
+	gsl_matrix * L = gsl_matrix_alloc(n, n);
+	int status = factorizeKernelMatrix(kernel, xTrain, weights, *C, *sigma, L);
+	
+	if (status == 0) {
+		// Matlab: alpha = L' \ (L \ Y);
+		gsl_matrix_memcpy(alpha, y);
+		gsl_blas_dtrsm(CblasLeft, CblasLower, CblasNoTrans, CblasNonUnit, 1.0, L, alpha);
+		gsl_blas_dtrsm(CblasLeft, CblasLower, CblasTrans, CblasNonUnit, 1.0, L, alpha);
+	}
+	
+	gsl_matrix_free(L);
+	
+	return status;
+}
+
+int trainBootstrapSVM(SVM * svm)
+{
+	int nbReplicates = svm->nbBootstrap;
+	int n, i, b, status = 0;
+	
+	if ((svm->type != SVM_SINGLE) || (svm->epsilon > 0.0) || (nbReplicates < 1) || !isTrainedSVM(svm))
+		return -1;
+	
+	n = svm->trainFeat->size1;
+	
+	// Without the factor of the model the replicates take a dense O(N^3) solve, only worth it for the dense
+	// solver: the replicates of a previous training are dropped
+	const int factored = svm->chol && (svm->chol->size1 == n);
+	const int solvable = factored || (svm->solver == SOLVER_CHOLESKY);
+	
+	if (svm->bootAlpha && (!solvable || (svm->bootAlpha->size1 != n) || (svm->bootAlpha->size2 != nbReplicates))) {
+		gsl_matrix_free(svm->bootAlpha);
+		gsl_vector_free(svm->bootNoise);
+		svm->bootAlpha = NULL;
+		svm->bootNoise = NULL;
+	}
+	
+	if (!solvable)
+		return -1;
+	
+	if (!svm->bootAlpha) {
+		svm->bootAlpha = gsl_matrix_alloc(n, nbReplicates);
+		svm->bootNoise = gsl_vector_alloc(nbReplicates);
+	}
+	
+	// (K + D) * alpha = y with D = I / C, so the fitted values are K * alpha = y - D * alpha and the residuals
+	// D * alpha
+	double * residuals = malloc(n * sizeof(double));
+	double mean = 0.0;
+	
+	if (!svm->bootAlpha || !svm->bootNoise || !residuals) {
+		gsl_matrix_free(svm->bootAlpha);
+		gsl_vector_free(svm->bootNoise);
+		svm->bootAlpha = NULL;
+		svm->bootNoise = NULL;
+		free(residuals);
+		return -1;
+	}
+	
+	for (i = 0; i < n; ++i) {
+		residuals[i] = gsl_vector_get(svm->alpha, i) / (svm->C * (svm->weights ? gsl_vector_get(svm->weights, i) : 1.0));
+		mean += residuals[i] / n;
+	}
+	
+	for (i = 0; i < n; ++i)
+		residuals[i] -= mean;
+	
+	// Matlab: Y(:,b) = (y - r) + r(randi(n, n, 1)); one column per replicate
+	for (b = 0; b < nbReplicates; ++b) {
+		for (i = 0; i < n; ++i)
+			gsl_matrix_set(svm->bootAlpha, i, b, gsl_vector_get(svm->trainY, i) - residuals[i] - mean +
+						   residuals[rand() % n]);
+		
+		gsl_vector_set(svm->bootNoise, b, residuals[rand() % n]);
+	}
+	
+	free(residuals);
+	
+	// All the replicates against the factor of the model
+	if (factored) {
+		gsl_blas_dtrsm(CblasLeft, CblasLower, CblasNoTrans, CblasNonUnit, 1.0, svm->chol, svm->bootAlpha);
+		gsl_blas_dtrsm(CblasLeft, CblasLower, CblasTrans, CblasNonUnit, 1.0, svm->chol, svm->bootAlpha);
+	}
+	else {
+		gsl_matrix * y = duplicateMatrix(svm->bootAlpha);
+		
+		status = trainMultiKernelSVM(selectKernel(svm->kernel, svm->trainFeat->size2), svm->trainFeat, svm->weights,
+									 y, &svm->C, &svm->sigma, svm->bootAlpha);
+		gsl_matrix_free(y);
+	}
+	
+	if (status) {
+		gsl_matrix_free(svm->bootAlpha);
+		gsl_vector_free(svm->bootNoise);
+		svm->bootAlpha = NULL;
+		svm->bootNoise = NULL;
+	}
+	
+	return status;
+}
+
+static int compareDoubles(const void * a, const void * b)
+{
+	double da = *(const double *) a;
+	double db = *(const double *) b;
+	
+	return (da > db) - (da < db);
+}
+
+int predictIntervalSVM(const SVM * svm, const gsl_matrix * xTest, double level, gsl_vector * y, gsl_vector * lower,
+					   gsl_vector * upper)
+{
+	if (!svm->bootAlpha || !isTrainedSVM(svm) || (svm->bootAlpha->size1 != svm->trainFeat->size1) ||
+		(level <= 0.0) || (level >= 1.0))
+		return -1;
+	
+	const KernelFunctions * kernel = selectKernel(svm->kernel, xTest->size2);
+	int m = xTest->size1;
+	int n = svm->trainFeat->size1;
+	int nbReplicates = svm->bootAlpha->size2;
+	int i, b;
+	
+	predictSVM(svm, xTest, y);
+	
+	// Matlab: P = K(xTest, xTrain) * A; all the replicates at once
+	gsl_matrix * K = gsl_matrix_alloc(m, n);
+	gsl_matrix * P = gsl_matrix_alloc(m, nbReplicates);
+	double * draws = malloc(nbReplicates * sizeof(double));
+	
+	for (i = 0; i < m; ++i)
+		kernel->row(gsl_matrix_const_ptr(xTest, i, 0), svm->trainFeat, svm->sigma, gsl_matrix_ptr(K, i, 0));
+	
+	gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1.0, K, svm->bootAlpha, 0.0, P);
+	
+	// Quantiles of the replicate predictions plus their residual draws
+	int lo = (int) floor(0.5 * (1.0 - level) * (nbReplicates - 1) + 0.5);
+	int hi = nbReplicates - 1 - lo;
+	
+	for (i = 0; i < m; ++i) {
+		for (b = 0; b < nbReplicates; ++b)
+			draws[b] = gsl_matrix_get(P, i, b) + svm->b + gsl_vector_get(svm->bootNoise, b);
+		
+		qsort(draws, nbReplicates, sizeof(double), compareDoubles);
+		gsl_vector_set(lower, i, draws[lo]);
+		gsl_vector_set(upper, i, draws[hi]);
+	}
+	
+	gsl_matrix_free(K);
+	gsl_matrix_free(P);
+	free(draws);
+	
+	return 0;
+}
+
+int selectCoreset(const KernelFunctions * kernel, const gsl_matrix * x, double sigma, int maxSize, double tolerance,
+				  int * selected)
+{
+	int n = x->size1;
+	int dim = x->size2;
+	int i, t;
+	
+	if (maxSize > n)
+		maxSize = n;
+	
+	double * mu = calloc(n, sizeof(double));
+	double * g = calloc(n, sizeof(double));
+	double * row = malloc(n * sizeof(double));
+	char * taken = calloc(n, 1);
+	double A = 0.0, S1 = 0.0, S2 = 0.0;
+	
+	// Matlab: mu = mean(K, 2); the kernel mean embedding of the samples, one row at a time
+	for (i = 0; i < n; ++i) {
+		kernel->row(gsl_matrix_const_ptr(x, i, 0), x, sigma, row);
+		
+		for (int j = 0; j < n; ++j)
+			mu[i] += row[j] / n;
+		
+		A += mu[i] / n;
+	}
+	
+	// Kernel herding: add the sample maximizing mu(x) - mean(k(x, coreset)), g(x) = sum(k(x, coreset))
+	for (t = 0; t < maxSize; ++t) {
+		int best = -1;
+		
+		for (i = 0; i < n; ++i)
+			if (!taken[i] && ((best < 0) || (mu[i] - g[i] / (t + 1) > mu[best] - g[best] / (t + 1))))
+				best = i;
+		
+		const double * xb = gsl_matrix_const_ptr(x, best, 0);
+		
+		// Matlab: S2 = sum(sum(K(coreset, coreset)));
+		S1 += mu[best];
+		S2 += 2.0 * g[best] + kernel->eval(xb, xb, dim, sigma);
+		selected[t] = best;
+		taken[best] = 1;
+		kernel->row(xb, x, sigma, row);
+		
+		for (i = 0; i < n; ++i)
+			g[i] += row[i];
+		
+		// Matlab: mmd2 = mean(K(:)) - 2 * mean(mu(coreset)) + mean(mean(K(coreset, coreset)));
+		double mmd2 = A - 2.0 * S1 / (t + 1) + S2 / ((double) (t + 1) * (t + 1));
+		
+		if (sqrt(mmd2 > 0.0 ? mmd2 : 0.0) <= tolerance) {
+			++t;
+			break;
+		}
+	}
+	
+	free(mu);
+	free(g);
+	free(row);
+	free(taken);
+	
+	return t;
+}
+
+int reduceSVMLibrary(SVM * svm, int maxSize, double tolerance)
+{
+	if (!svm || (svm->type != SVM_SINGLE) || !svm->trainFeat || (maxSize < 1))
+		return -1;
+	
+	const gsl_matrix * xTrain = svm->trainFeat;
+	const KernelFunctions * kernel = selectKernel(svm->kernel, xTrain->size2);
+	int n = xTrain->size1;
+	int dim = xTrain->size2;
+	int i, j, s, m;
+	
+	if (svm->sigma <= 0.0)
+		svm->sigma = meanSquaredDistance(xTrain);
+	
+	int * selected = malloc((maxSize < n ? maxSize : n) * sizeof(int));
+	
+	m = selectCoreset(kernel, xTrain, svm->sigma, maxSize, tolerance, selected);
+	
+	// Every sample is represented by its most similar coreset sample, which takes its weight and the
+	// weighted mean of its concentrations (the ridge solution of its duplicates)
+	double * weights = calloc(m, sizeof(double));
+	double * sums = calloc(m, sizeof(double));
+	
+	for (i = 0; i < n; ++i) {
+		const double * xi = gsl_matrix_const_ptr(xTrain, i, 0);
+		double w = svm->weights ? gsl_vector_get(svm->weights, i) : 1.0;
+		double best = -1.0;
+		int nearest = 0;
+		
+		for (s = 0; s < m; ++s) {
+			double k = kernel->eval(xi, gsl_matrix_const_ptr(xTrain, selected[s], 0), dim, svm->sigma);
+			
+			if (k > best) {
+				best = k;
+				nearest = s;
+			}
+		}
+		
+		weights[nearest] += w;
+		sums[nearest] += w * gsl_vector_get(svm->trainY, i);
+	}
+	
+	for (s = 0, j = 0; s < m; ++s)
+		j += (weights[s] > 0.0);
+	
+	gsl_matrix * feat = gsl_matrix_alloc(j, dim);
+	gsl_vector * y = gsl_vector_alloc(j);
+	gsl_vector * w = gsl_vector_alloc(j);
+	
+	for (s = 0, j = 0; s < m; ++s) {
+		if (weights[s] <= 0.0)
+			continue;
+		
+		for (int k = 0; k < dim; ++k)
+			gsl_matrix_set(feat, j, k, gsl_matrix_get(xTrain, selected[s], k));
+		
+		gsl_vector_set(y, j, sums[s] / weights[s]);
+		gsl_vector_set(w, j, weights[s]);
+		++j;
+	}
+	
+	// The model now describes the coreset, drop everything computed on the full library
+	deleteSVM(svm);
+	svm->trainFeat = feat;
+	svm->trainY = y;
+	svm->weights = w;
+	svm->alpha = gsl_vector_calloc(j);
+	
+	free(selected);
+	free(weights);
+	free(sums);
+	
+	return j;
+}
+
+// Rank one update (sign > 0) or downdate (sign < 0) of the lower Cholesky factor: L * L' + sign * w * w'.
+// w is overwritten. Returns -1 if the downdated matrix is not numerically positive definite.
+static int choleskyRankOne(gsl_matrix * L, double * w, double sign)
+{
+	int n = L->size1;
+	int i, k;
+	
+	for (k = 0; k < n; ++k) {
+		double Lkk = gsl_matrix_get(L, k, k);
+		double r2 = Lkk * Lkk + sign * w[k] * w[k];
+		
+		if (r2 <= 0.0)
+			return -1;
+		
+		double r = sqrt(r2);
+		double c = r / Lkk;
+		double s = w[k] / Lkk;
+		
+		gsl_matrix_set(L, k, k, r);
+		
+		for (i = k + 1; i < n; ++i) {
+			double Lik = (gsl_matrix_get(L, i, k) + sign * s * w[i]) / c;
+			gsl_matrix_set(L, i, k, Lik);
+			w[i] = c * w[i] - s * Lik;
+		}
+	}
+	
+	return 0;
+}
+
+// Write a new sample at row r of the library, standing for itself only (weight 1)
+static void setLibrarySample(SVM * svm, int r, const double * feat, double y)
+{
+	for (int j = 0; j < svm->trainFeat->size2; ++j)
+		gsl_matrix_set(svm->trainFeat, r, j, feat[j]);
+	
+	gsl_vector_set(svm->trainY, r, y);
+	
+	if (svm->weights)
+		gsl_vector_set(svm->weights, r, 1.0);
+}
+
+// Replace the library sample r and update the Cholesky factor accordingly, without solving for alpha.
+// Returns -1 if the factor lost positive definiteness (the library is updated anyway).
+static int updateCholeskySample(SVM * svm, int r, const double * feat, double y)
+{
+	gsl_matrix * xTrain = svm->trainFeat;
+	const KernelFunctions * kernel = selectKernel(svm->kernel, xTrain->size2);
+	int n = xTrain->size1;
+	double weight = svm->weights ? gsl_vector_get(svm->weights, r) : 1.0;
+	int j, status = 0;
+	double * v = malloc(n * sizeof(double));
+	double * w1 = malloc(n * sizeof(double));
+	double * w2 = malloc(n * sizeof(double));
+	
+	// Matlab: v = K(:,r) before the replacement
+	kernel->row(gsl_matrix_const_ptr(xTrain, r, 0), xTrain, svm->sigma, v);
+	
+	setLibrarySample(svm, r, feat, y);
+	
+	// Matlab: v = K(:,r) after - K(:,r) before; (the kernel diagonal is unchanged)
+	kernel->row(feat, xTrain, svm->sigma, w1);
+	
+	for (j = 0; j < n; ++j)
+		v[j] = w1[j] - v[j];
+	
+	// The new sample stands for itself only (weight 1), its regularization 1 / (C * weight) changes on the diagonal
+	v[r] = 0.5 * (1.0 - 1.0 / weight) / svm->C;
+	
+	// K + e_r * v' + v * e_r' = K + w1 * w1' - w2 * w2' with w1 = (e_r + v) / sqrt(2) and w2 = (e_r - v) / sqrt(2)
+	for (j = 0; j < n; ++j) {
+		w1[j] = ((j == r) + v[j]) * sqrt(0.5);
+		w2[j] = ((j == r) - v[j]) * sqrt(0.5);
+	}
+	
+	if (choleskyRankOne(svm->chol, w1, 1.0) || choleskyRankOne(svm->chol, w2,-1.0))
+		status =-1;
+	
+	free(v);
+	free(w1);
+	free(w2);
+	
+	return status;
+}
+
+// Matlab: alpha = chol' \ (chol \ y);
+static void solveCholeskySVM(SVM * svm)
+{
+	gsl_vector_memcpy(svm->alpha, svm->trainY);
+	gsl_blas_dtrsv(CblasLower, CblasNoTrans, CblasNonUnit, svm->chol, svm->alpha);
+	gsl_blas_dtrsv(CblasLower, CblasTrans, CblasNonUnit, svm->chol, svm->alpha);
+	
+	if (svm->nbBootstrap > 0)
+		trainBootstrapSVM(svm);
+}
+
+int updateSVMSample(SVM * svm, int r, const double * feat, double y)
+{
+	gsl_matrix * xTrain = svm->trainFeat;
+	int n = xTrain->size1;
+	int j, status = 0;
+	
+	if ((r < 0) || (r >= n))
+		return -1;
+	
+	if (svm->type == SVM_CLUSTERED) {
+		// Retrain the clusters the sample leaves or joins, the centers do not move
+		char * affected = calloc(svm->nbModels, 1);
+		int * members = malloc(svm->nbModels * sizeof(int));
+		int k, nbMembers;
+		
+		nbMembers = clusterMembership(svm, gsl_matrix_const_ptr(xTrain, r, 0), members);
+		
+		for (k = 0; k < nbMembers; ++k)
+			affected[members[k]] = 1;
+		
+		setLibrarySample(svm, r, feat, y);
+		nbMembers = clusterMembership(svm, feat, members);
+		
+		for (k = 0; k < nbMembers; ++k)
+			affected[members[k]] = 1;
+		
+		for (k = 0; k < svm->nbModels; ++k)
+			if (affected[k] && buildClusterModel(svm, k))
+				status =-1;
+		
+		free(affected);
+		free(members);
+	}
+	else if (svm->type == SVM_ENSEMBLE) {
+		// Update only the sub-model holding the sample, if its library still mirrors the partition
+		int k = svm->partition[r];
+		int index = 0, size = 0;
+		
+		setLibrarySample(svm, r, feat, y);
+		
+		for (j = 0; j < n; ++j) {
+			if (svm->partition[j] == k) {
+				index += (j < r);
+				++size;
+			}
+		}
+		
+		if (svm->models[k].trainFeat->size1 != size)
+			status = trainEnsembleSVM(svm);
+		else
+			status = updateSVMSample(&svm->models[k], index, feat, y);
+	}
+	else if (!svm->chol || (svm->chol->size1 != n)) {
+		setLibrarySample(svm, r, feat, y);
+		status = trainSVM(svm);
+	}
+	else if (updateCholeskySample(svm, r, feat, y)) {
+		// Refactor from scratch if the factor lost positive definiteness to rounding
+		status = trainSVM(svm);
+	}
+	else {
+		solveCholeskySVM(svm);
+	}
+	
+	// The cached workspaces, curves and predictions of the old library are stale
+	indexSVM(svm);
+	stampSVM(svm);
+	
+	return status;
+}
+
+int queueSVMSample(SVM * svm, int r, const double * feat, double y)
+{
+	int i, j;
+	
+	if (!svm || !svm->trainFeat || (r < 0) || (r >= svm->trainFeat->size1) || !feat)
+		return -1;
+	
+	assert(svm->trainFeat->size2 <= NB_FEATURES);
+	
+	for (i = 0; (i < svm->nbPending) && (svm->pending[i].index != r); ++i);
+	
+	if (i == svm->pendingCapacity) {
+		int capacity = svm->pendingCapacity ? 2 * svm->pendingCapacity : 16;
+		PendingSample * pending = realloc(svm->pending, capacity * sizeof(PendingSample));
+		
+		if (!pending)
+			return -1;
+		
+		svm->pending = pending;
+		svm->pendingCapacity = capacity;
+	}
+	
+	if (i == svm->nbPending)
+		++svm->nbPending;
+	
+	svm->pending[i].index = r;
+	svm->pending[i].y = y;
+	
+	for (j = 0; j < svm->trainFeat->size2; ++j)
+		svm->pending[i].feat[j] = feat[j];
+	
+	svm->dirty = 1;
+	
+	return 0;
+}
+
+// Copy a pending change into the library
+static void applyPendingSample(SVM * svm, const PendingSample * change)
+{
+	setLibrarySample(svm, change->index, change->feat, change->y);
+}
+
+int flushSVM(SVM * svm)
+{
+	int n, i, k, c, status = 0;
+	
+	if (!svm || !svm->trainFeat)
+		return -1;
+	
+	if (!svm->dirty)
+		return 0;
+	
+	n = svm->trainFeat->size1;
+	
+	if ((svm->type == SVM_CLUSTERED) && svm->models && (svm->nbPending > 0)) {
+		// Retrain once every cluster a pending sample leaves or joins
+		char * affected = calloc(svm->nbModels, 1);
+		int * members = malloc(svm->nbModels * sizeof(int));
+		
+		for (i = 0; i < svm->nbPending; ++i) {
+			for (c = clusterMembership(svm, gsl_matrix_const_ptr(svm->trainFeat, svm->pending[i].index, 0),
+									   members); c > 0; --c)
+				affected[members[c - 1]] = 1;
+			
+			for (c = clusterMembership(svm, svm->pending[i].feat, members); c > 0; --c)
+				affected[members[c - 1]] = 1;
+			
+			applyPendingSample(svm, &svm->pending[i]);
+		}
+		
+		for (k = 0; k < svm->nbModels; ++k)
+			if (affected[k] && buildClusterModel(svm, k))
+				status =-1;
+		
+		free(affected);
+		free(members);
+	}
+	else if ((svm->type == SVM_ENSEMBLE) && svm->models && (svm->nbPending > 0)) {
+		// Rebuild and retrain once the sub-models holding a pending sample
+		char * affected = calloc(svm->nbModels, 1);
+		
+		for (i = 0; i < svm->nbPending; ++i) {
+			affected[svm->partition[svm->pending[i].index]] = 1;
+			applyPendingSample(svm, &svm->pending[i]);
+		}
+		
+		for (k = 0; k < svm->nbModels; ++k) {
+			int size = 0;
+			
+			if (!affected[k])
+				continue;
+			
+			for (i = 0; i < n; ++i)
+				size += (svm->partition[i] == k);
+			
+			deleteSVM(&svm->models[k]);
+			initSubModel(svm, &svm->models[k], size);
+			
+			for (i = 0, size = 0; i < n; ++i)
+				if (svm->partition[i] == k)
+					copySubModelSample(svm, i, &svm->models[k], size++);
+			
+			if (trainSVM(&svm->models[k]))
+				status =-1;
+		}
+		
+		free(affected);
+	}
+	else if ((svm->type == SVM_SINGLE) && svm->chol && (svm->chol->size1 == n) && (svm->nbPending > 0) &&
+			 (24 * svm->nbPending < n)) {
+		// A replacement costs about 8 N^2 flops against N^3 / 3 for a new factorization
+		for (i = 0; i < svm->nbPending; ++i)
+			if (updateCholeskySample(svm, svm->pending[i].index, svm->pending[i].feat, svm->pending[i].y))
+				break;
+		
+		if (i < svm->nbPending) {
+			for (; i < svm->nbPending; ++i)
+				applyPendingSample(svm, &svm->pending[i]);
+			
+			status = trainSVM(svm);
+		}
+		else {
+			solveCholeskySVM(svm);
+			indexSVM(svm);
+		}
+	}
+	else {
+		for (i = 0; i < svm->nbPending; ++i)
+			applyPendingSample(svm, &svm->pending[i]);
+		
+		status = trainSVM(svm);
+	}
+	
+	// The changes are in the library, a failed training stays dirty so that the next flush retrains it whole
+	svm->nbPending = 0;
+	svm->dirty = (status != 0);
+	stampSVM(svm);
+	
+	return status;
+}
+
+// Normalized features of p at n times from start to stop
+static void timeFeatures(double start, double stop, int n, const Patient * p, float dose, const SVM * svm,
+						 gsl_matrix * testFeat)
+{
+	// Normalize the testFeat matrix (a single time is start)
+	for (int j = 0; j < n; ++j) {
+		sampleFeatures(p, (n > 1) ? start + j * (stop - start) / (n-1) : start, dose, gsl_matrix_ptr(testFeat, j, 0));
+		normalizeFeatures(svm, gsl_matrix_ptr(testFeat, j, 0));
+	}
+}
+
+int prepareTimeCurve(const SVM * svm, const Patient * p, float dose, TimeCurve * curve)
+{
+	const gsl_matrix * xTrain = svm->trainFeat;
+	double feat[NB_FEATURES];
+	
+	if ((svm->type != SVM_SINGLE) || (svm->kernel != KERNEL_GAUSSIAN) || !xTrain || (xTrain->size2 != NB_FEATURES))
+		return -1;
+	
+	if (curve->capacity < xTrain->size1) {
+		curve->capacity = xTrain->size1;
+		curve->times = realloc(curve->times, curve->capacity * sizeof(double));
+		curve->timeNorms = realloc(curve->timeNorms, curve->capacity * sizeof(double));
+		curve->factors = realloc(curve->factors, curve->capacity * sizeof(double));
+	}
+	
+	curve->version = svm->version;
+	curve->precision = svm->precision;
+	curve->scale = GAUSSIAN_SCALE(svm->sigma);
+	curve->b = svm->b;
+	curve->timeMean = svm->means[FEATURE_TIME];
+	curve->timeStd = svm->stds[FEATURE_TIME];
+	curve->size = 0;
+	
+	sampleFeatures(p, 0.0, dose, feat);
+	normalizeFeatures(svm, feat);
+	
+	// Matlab: factors = alpha .* exp(scale * sum((X(:,2:end) - x(2:end)).^2, 2));
+	for (int i = 0; i < xTrain->size1; ++i) {
+		const double * xi = gsl_matrix_const_ptr(xTrain, i, 0);
+		double d2 = 0.0;
+		
+		for (int k = 0; k < NB_FEATURES; ++k)
+			if (k != FEATURE_TIME)
+				d2 += (feat[k] - xi[k]) * (feat[k] - xi[k]);
+		
+		double factor = gsl_vector_get(svm->alpha, i) *
+						((curve->precision == PRECISION_FAST) ? fastExp(d2 * curve->scale) : exp(d2 * curve->scale));
+		
+		// Samples too far from the patient never contribute, or less than their share of the allowed error
+		if (fabs(factor) <= svm->pruning / xTrain->size1)
+			continue;
+		
+		curve->times[curve->size] = xi[FEATURE_TIME];
+		curve->timeNorms[curve->size] = xi[FEATURE_TIME] * xi[FEATURE_TIME];
+		curve->factors[curve->size] = factor;
+		++curve->size;
+	}
+	
+	return 0;
+}
+
+int predictTimeCurve(const TimeCurve * curve, const SVM * svm, double start, double stop, int n, gsl_vector * out)
+{
+	if (!curve || (curve->version != svm->version) || (n < 1) || (out->size < n))
+		return -1;
+	
+	const GaussianSum gaussianSum = gaussianSums[detectISA()][curve->precision == PRECISION_FAST];
+	
+	for (int j = 0; j < n; ++j) {
+		double t = ((n > 1) ? start + j * (stop - start) / (n-1) : start);
+		
+		t = (t - curve->timeMean) / curve->timeStd;
+		gsl_vector_set(out, j, gaussianSum(&t, t * t, curve->times, curve->size, 1, curve->timeNorms, curve->factors,
+										   0, curve->size, curve->scale) + curve->b);
+	}
+	
+	return 0;
+}
+
+void deleteTimeCurve(TimeCurve * curve)
+{
+	free(curve->times);
+	free(curve->timeNorms);
+	free(curve->factors);
+	curve->times = NULL;
+	curve->timeNorms = NULL;
+	curve->factors = NULL;
+	curve->capacity = 0;
+	curve->size = 0;
+}
+
+// Bracketing intervals of the analytic curve queries per kernel width, narrow enough for the curve to have at most
+// one extremum in most intervals
+#define CURVE_STEPS 2
+
+// Accuracy of the times of the analytic curve queries (normalized time)
+#define CURVE_TOLERANCE 1e-10
+
+// Largest number of iterations of a root search
+#define CURVE_MAX_ITERATIONS 100
+
+// Concentration of a curve and its first two derivatives at the normalized time t:
+// Matlab: e = factors .* exp(scale * (t - times).^2); d = [sum(e) + b, sum(e .* 2 * scale .* (t - times)),
+//                                                          sum(e .* (2 * scale + (2 * scale * (t - times)).^2))];
+static void curveDerivatives(const TimeCurve * curve, double t, double d[3])
+{
+	const double scale = curve->scale;
+	
+	d[0] = curve->b;
+	d[1] = 0.0;
+	d[2] = 0.0;
+	
+	for (int i = 0; i < curve->size; ++i) {
+		double u = t - curve->times[i];
+		double e = curve->factors[i] *
+				   ((curve->precision == PRECISION_FAST) ? fastExp(scale * u * u) : exp(scale * u * u));
+		double g = 2.0 * scale * u;
+		
+		d[0] += e;
+		d[1] += e * g;
+		d[2] += e * (2.0 * scale + g * g);
+	}
+}
+
+// Root of d[order](t) = target in [a, b], where it changes sign, by Newton iterations falling back to bisection when
+// a step leaves the bracket or does not halve the previous one
+static double curveRoot(const TimeCurve * curve, int order, double target, double a, double b)
+{
+	double d[3];
+	double x = 0.5 * (a + b);
+	double step = b - a, previous = step;
+	
+	curveDerivatives(curve, a, d);
+	
+	const int rising = (d[order] < target);
+	
+	for (int i = 0; i < CURVE_MAX_ITERATIONS; ++i) {
+		curveDerivatives(curve, x, d);
+		
+		double g = d[order] - target;
+		
+		if (g == 0.0)
+			return x;
+		
+		// Keep the root inside [a, b]
+		if ((g < 0.0) == rising)
+			a = x;
+		else
+			b = x;
+		
+		double newton = (d[order + 1] != 0.0) ? x - g / d[order + 1] : a - 1.0;
+		
+		if ((newton <= fmin(a, b)) || (newton >= fmax(a, b)) || (fabs(newton - x) > 0.5 * fabs(previous))) {
+			previous = step;
+			step = 0.5 * (b - a);
+			x = 0.5 * (a + b);
+		}
+		else {
+			previous = step;
+			step = newton - x;
+			x = newton;
+		}
+		
+		if (fabs(step) < CURVE_TOLERANCE)
+			break;
+	}
+	
+	return x;
+}
+
+// Bounds of the bracketing intervals of [start, stop] in normalized time, returns their number
+static int curveIntervals(const TimeCurve * curve, double start, double stop, double * lower, double * width)
+{
+	const double sigma = sqrt(-0.5 / curve->scale);
+	
+	*lower = (start - curve->timeMean) / curve->timeStd;
+	
+	double upper = (stop - curve->timeMean) / curve->timeStd;
+	int n = (int) ceil((upper - *lower) * CURVE_STEPS / sigma);
+	
+	if (n < 1)
+		n = 1;
+	
+	*width = (upper - *lower) / n;
+	
+	return n;
+}
+
+int thresholdTimeCurve(const TimeCurve * curve, const SVM * svm, double start, double stop, double threshold,
+					   double * times, int maxTimes)
+{
+	double lower, width, da[3], db[3];
+	int count = 0;
+	
+	if (!curve || (curve->version != svm->version) || (start > stop) || (maxTimes && !times))
+		return -1;
+	
+	int n = curveIntervals(curve, start, stop, &lower, &width);
+	
+	curveDerivatives(curve, lower, da);
+	
+	// A crossing at start
+	if (da[0] == threshold) {
+		if (count < maxTimes)
+			times[count] = start;
+		
+		++count;
+	}
+	
+	for (int k = 0; k < n; ++k) {
+		double a = lower + k * width;
+		double b = lower + (k + 1) * width;
+		double roots[2];
+		int nbRoots = 0;
+		
+		curveDerivatives(curve, b, db);
+		
+		if ((da[0] - threshold) * (db[0] - threshold) < 0.0) {
+			roots[nbRoots++] = curveRoot(curve, 0, threshold, a, b);
+		}
+		else if ((da[0] != threshold) && (da[1] * db[1] < 0.0)) {
+			// Both bounds on the same side, the curve may cross twice around its extremum
+			double e = curveRoot(curve, 1, 0.0, a, b);
+			double de[3];
+			
+			curveDerivatives(curve, e, de);
+			
+			if ((de[0] - threshold) * (da[0] - threshold) < 0.0) {
+				roots[nbRoots++] = curveRoot(curve, 0, threshold, a, e);
+				roots[nbRoots++] = curveRoot(curve, 0, threshold, e, b);
+			}
+		}
+		
+		if (db[0] == threshold)
+			roots[nbRoots++] = b;
+		
+		for (int r = 0; r < nbRoots; ++r) {
+			if (count < maxTimes)
+				times[count] = roots[r] * curve->timeStd + curve->timeMean;
+			
+			++count;
+		}
+		
+		da[0] = db[0];
+		da[1] = db[1];
+		da[2] = db[2];
+	}
+	
+	return count;
+}
+
+int peakTimeCurve(const TimeCurve * curve, const SVM * svm, double start, double stop, double * tmax, double * cmax)
+{
+	double lower, width, da[3], db[3], d[3];
+	
+	if (!curve || (curve->version != svm->version) || (start > stop) || !tmax || !cmax)
+		return -1;
+	
+	int n = curveIntervals(curve, start, stop, &lower, &width);
+	double best = lower;
+	
+	curveDerivatives(curve, lower, da);
+	*cmax = da[0];
+	
+	for (int k = 0; k < n; ++k) {
+		double a = lower + k * width;
+		double b = lower + (k + 1) * width;
+		
+		curveDerivatives(curve, b, db);
+		
+		// The bounds of the intervals, and the maxima inside where the derivative goes from positive to negative
+		if (db[0] > *cmax) {
+			*cmax = db[0];
+			best = b;
+		}
+		
+		if ((da[1] > 0.0) && (db[1] < 0.0)) {
+			double t = curveRoot(curve, 1, 0.0, a, b);
+			
+			curveDerivatives(curve, t, d);
+			
+			if (d[0] > *cmax) {
+				*cmax = d[0];
+				best = t;
+			}
+		}
+		
+		da[0] = db[0];
+		da[1] = db[1];
+		da[2] = db[2];
+	}
+	
+	*tmax = best * curve->timeStd + curve->timeMean;
+	
+	return 0;
+}
+
+// Predict n concentrations from start to stop without touching the model
+static void predictTimes(double start, double stop, int n, const Patient * p, float dose, const SVM * svm,
+						 SVMWorkspace * ws, gsl_vector * out)
+{
+	SVMWorkspace temporary = {0};
+	SVMWorkspace * w = ws ? ws : &temporary;
+	
+	// Only the time changes along the curve of a single Gaussian model
+	if (prepareTimeCurve(svm, p, dose, &w->curve) == 0) {
+		predictTimeCurve(&w->curve, svm, start, stop, n, out);
+		
+		if (!ws)
+			freeWorkspaceBuffers(&temporary);
+		
+		return;
+	}
+	
+	reserveSVMWorkspace(w, n, svm->trainFeat->size1);
+	
+	gsl_matrix_view testFeat = gsl_matrix_view_array(w->testFeat, n, NB_FEATURES);
+	
+	timeFeatures(start, stop, n, p, dose, svm, &testFeat.matrix);
+	predictWorkspaceSVM(svm, w, &testFeat.matrix, out);
+	
+	if (!ws)
+		freeWorkspaceBuffers(&temporary);
+}
+
+int predictN(double start, double stop, int n, const Patient * p, float dose, SVM * svm, gsl_vector * out)
+{
+	if ((start < 0) || (start >= stop) || (n < 1) || !p || !isTrainedSVM(svm) || !out)
+		return -1;
+	
+	if (flushSVM(svm))
+		return -1;
+	
+	printf("\nsigma: %f\n", svm->sigma);
+	
+	
+	predictTimes(start, stop, n, p, dose, svm, NULL, out);
+	
+	printf("\nout:");
+	for (int i = 0; i < n; ++i)
+		printf(" %f", gsl_vector_get(out, i));
+	
+	printf("\n\n fen ge xian\n\n");
+	return 0;
+}
+
+int predictWorkspaceN(double start, double stop, int n, const Patient * p, float dose, SVM * svm, SVMWorkspace * ws,
+					  gsl_vector * out)
+{
+	if ((start < 0) || (start >= stop) || (n < 1) || !p || !isTrainedSVM(svm) || !out)
+		return -1;
+	
+	if (flushSVM(svm))
+		return -1;
+	
+	predictTimes(start, stop, n, p, dose, svm, ws, out);
+	
+	return 0;
+}
+
+int predictParallelN(double start, double stop, int n, const Patient * p, float dose, SVM * svm, PredictPool * pool,
+					 gsl_vector * out)
+{
+	if ((start < 0) || (start >= stop) || (n < 1) || !p || !isTrainedSVM(svm) || !out)
+		return -1;
+	
+	if (flushSVM(svm))
+		return -1;
+	
+	gsl_matrix * testFeat = gsl_matrix_alloc(n, NB_FEATURES);
+	
+	timeFeatures(start, stop, n, p, dose, svm, testFeat);
+	predictParallelSVM(svm, pool, testFeat, out);
+	
+	gsl_matrix_free(testFeat);
+	
+	return 0;
+}
+
+int predictBatchN(const PredictQuery * queries, int nbQueries, SVM * svm, PredictPool * pool, int * offsets,
+				  gsl_vector * out)
+{
+	int q, j;
+	
+	if ((nbQueries < 0) || (nbQueries && !queries) || !offsets || !isTrainedSVM(svm) || !out)
+		return -1;
+	
+	offsets[0] = 0;
+	
+	for (q = 0; q < nbQueries; ++q) {
+		if (!queries[q].patient || (queries[q].nbTimes < 0) || (queries[q].nbTimes && !queries[q].times))
+			return -1;
+		
+		offsets[q + 1] = offsets[q] + queries[q].nbTimes;
+	}
+	
+	if (out->size < offsets[nbQueries])
+		return -1;
+	
+	if (offsets[nbQueries] == 0)
+		return 0;
+	
+	if (flushSVM(svm))
+		return -1;
+	
+	// All the curves in one block of features and one prediction
+	gsl_matrix * testFeat = gsl_matrix_alloc(offsets[nbQueries], NB_FEATURES);
+	gsl_vector_view y = gsl_vector_subvector(out, 0, offsets[nbQueries]);
+	
+	for (q = 0; q < nbQueries; ++q) {
+		for (j = 0; j < queries[q].nbTimes; ++j) {
+			double * feat = gsl_matrix_ptr(testFeat, offsets[q] + j, 0);
+			
+			sampleFeatures(queries[q].patient, queries[q].times[j], queries[q].dose, feat);
+			normalizeFeatures(svm, feat);
+		}
+	}
+	
+	predictParallelSVM(svm, pool, testFeat, &y.vector);
+	
+	gsl_matrix_free(testFeat);
+	
+	return 0;
+}
+
+int predictDatabase(const Database * db, SVM * svm, PredictPool * pool, int * offsets, gsl_vector * out)
+{
+	int i, j;
+	
+	if (!db || !offsets || !isTrainedSVM(svm) || !out)
+		return -1;
+	
+	offsets[0] = 0;
+	
+	for (i = 0; i < db->size; ++i)
+		offsets[i + 1] = offsets[i] + db->patients[i].size;
+	
+	if (out->size < offsets[db->size])
+		return -1;
+	
+	if (offsets[db->size] == 0)
+		return 0;
+	
+	if (flushSVM(svm))
+		return -1;
+	
+	gsl_matrix * testFeat = gsl_matrix_alloc(offsets[db->size], NB_FEATURES);
+	gsl_vector_view y = gsl_vector_subvector(out, 0, offsets[db->size]);
+	
+	for (i = 0; i < db->size; ++i) {
+		const Patient * p = &db->patients[i];
+		
+		for (j = 0; j < p->size; ++j) {
+			double * feat = gsl_matrix_ptr(testFeat, offsets[i] + j, 0);
+			
+			sampleFeatures(p, p->times[j], p->doses[j], feat);
+			normalizeFeatures(svm, feat);
+		}
+	}
+	
+	predictParallelSVM(svm, pool, testFeat, &y.vector);
+	
+	gsl_matrix_free(testFeat);
+	
+	return 0;
+}
+
+void initDoseWindow(DoseWindow * window)
+{
+	window->low = 750.0;
+	window->high = 1500.0;
+	window->start = 1.0;
+	window->stop = 24.0;
+	window->nbTimes = 24;
+	window->minDose = 100.0;
+	window->maxDose = 1000.0;
+	window->tolerance = 0.0;
+}
+
+// Number of intervals the dose range is bracketed on
+#define DOSE_CANDIDATES 16
+
+// Predicted curves of one patient on the times of a window for any dose. For a single Gaussian model
+// y(d) = T * (weights .* exp(scale * (d - doses).^2)) + b, with T(j, i) = exp(scale * (t(j) - times(i))^2) and
+// weights(i) = alpha(i) * exp(scale * |x - x_i|^2) over the covariates computed once.
+struct doseSearchStruct {
+	const DoseWindow * window;
+	const Patient * patient;
+	const SVM * svm;
+	gsl_matrix * T; // NULL for the other models, predicted with predictTimes
+	gsl_vector * weights;
+	gsl_vector * combined; // weights .* exp(scale * (d - doses).^2)
+	gsl_vector * curve;
+	SVMWorkspace * ws;
+};
+
+static void initDoseSearch(struct doseSearchStruct * search, const DoseWindow * window, const Patient * p,
+						   const SVM * svm)
+{
+	const gsl_matrix * xTrain = svm->trainFeat;
+	const int n = xTrain->size1;
+	
+	search->window = window;
+	search->patient = p;
+	search->svm = svm;
+	search->T = NULL;
+	search->weights = NULL;
+	search->combined = NULL;
+	search->curve = gsl_vector_alloc(window->nbTimes);
+	search->ws = createSVMWorkspace();
+	
+	if ((svm->type != SVM_SINGLE) || (svm->kernel != KERNEL_GAUSSIAN) || (xTrain->size2 != NB_FEATURES))
+		return;
+	
+	const double scale = GAUSSIAN_SCALE(svm->sigma);
+	gsl_matrix * testFeat = gsl_matrix_alloc(window->nbTimes, NB_FEATURES);
+	int i, j, k;
+	
+	search->T = gsl_matrix_alloc(window->nbTimes, n);
+	search->weights = gsl_vector_alloc(n);
+	search->combined = gsl_vector_alloc(n);
+	
+	timeFeatures(window->start, window->stop, window->nbTimes, p, 0.0, svm, testFeat);
+	
+	// Matlab: T = exp(scale * (t - times').^2); with the exponential of the precision of the model, like
+	// doseViolation
+	for (j = 0; j < window->nbTimes; ++j) {
+		for (i = 0; i < n; ++i) {
+			double d = gsl_matrix_get(testFeat, j, FEATURE_TIME) - gsl_matrix_get(xTrain, i, FEATURE_TIME);
+			gsl_matrix_set(search->T, j, i,
+						   (svm->precision == PRECISION_FAST) ? fastExp(scale * d * d) : exp(scale * d * d));
+		}
+	}
+	
+	// Matlab: weights = alpha .* exp(scale * sum((X(:,3:end) - x(3:end)).^2, 2));
+	for (i = 0; i < n; ++i) {
+		double d2 = 0.0;
+		
+		for (k = FEATURE_COVARIATES; k < NB_FEATURES; ++k)
+			d2 += (gsl_matrix_get(testFeat, 0, k) - gsl_matrix_get(xTrain, i, k)) *
+				  (gsl_matrix_get(testFeat, 0, k) - gsl_matrix_get(xTrain, i, k));
+		
+		gsl_vector_set(search->weights, i, gsl_vector_get(svm->alpha, i) *
+					   ((svm->precision == PRECISION_FAST) ? fastExp(scale * d2) : exp(scale * d2)));
+	}
+	
+	gsl_matrix_free(testFeat);
+}
+
+static void deleteDoseSearch(struct doseSearchStruct * search)
+{
+	if (search->T) {
+		gsl_matrix_free(search->T);
+		gsl_vector_free(search->weights);
+		gsl_vector_free(search->combined);
+	}
+	
+	gsl_vector_free(search->curve);
+	deleteSVMWorkspace(search->ws);
+}
+
+// Distance of the predicted curve of a dose to the window, 0 if it stays inside
+static double doseViolation(struct doseSearchStruct * search, double dose)
+{
+	const DoseWindow * window = search->window;
+	const SVM * svm = search->svm;
+	
+	if (search->T) {
+		const double scale = GAUSSIAN_SCALE(svm->sigma);
+		double x = (dose - svm->means[FEATURE_DOSE]) / svm->stds[FEATURE_DOSE];
+		
+		// Matlab: y = T * (weights .* exp(scale * (x - doses).^2)) + b;
+		for (int i = 0; i < search->weights->size; ++i) {
+			double d = x - gsl_matrix_get(svm->trainFeat, i, FEATURE_DOSE);
+			gsl_vector_set(search->combined, i, gsl_vector_get(search->weights, i) *
+						   ((svm->precision == PRECISION_FAST) ? fastExp(scale * d * d) : exp(scale * d * d)));
+		}
+		
+		gsl_blas_dgemv(CblasNoTrans, 1.0, search->T, search->combined, 0.0, search->curve);
+		gsl_vector_add_constant(search->curve, svm->b);
+	}
+	else {
+		predictTimes(window->start, window->stop, window->nbTimes, search->patient, dose, svm, search->ws,
+					 search->curve);
+	}
+	
+	double violation = 0.0;
+	
+	for (int j = 0; j < window->nbTimes; ++j) {
+		double y = gsl_vector_get(search->curve, j);
+		
+		if (window->low - y > violation)
+			violation = window->low - y;
+		
+		if (y - window->high > violation)
+			violation = y - window->high;
+	}
+	
+	return violation;
+}
+
+// Largest number of bisections of a dose bound: 2^-64 of the bracket, below the spacing of the doubles of doses of
+// the magnitude of the bracket
+#define DOSE_MAX_BISECTIONS 64
+
+// Bisection of the bound between a qualifying dose and one that does not qualify, returns a qualifying dose. Stops
+// at adjacent doubles if the tolerance is below their spacing.
+static double bisectDose(struct doseSearchStruct * search, double inside, double outside, double tolerance)
+{
+	for (int k = 0; (k < DOSE_MAX_BISECTIONS) && (fabs(outside - inside) > tolerance); ++k) {
+		double middle = 0.5 * (inside + outside);
+		
+		if ((middle == inside) || (middle == outside))
+			break;
+		
+		if (doseViolation(search, middle) == 0.0)
+			inside = middle;
+		else
+			outside = middle;
+	}
+	
+	return inside;
+}
+
+int optimizeDose(const DoseWindow * window, const Patient * p, SVM * svm, double doses[2])
+{
+	double candidates[DOSE_CANDIDATES + 1];
+	double violations[DOSE_CANDIDATES + 1];
+	int k, best = 0, first = -1, length = 0;
+	
+	if (!window || !p || !doses || !isTrainedSVM(svm) || (window->nbTimes < 1) || (window->start > window->stop) ||
+		(window->minDose > window->maxDose) || (window->low > window->high))
+		return -1;
+	
+	if (flushSVM(svm))
+		return -1;
+	
+	struct doseSearchStruct search;
+	double tolerance = (window->tolerance > 0.0) ? window->tolerance : (window->maxDose - window->minDose) / 1000.0;
+	
+	initDoseSearch(&search, window, p, svm);
+	
+	// Bracketing: the widest run of qualifying candidates, or the candidate closest to the window
+	for (k = 0; k <= DOSE_CANDIDATES; ++k) {
+		candidates[k] = window->minDose + k * (window->maxDose - window->minDose) / DOSE_CANDIDATES;
+		violations[k] = doseViolation(&search, candidates[k]);
+		
+		if (violations[k] < violations[best])
+			best = k;
+	}
+	
+	for (k = 0; k <= DOSE_CANDIDATES; ++k) {
+		int run = 0;
+		
+		while ((k + run <= DOSE_CANDIDATES) && (violations[k + run] == 0.0))
+			++run;
+		
+		if (run > length) {
+			first = k;
+			length = run;
+		}
+		
+		k += run;
+	}
+	
+	if (length == 0) {
+		doses[0] = candidates[best];
+		doses[1] = candidates[best];
+		deleteDoseSearch(&search);
+		return 1;
+	}
+	
+	// Bisection of the bounds of the run that are not the bounds of the searched range
+	doses[0] = (first > 0) ? bisectDose(&search, candidates[first], candidates[first - 1], tolerance) :
+							 candidates[first];
+	doses[1] = (first + length <= DOSE_CANDIDATES) ?
+			   bisectDose(&search, candidates[first + length - 1], candidates[first + length], tolerance) :
+			   candidates[first + length - 1];
+	
+	deleteDoseSearch(&search);
+	
+	return 0;
+}
+
+PredictCache * createPredictCache(int capacity)
+{
+	if (capacity < 1)
+		return NULL;
+	
+	PredictCache * cache = malloc(sizeof(PredictCache));
+	
+	for (int s = 0; s < CACHE_SHARDS; ++s) {
+		struct predictShardStruct * shard = &cache->shards[s];
+		
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->version = 0;
+		shard->capacity = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+		shard->used = 0;
+		shard->entries = malloc(shard->capacity * sizeof(struct predictEntryStruct));
+		
+		// Twice as many buckets as entries keeps the chains short
+		for (shard->nbBuckets = 1; shard->nbBuckets < 2 * shard->capacity; shard->nbBuckets *= 2)
+			;
+		
+		shard->buckets = malloc(shard->nbBuckets * sizeof(int));
+		
+		for (int i = 0; i < shard->capacity; ++i) {
+			shard->entries[i].values = NULL;
+			shard->entries[i].size = 0;
+		}
+		
+		for (int k = 0; k < shard->nbBuckets; ++k)
+			shard->buckets[k] = -1;
+		
+		shard->head = -1;
+		shard->tail = -1;
+	}
+	
+	atomic_init(&cache->hits, 0);
+	atomic_init(&cache->misses, 0);
+	
+	return cache;
+}
+
+void deletePredictCache(PredictCache * cache)
+{
+	if (!cache)
+		return;
+	
+	for (int s = 0; s < CACHE_SHARDS; ++s) {
+		struct predictShardStruct * shard = &cache->shards[s];
+		
+		for (int i = 0; i < shard->capacity; ++i)
+			free(shard->entries[i].values);
+		
+		free(shard->entries);
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	
+	free(cache);
+}
+
+// Forget the curves of a shard, keeping their buffers (the lock must be held)
+static void clearPredictShard(struct predictShardStruct * shard)
+{
+	for (int k = 0; k < shard->nbBuckets; ++k)
+		shard->buckets[k] = -1;
+	
+	shard->used = 0;
+	shard->head = -1;
+	shard->tail = -1;
+}
+
+void clearPredictCache(PredictCache * cache)
+{
+	for (int s = 0; s < CACHE_SHARDS; ++s) {
+		pthread_mutex_lock(&cache->shards[s].lock);
+		clearPredictShard(&cache->shards[s]);
+		pthread_mutex_unlock(&cache->shards[s].lock);
+	}
+}
+
+static void unlinkPredictEntry(struct predictShardStruct * shard, int i)
+{
+	struct predictEntryStruct * entries = shard->entries;
+	
+	if (entries[i].prev != -1)
+		entries[entries[i].prev].next = entries[i].next;
+	else
+		shard->head = entries[i].next;
+	
+	if (entries[i].next != -1)
+		entries[entries[i].next].prev = entries[i].prev;
+	else
+		shard->tail = entries[i].prev;
+}
+
+static void pushPredictEntry(struct predictShardStruct * shard, int i)
+{
+	struct predictEntryStruct * entries = shard->entries;
+	
+	entries[i].prev = -1;
+	entries[i].next = shard->head;
+	
+	if (shard->head != -1)
+		entries[shard->head].prev = i;
+	else
+		shard->tail = i;
+	
+	shard->head = i;
+}
+
+// Entry of the shard holding key, or -1 (the lock must be held)
+static int findPredictEntry(const struct predictShardStruct * shard, const long * key, unsigned long hash)
+{
+	for (int i = shard->buckets[(hash / CACHE_SHARDS) & (shard->nbBuckets - 1)]; i != -1; i = shard->entries[i].chain)
+		if ((shard->entries[i].hash == hash) && !memcmp(shard->entries[i].key, key, sizeof(shard->entries[i].key)))
+			return i;
+	
+	return -1;
+}
+
+// Cache a curve in a free entry or in place of the least recently used one (the lock must be held)
+static void insertPredictEntry(struct predictShardStruct * shard, const long * key, unsigned long hash,
+							   const gsl_vector * values)
+{
+	struct predictEntryStruct * entries = shard->entries;
+	int i;
+	
+	if (shard->used < shard->capacity) {
+		i = shard->used++;
+	}
+	else {
+		// Recycle the least recently used entry, removed from its bucket first
+		i = shard->tail;
+		unlinkPredictEntry(shard, i);
+		
+		int * link = &shard->buckets[(entries[i].hash / CACHE_SHARDS) & (shard->nbBuckets - 1)];
+		
+		while (*link != i)
+			link = &entries[*link].chain;
+		
+		*link = entries[i].chain;
+	}
+	
+	if (entries[i].size < values->size) {
+		entries[i].size = values->size;
+		entries[i].values = realloc(entries[i].values, entries[i].size * sizeof(double));
+	}
+	
+	memcpy(entries[i].key, key, sizeof(entries[i].key));
+	entries[i].hash = hash;
+	
+	for (int j = 0; j < values->size; ++j)
+		entries[i].values[j] = gsl_vector_get(values, j);
+	
+	int * bucket = &shard->buckets[(hash / CACHE_SHARDS) & (shard->nbBuckets - 1)];
+	
+	entries[i].chain = *bucket;
+	*bucket = i;
+	pushPredictEntry(shard, i);
+}
+
+int predictCachedN(double start, double stop, int n, const Patient * p, float dose, SVM * svm, PredictCache * cache,
+				   SVMWorkspace * ws, gsl_vector * out)
+{
+	long key[CACHE_KEY_SIZE];
+	unsigned long hash = 14695981039346656037UL;
+	int c = 0, j;
+	
+	if ((start < 0) || (start >= stop) || (n < 1) || !p || !isTrainedSVM(svm) || !cache || !out || (out->size < n))
+		return -1;
+	
+	if (flushSVM(svm))
+		return -1;
+	
+#define QUANTIZE_COVARIATE(name) key[c++] = lround(p->name / CACHE_COVARIATE_STEP);
+	PATIENT_COVARIATES(QUANTIZE_COVARIATE)
+#undef QUANTIZE_COVARIATE
+	
+	key[c++] = lround(dose / CACHE_DOSE_STEP);
+	key[c++] = lround(start / CACHE_TIME_STEP);
+	key[c++] = lround(stop / CACHE_TIME_STEP);
+	key[c++] = n;
+	
+	// FNV-1a over the quantized key
+	for (c = 0; c < CACHE_KEY_SIZE; ++c)
+		hash = (hash ^ (unsigned long)key[c]) * 1099511628211UL;
+	
+	struct predictShardStruct * shard = &cache->shards[hash % CACHE_SHARDS];
+	gsl_vector_view curve = gsl_vector_subvector(out, 0, n);
+	
+	pthread_mutex_lock(&shard->lock);
+	
+	if (shard->version != svm->version) {
+		clearPredictShard(shard);
+		shard->version = svm->version;
+	}
+	
+	int i = findPredictEntry(shard, key, hash);
+	
+	if (i != -1) {
+		for (j = 0; j < n; ++j)
+			gsl_vector_set(out, j, shard->entries[i].values[j]);
+		
+		unlinkPredictEntry(shard, i);
+		pushPredictEntry(shard, i);
+		pthread_mutex_unlock(&shard->lock);
+		atomic_fetch_add(&cache->hits, 1);
+		
+		return 0;
+	}
+	
+	pthread_mutex_unlock(&shard->lock);
+	atomic_fetch_add(&cache->misses, 1);
+	
+	// Predict without holding the lock, another thread may cache the same curve meanwhile
+	predictTimes(start, stop, n, p, dose, svm, ws, &curve.vector);
+	
+	pthread_mutex_lock(&shard->lock);
+	
+	if ((shard->version == svm->version) && (findPredictEntry(shard, key, hash) == -1))
+		insertPredictEntry(shard, key, hash, &curve.vector);
+	
+	pthread_mutex_unlock(&shard->lock);
+	
+	return 0;
+}
+
+// Refinement probes per axis (library samples of which only the refined feature varies)
+#define SURROGATE_PROBES 32
+
+// Initial knots of a refined axis
+#define SURROGATE_INITIAL_KNOTS 5
+
+// Grid points predicted per batch
+#define SURROGATE_BATCH 4096
+
+// Header of a surrogate table file, followed by the knots of every axis and the values
+struct surrogateHeaderStruct {
+	char magic[8];
+	int nbFeatures;
+	int nbKnots[NB_FEATURES];
+};
+
+void initSurrogate(Surrogate * surrogate, const SVM * svm)
+{
+	const gsl_matrix * x = svm->trainFeat;
+	
+	for (int k = 0; k < NB_FEATURES; ++k) {
+		double value = x ? gsl_matrix_get(x, 0, k) * svm->stds[k] + svm->means[k] : 0.0;
+		int distinct = 1;
+		
+		surrogate->lower[k] = value;
+		surrogate->upper[k] = value;
+		
+		for (int i = 1; x && (i < x->size1); ++i) {
+			value = gsl_matrix_get(x, i, k) * svm->stds[k] + svm->means[k];
+			
+			if ((value != surrogate->lower[k]) && (value != surrogate->upper[k]))
+				++distinct;
+			
+			surrogate->lower[k] = fmin(surrogate->lower[k], value);
+			surrogate->upper[k] = fmax(surrogate->upper[k], value);
+		}
+		
+		surrogate->maxKnots[k] = (k == FEATURE_TIME) ? 64 : ((k == FEATURE_DOSE) ? 32 : 16);
+		
+		// Binary features are not interpolated
+		if (distinct == 2)
+			surrogate->maxKnots[k] = 2;
+		
+		surrogate->nbKnots[k] = 0;
+		surrogate->knots[k] = NULL;
+		surrogate->bins[k] = NULL;
+	}
+	
+	surrogate->tolerance = 0.01;
+	surrogate->values = NULL;
+	surrogate->map = NULL;
+	surrogate->mapSize = 0;
+}
+
+// Exact predictions of rows points given in raw units (rows x NB_FEATURES)
+static void surrogateExact(const SVM * svm, SVMWorkspace * ws, double * raw, int rows, double * y)
+{
+	gsl_matrix_view feat = gsl_matrix_view_array(raw, rows, NB_FEATURES);
+	gsl_vector_view yv = gsl_vector_view_array(y, rows);
+	
+	for (int i = 0; i < rows; ++i)
+		normalizeFeatures(svm, gsl_matrix_ptr(&feat.matrix, i, 0));
+	
+	predictWorkspaceSVM(svm, ws, &feat.matrix, &yv.vector);
+}
+
+// Largest error of the linear interpolation at the midpoint of [x0, x1] along the axis, over the probes
+static double surrogateIntervalError(const SVM * svm, SVMWorkspace * ws, const double * probes, int axis, double x0,
+									 double x1, double * raw, double * y)
+{
+	double error = 0.0;
+	
+	for (int p = 0; p < SURROGATE_PROBES; ++p) {
+		for (int c = 0; c < 3; ++c) {
+			for (int k = 0; k < NB_FEATURES; ++k)
+				raw[(3 * p + c) * NB_FEATURES + k] = probes[p * NB_FEATURES + k];
+			
+			raw[(3 * p + c) * NB_FEATURES + axis] = (c == 0) ? x0 : ((c == 1) ? x1 : 0.5 * (x0 + x1));
+		}
+	}
+	
+	surrogateExact(svm, ws, raw, 3 * SURROGATE_PROBES, y);
+	
+	for (int p = 0; p < SURROGATE_PROBES; ++p)
+		error = fmax(error, fabs(y[3 * p + 2] - 0.5 * (y[3 * p] + y[3 * p + 1])));
+	
+	return error;
+}
+
+// Point the uniform bins of an axis to the interval of knots they start in
+static void surrogateBins(Surrogate * surrogate, int axis)
+{
+	const int n = surrogate->nbKnots[axis];
+	const double * knots = surrogate->knots[axis];
+	int interval = 0;
 	
+	surrogate->bins[axis] = realloc(surrogate->bins[axis], SURROGATE_BINS * sizeof(int));
+	
+	for (int b = 0; b < SURROGATE_BINS; ++b) {
+		double x = knots[0] + b * (knots[n - 1] - knots[0]) / SURROGATE_BINS;
+		
+		while ((interval < n - 2) && (knots[interval + 1] <= x))
+			++interval;
+		
+		surrogate->bins[axis][b] = interval;
+	}
+}
+
+int buildSurrogate(Surrogate * surrogate, SVM * svm)
+{
+	double probes[SURROGATE_PROBES * NB_FEATURES];
+	double raw[3 * SURROGATE_PROBES * NB_FEATURES];
+	double y[3 * SURROGATE_PROBES];
+	double scale = 0.0;
+	long size = 1;
+	int i, k;
 	
-	predictGaussianSVM(svm->trainFeat, testFeat, svm->alpha, svm->sigma, out);
+	if (!isTrainedSVM(svm) || (svm->trainFeat->size2 != NB_FEATURES) || surrogate->map || (surrogate->tolerance <= 0.0))
+		return -1;
 	
-	printf("\nout:");
-	for (int i = 0; i < n; ++i)
-		printf(" %f", gsl_vector_get(out, i));
+	for (k = 0; k < NB_FEATURES; ++k)
+		if ((surrogate->maxKnots[k] < 2) || (surrogate->lower[k] > surrogate->upper[k]))
+			return -1;
 	
-	gsl_matrix_free(testFeat);
+	if (flushSVM(svm))
+		return -1;
+	
+	const gsl_matrix * x = svm->trainFeat;
+	SVMWorkspace * ws = createSVMWorkspace();
+	
+	// Matlab: probes = X(round(linspace(1, N, P)), :) .* stds + means;
+	for (i = 0; i < SURROGATE_PROBES; ++i) {
+		int r = (int) ((long) i * (x->size1 - 1) / (SURROGATE_PROBES - 1));
+		
+		for (k = 0; k < NB_FEATURES; ++k)
+			probes[i * NB_FEATURES + k] = gsl_matrix_get(x, r, k) * svm->stds[k] + svm->means[k];
+	}
+	
+	for (i = 0; i < SURROGATE_PROBES * NB_FEATURES; ++i)
+		raw[i] = probes[i];
+	
+	surrogateExact(svm, ws, raw, SURROGATE_PROBES, y);
+	
+	for (i = 0; i < SURROGATE_PROBES; ++i)
+		scale = fmax(scale, fabs(y[i]));
+	
+	if (scale == 0.0)
+		scale = 1.0;
+	
+	for (k = 0; k < NB_FEATURES; ++k) {
+		const double lower = surrogate->lower[k];
+		const double upper = surrogate->upper[k];
+		int n = (upper > lower) ? ((surrogate->maxKnots[k] < SURROGATE_INITIAL_KNOTS) ? surrogate->maxKnots[k] :
+								   SURROGATE_INITIAL_KNOTS) : 1;
+		double * knots = malloc(surrogate->maxKnots[k] * sizeof(double));
+		double * errors = malloc(surrogate->maxKnots[k] * sizeof(double)); // Of the interval after each knot
+		
+		for (i = 0; i < n; ++i)
+			knots[i] = (n > 1) ? lower + i * (upper - lower) / (n - 1) : lower;
+		
+		// Binary features are exact at their two values
+		for (i = 0; (i < n - 1) && (surrogate->maxKnots[k] > 2); ++i)
+			errors[i] = surrogateIntervalError(svm, ws, probes, k, knots[i], knots[i + 1], raw, y);
+		
+		// Split the interval worst interpolated at its midpoint
+		while ((n < surrogate->maxKnots[k]) && (n > 1) && (surrogate->maxKnots[k] > 2)) {
+			int worst = 0;
+			
+			for (i = 1; i < n - 1; ++i)
+				if (errors[i] > errors[worst])
+					worst = i;
+			
+			if (errors[worst] <= surrogate->tolerance * scale)
+				break;
+			
+			for (i = n; i > worst + 1; --i) {
+				knots[i] = knots[i - 1];
+				errors[i] = errors[i - 1];
+			}
+			
+			knots[worst + 1] = 0.5 * (knots[worst] + knots[worst + 2]);
+			++n;
+			errors[worst] = surrogateIntervalError(svm, ws, probes, k, knots[worst], knots[worst + 1], raw, y);
+			errors[worst + 1] = surrogateIntervalError(svm, ws, probes, k, knots[worst + 1], knots[worst + 2], raw, y);
+		}
+		
+		free(surrogate->knots[k]);
+		free(errors);
+		surrogate->knots[k] = knots;
+		surrogate->nbKnots[k] = n;
+		surrogateBins(surrogate, k);
+		size *= n;
+	}
+	
+	// Matlab: values = predict(model, ndgrid(knots{:}));
+	double * batch = malloc(SURROGATE_BATCH * NB_FEATURES * sizeof(double));
+	
+	surrogate->values = realloc(surrogate->values, size * sizeof(double));
+	
+	for (long begin = 0; begin < size; begin += SURROGATE_BATCH) {
+		int rows = (size - begin < SURROGATE_BATCH) ? (int) (size - begin) : SURROGATE_BATCH;
+		
+		for (i = 0; i < rows; ++i) {
+			long index = begin + i;
+			
+			for (k = NB_FEATURES - 1; k >= 0; --k) {
+				batch[i * NB_FEATURES + k] = surrogate->knots[k][index % surrogate->nbKnots[k]];
+				index /= surrogate->nbKnots[k];
+			}
+		}
+		
+		surrogateExact(svm, ws, batch, rows, &surrogate->values[begin]);
+	}
+	
+	free(batch);
+	deleteSVMWorkspace(ws);
 	
-	printf("\n\n fen ge xian\n\n");
 	return 0;
 }
 
-int leastRelevent(SVM * svm, const Patient * p)
+// Multilinear interpolation at a point in raw units
+static double interpolateSurrogate(const Surrogate * surrogate, const double * feat)
 {
-	if (!svm || !p)
+	double corners[1 << NB_FEATURES];
+	long indices[1 << NB_FEATURES];
+	long offsets[NB_FEATURES]; // Step to the upper knot along each axis (0 for a single knot)
+	double weights[NB_FEATURES];
+	long base = 0, stride = 1;
+	int k, c;
+	
+	for (k = NB_FEATURES - 1; k >= 0; stride *= surrogate->nbKnots[k--]) {
+		const int n = surrogate->nbKnots[k];
+		const double * knots = surrogate->knots[k];
+		
+		offsets[k] = 0;
+		weights[k] = 0.0;
+		
+		if (n == 1)
+			continue;
+		
+		double t = fmin(fmax(feat[k], knots[0]), knots[n - 1]);
+		int b = (int) ((t - knots[0]) / (knots[n - 1] - knots[0]) * SURROGATE_BINS);
+		int interval = surrogate->bins[k][(b < SURROGATE_BINS) ? b : SURROGATE_BINS - 1];
+		
+		while ((interval < n - 2) && (knots[interval + 1] <= t))
+			++interval;
+		
+		base += interval * stride;
+		offsets[k] = stride;
+		weights[k] = (t - knots[interval]) / (knots[interval + 1] - knots[interval]);
+	}
+	
+	// Gather the values of the corners, bit k of a corner selecting the upper knot along the axis k
+	indices[0] = base;
+	
+	for (k = 0; k < NB_FEATURES; ++k)
+		for (c = 0; c < (1 << k); ++c)
+			indices[c + (1 << k)] = indices[c] + offsets[k];
+	
+	for (c = 0; c < (1 << NB_FEATURES); ++c)
+		corners[c] = surrogate->values[indices[c]];
+	
+	// Matlab: value = interpn(knots{:}, values, feat{:}, 'linear'); one axis at a time
+	for (k = 0; k < NB_FEATURES; ++k)
+		for (c = 0; c < (1 << (NB_FEATURES - 1 - k)); ++c)
+			corners[c] = (1.0 - weights[k]) * corners[2 * c] + weights[k] * corners[2 * c + 1];
+	
+	return corners[0];
+}
+
+double predictSurrogate(const Surrogate * surrogate, double time, double dose, const Patient * p)
+{
+	double feat[NB_FEATURES];
+	
+	sampleFeatures(p, time, dose, feat);
+	
+	return interpolateSurrogate(surrogate, feat);
+}
+
+int validateSurrogate(const Surrogate * surrogate, SVM * svm, int nbPoints, double errors[2])
+{
+	if (!surrogate->values || !isTrainedSVM(svm) || (nbPoints < 1) || flushSVM(svm))
+		return -1;
+	
+	double * raw = malloc(SURROGATE_BATCH * NB_FEATURES * sizeof(double));
+	double * points = malloc(SURROGATE_BATCH * NB_FEATURES * sizeof(double));
+	double * y = malloc(SURROGATE_BATCH * sizeof(double));
+	SVMWorkspace * ws = createSVMWorkspace();
+	unsigned seed = 1;
+	double scale = 0.0;
+	long size = 1;
+	
+	errors[0] = 0.0;
+	
+	for (int begin = 0; begin < nbPoints; begin += SURROGATE_BATCH) {
+		int rows = (nbPoints - begin < SURROGATE_BATCH) ? nbPoints - begin : SURROGATE_BATCH;
+		
+		// Uniform in the ranges, binary features at one of their two values
+		for (int i = 0; i < rows * NB_FEATURES; ++i) {
+			const int k = i % NB_FEATURES;
+			double u = (seed = seed * 1103515245u + 12345u) / 4294967296.0;
+			
+			if (surrogate->nbKnots[k] == 2)
+				u = (u < 0.5) ? 0.0 : 1.0;
+			
+			points[i] = surrogate->knots[k][0] + u * (surrogate->knots[k][surrogate->nbKnots[k] - 1] -
+													  surrogate->knots[k][0]);
+			raw[i] = points[i];
+		}
+		
+		surrogateExact(svm, ws, raw, rows, y);
+		
+		for (int i = 0; i < rows; ++i) {
+			errors[0] = fmax(errors[0], fabs(interpolateSurrogate(surrogate, &points[i * NB_FEATURES]) - y[i]));
+			scale = fmax(scale, fabs(y[i]));
+		}
+	}
+	
+	errors[1] = (scale > 0.0) ? errors[0] / scale : 0.0;
+	
+	for (int k = 0; k < NB_FEATURES; ++k)
+		size *= surrogate->nbKnots[k];
+	
+	printf("Surrogate: %ld knots (", size);
+	
+	for (int k = 0; k < NB_FEATURES; ++k)
+		printf("%s%d", k ? " x " : "", surrogate->nbKnots[k]);
+	
+	printf("), maximum error %g (%.3f%% of the largest prediction) over %d points\n", errors[0], 100.0 * errors[1],
+		   nbPoints);
+	
+	free(raw);
+	free(points);
+	free(y);
+	deleteSVMWorkspace(ws);
+	
+	return 0;
+}
+
+int saveSurrogate(const Surrogate * surrogate, const char * filename)
+{
+	struct surrogateHeaderStruct header = {"DoseGrid", NB_FEATURES, {0}};
+	long size = 1;
+	
+	if (!surrogate->values)
+		return -1;
+	
+	FILE * file = fopen(filename, "wb");
+	
+	if (file == NULL) {
+		fprintf(stderr, "Could not open file %s.\n", filename);
+		return -1;
+	}
+	
+	for (int k = 0; k < NB_FEATURES; ++k) {
+		header.nbKnots[k] = surrogate->nbKnots[k];
+		size *= surrogate->nbKnots[k];
+	}
+	
+	fwrite(&header, sizeof(header), 1, file);
+	
+	for (int k = 0; k < NB_FEATURES; ++k)
+		fwrite(surrogate->knots[k], sizeof(double), surrogate->nbKnots[k], file);
+	
+	fwrite(surrogate->values, sizeof(double), size, file);
+	
+	if (fclose(file))
+		return -1;
+	
+	return 0;
+}
+
+int loadSurrogate(Surrogate * surrogate, const char * filename)
+{
+	struct surrogateHeaderStruct header;
+	struct stat info;
+	size_t offset = sizeof(header);
+	long size = 1;
+	int i, k;
+	
+	int fd = open(filename, O_RDONLY);
+	
+	if (fd < 0) {
+		fprintf(stderr, "Could not open file %s.\n", filename);
+		return -1;
+	}
+	
+	void * map = MAP_FAILED;
+	
+	if ((fstat(fd, &info) == 0) && (info.st_size >= sizeof(header)))
+		map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	
+	close(fd);
+	
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Invalid surrogate file %s.\n", filename);
+		return -1;
+	}
+	
+	memcpy(&header, map, sizeof(header));
+	
+	// The table cannot hold more values than the file, which also keeps the product of the knot counts in range
+	for (k = 0; k < NB_FEATURES; ++k) {
+		if ((header.nbKnots[k] < 1) || (header.nbKnots[k] > info.st_size / sizeof(double) / size))
+			break;
+		
+		size *= header.nbKnots[k];
+		offset += header.nbKnots[k] * sizeof(double);
+	}
+	
+	if ((k == NB_FEATURES) && (offset + size * sizeof(double) == info.st_size)) {
+		const double * knots = (const double *) ((char *) map + sizeof(header));
+		
+		// The interpolation divides by the knot spacings: strictly increasing finite knots only
+		for (k = 0; k < NB_FEATURES; knots += header.nbKnots[k++]) {
+			for (i = 0; (i < header.nbKnots[k]) && isfinite(knots[i]) && ((i == 0) || (knots[i] > knots[i - 1])); ++i);
+			
+			if (i < header.nbKnots[k])
+				break;
+		}
+	}
+	
+	if (memcmp(header.magic, "DoseGrid", 8) || (header.nbFeatures != NB_FEATURES) || (k < NB_FEATURES) ||
+		(offset + size * sizeof(double) != info.st_size)) {
+		fprintf(stderr, "Invalid surrogate file %s.\n", filename);
+		munmap(map, info.st_size);
 		return -1;
+	}
+	
+	deleteSurrogate(surrogate);
+	surrogate->map = map;
+	surrogate->mapSize = info.st_size;
+	offset = sizeof(header);
+	
+	for (k = 0; k < NB_FEATURES; ++k) {
+		surrogate->nbKnots[k] = header.nbKnots[k];
+		surrogate->knots[k] = (double *) ((char *) map + offset);
+		surrogate->lower[k] = surrogate->knots[k][0];
+		surrogate->upper[k] = surrogate->knots[k][header.nbKnots[k] - 1];
+		surrogate->maxKnots[k] = header.nbKnots[k];
+		surrogate->bins[k] = NULL;
+		offset += header.nbKnots[k] * sizeof(double);
+		
+		if (header.nbKnots[k] > 1)
+			surrogateBins(surrogate, k);
+	}
+	
+	surrogate->values = (double *) ((char *) map + offset);
+	
+	return 0;
+}
+
+void deleteSurrogate(Surrogate * surrogate)
+{
+	for (int k = 0; k < NB_FEATURES; ++k) {
+		if (!surrogate->map)
+			free(surrogate->knots[k]);
+		
+		free(surrogate->bins[k]);
+		surrogate->knots[k] = NULL;
+		surrogate->bins[k] = NULL;
+		surrogate->nbKnots[k] = 0;
+	}
 	
+	if (surrogate->map)
+		munmap(surrogate->map, surrogate->mapSize);
+	else
+		free(surrogate->values);
+	
+	surrogate->values = NULL;
+	surrogate->map = NULL;
+	surrogate->mapSize = 0;
+}
+
+// Return the library sample the first measurement of p should replace (with the nbPending replacements not
+// trained yet taken into account) and fill its normalized features
+static int selectLeastRelevent(const SVM * svm, const PendingSample * pending, int nbPending, const Patient * p,
+							   double * testFeat)
+{
 	// Take the time and concentration value from the new patient
 	float t = p->times[0];
 	float conc = p->concentrations[0];
 	
-	double testFeat[4];
-	
 	// Normalize the testFeat matrix
-	testFeat[0] = (p->doses[0] - svm->means[1]) / svm->stds[1];
-	testFeat[1] = (p->sex - svm->means[2]) / svm->stds[2];
-	testFeat[2] = (p->age - svm->means[3]) / svm->stds[3];
-	testFeat[3] = (p->weight - svm->means[4]) / svm->stds[4];
+	sampleFeatures(p, t, p->doses[0], testFeat);
+	normalizeFeatures(svm, testFeat);
 	
 	// Duplicate the training library
 	gsl_matrix * xTrain = svm->trainFeat;
-	gsl_matrix * xTest = svm->trainFeat;
+	gsl_matrix * xTest = gsl_matrix_alloc(xTrain->size1, xTrain->size2);
+	gsl_matrix_memcpy(xTest, xTrain);
+	
+	// Take the queued replacements into account, they are not in the trained model yet
+	for (int i = 0; i < nbPending; ++i)
+		for (int j = 0; j < xTest->size2; ++j)
+			gsl_matrix_set(xTest, pending[i].index, j, pending[i].feat[j]);
 	
 	// Update the xTest with the time value from the new patient
 	for (int i = 0; i < xTrain->size1; ++i)
-		gsl_matrix_set(xTest, i, 0, (t - svm->means[0]) / svm->stds[0]);
+		gsl_matrix_set(xTest, i, FEATURE_TIME, testFeat[FEATURE_TIME]);
 	
 	// Predict the concentration values for all the training patients 
 	// at the time when the new patient got measured
 	gsl_vector * out = gsl_vector_calloc(xTrain->size1);
-	predictGaussianSVM(xTrain, xTest, svm->alpha, svm->sigma, out);
+	predictSVM(svm, xTest, out);
 	
 	// Compute the mean and std of concentration values including the new measurement
 	// Normalize the concentration values
@@ -691,9 +7615,9 @@ int leastRelevent(SVM * svm, const Patient * p)
 		d = (gsl_vector_get(out,i) - conc) *
 			(gsl_vector_get(out,i) - conc);
 		
-		for (int j = 0; j < 4; ++j)
-			d += (gsl_matrix_get(svm->trainFeat, i ,j) - testFeat[j]) *
-				 (gsl_matrix_get(svm->trainFeat, i ,j) - testFeat[j]);
+		for (int j = FEATURE_DOSE; j < NB_FEATURES; ++j)
+			d += (gsl_matrix_get(xTest, i ,j) - testFeat[j]) *
+				 (gsl_matrix_get(xTest, i ,j) - testFeat[j]);
 		
 		if ( d > largestDist) {
 			largestDist = d;
@@ -703,15 +7627,311 @@ int leastRelevent(SVM * svm, const Patient * p)
 
 	printf("Replaced the sample %d\n",largestLoc);
 	
-	// Update the library with the new paitent's sample
-	gsl_matrix_set(svm->trainFeat, largestLoc, 0, (p->times[0] - svm->means[0]) / svm->stds[0]);
+	gsl_matrix_free(xTest);
+	gsl_vector_free(out);
+	
+	return largestLoc;
+}
+
+int leastRelevent(SVM * svm, const Patient * p)
+{
+	if (!svm || !p)
+		return -1;
+	
+	double testFeat[NB_FEATURES];
+	int r = selectLeastRelevent(svm, svm->pending, svm->nbPending, p, testFeat);
+	
+	// Queue the new paitent's sample, the model is retrained by the next predictN or flushSVM
+	return queueSVMSample(svm, r, testFeat, p->concentrations[0]);
+}
+
+// Wait until no reader can still hold a model unpublished before this call (writers are serialized by the worker)
+static void synchronizeLiveSVM(LiveSVM * live)
+{
+	unsigned e = atomic_load(&live->epoch);
+	
+	// New readers count in the other parity, the ones of this parity can only leave
+	atomic_store(&live->epoch, e + 1);
+	
+	while (atomic_load(&live->readers[e & 1]) > 0)
+		sched_yield();
+}
+
+// Delay between two copies of the published model when the memory is lacking (ns)
+#define LIVE_COPY_RETRY_NS 10000000
+
+static void * liveSVMWorker(void * arg)
+{
+	LiveSVM * live = arg;
+	
+	pthread_mutex_lock(&live->lock);
+	
+	for (;;) {
+		while ((live->nbIncoming == 0) && !live->stop)
+			pthread_cond_wait(&live->wake, &live->lock);
+		
+		if (live->nbIncoming == 0) {
+			pthread_mutex_unlock(&live->lock);
+			return NULL;
+		}
+		
+		// Swap the queue for an empty one, so that replacements keep arriving while the shadow retrains
+		PendingSample * batch = live->incoming;
+		int capacity = live->incomingCapacity;
+		
+		live->incoming = live->training;
+		live->incomingCapacity = live->trainingCapacity;
+		live->training = batch;
+		live->trainingCapacity = capacity;
+		live->nbTraining = live->nbIncoming;
+		live->nbIncoming = 0;
+		live->busy = 1;
+		pthread_mutex_unlock(&live->lock);
+		
+		for (int i = 0; i < live->nbTraining; ++i)
+			queueSVMSample(live->shadow, batch[i].index, batch[i].feat, batch[i].y);
+		
+		// Keep publishing the previous model if the retraining fails, the shadow stays dirty and retrains whole
+		// with the next replacements
+		if (flushSVM(live->shadow)) {
+			fprintf(stderr, "Could not retrain the live model.\n");
+			pthread_mutex_lock(&live->lock);
+			live->nbTraining = 0;
+			live->busy = 0;
+			
+			if (live->nbIncoming == 0)
+				pthread_cond_broadcast(&live->idle);
+			
+			continue;
+		}
+		
+		// Readers only predict, the Cholesky factor stays with the shadow for the next rank 2 updates
+		gsl_matrix * chol = live->shadow->chol;
+		
+		live->shadow->chol = NULL;
+		
+		// Publish the shadow, and once every reader left the previous model make it the next shadow
+		SVM * previous = atomic_exchange(&live->current, live->shadow);
+		
+		atomic_fetch_add(&live->version, 1);
+		synchronizeLiveSVM(live);
+		deleteSVM(previous);
+		
+		// The next shadow must be a whole copy of the published model, which is left as it is: retry while the
+		// memory is lacking, unless a stop gives up the replacements still queued
+		while (copySVM(previous, live->shadow)) {
+			struct timespec delay = {0, LIVE_COPY_RETRY_NS};
+			
+			fprintf(stderr, "Could not copy the published model.\n");
+			pthread_mutex_lock(&live->lock);
+			
+			if (live->stop) {
+				previous->chol = chol;
+				live->shadow = previous;
+				live->nbIncoming = 0;
+				live->nbTraining = 0;
+				live->busy = 0;
+				pthread_cond_broadcast(&live->idle);
+				pthread_mutex_unlock(&live->lock);
+				return NULL;
+			}
+			
+			pthread_mutex_unlock(&live->lock);
+			nanosleep(&delay, NULL);
+		}
+		
+		previous->chol = chol;
+		live->shadow = previous;
+		
+		pthread_mutex_lock(&live->lock);
+		live->nbTraining = 0;
+		live->busy = 0;
+		
+		if (live->nbIncoming == 0)
+			pthread_cond_broadcast(&live->idle);
+	}
+}
+
+LiveSVM * createLiveSVM(SVM * svm)
+{
+	if (!isTrainedSVM(svm) || flushSVM(svm))
+		return NULL;
+	
+	LiveSVM * live = malloc(sizeof(LiveSVM));
+	SVM * shadow = malloc(sizeof(SVM));
+	
+	if (!live || !shadow || copySVM(shadow, svm)) {
+		free(live);
+		free(shadow);
+		return NULL;
+	}
+	
+	atomic_init(&live->current, svm);
+	atomic_init(&live->epoch, 0);
+	atomic_init(&live->readers[0], 0);
+	atomic_init(&live->readers[1], 0);
+	atomic_init(&live->version, 0);
+	live->shadow = shadow;
+	live->allocated = shadow;
+	live->incoming = NULL;
+	live->nbIncoming = 0;
+	live->incomingCapacity = 0;
+	live->training = NULL;
+	live->nbTraining = 0;
+	live->trainingCapacity = 0;
+	live->busy = 0;
+	live->stop = 0;
+	pthread_mutex_init(&live->lock, NULL);
+	pthread_cond_init(&live->wake, NULL);
+	pthread_cond_init(&live->idle, NULL);
+	atomic_fetch_add(&trainingThreads, 1);
+	
+	if (pthread_create(&live->worker, NULL, liveSVMWorker, live)) {
+		atomic_fetch_sub(&trainingThreads, 1);
+		deleteSVM(shadow);
+		free(shadow);
+		pthread_mutex_destroy(&live->lock);
+		pthread_cond_destroy(&live->wake);
+		pthread_cond_destroy(&live->idle);
+		free(live);
+		return NULL;
+	}
+	
+	return live;
+}
+
+void deleteLiveSVM(LiveSVM * live)
+{
+	if (!live)
+		return;
+	
+	pthread_mutex_lock(&live->lock);
+	live->stop = 1;
+	pthread_cond_signal(&live->wake);
+	pthread_mutex_unlock(&live->lock);
+	pthread_join(live->worker, NULL);
+	atomic_fetch_sub(&trainingThreads, 1);
+	
+	// One of the two models is the structure of the caller of createLiveSVM, only its contents are freed
+	deleteSVM(atomic_load(&live->current));
+	deleteSVM(live->shadow);
+	free(live->allocated);
+	free(live->incoming);
+	free(live->training);
+	pthread_mutex_destroy(&live->lock);
+	pthread_cond_destroy(&live->wake);
+	pthread_cond_destroy(&live->idle);
+	free(live);
+}
+
+const SVM * acquireLiveSVM(LiveSVM * live, unsigned * token)
+{
+	unsigned e;
+	
+	// Register in the current grace period; retry if the worker opened a new one meanwhile
+	for (;;) {
+		e = atomic_load(&live->epoch);
+		atomic_fetch_add(&live->readers[e & 1], 1);
+		
+		if (atomic_load(&live->epoch) == e)
+			break;
+		
+		atomic_fetch_sub(&live->readers[e & 1], 1);
+	}
+	
+	*token = e & 1;
+	
+	return atomic_load(&live->current);
+}
+
+void releaseLiveSVM(LiveSVM * live, unsigned token)
+{
+	atomic_fetch_sub(&live->readers[token], 1);
+}
+
+int predictLiveN(double start, double stop, int n, const Patient * p, float dose, LiveSVM * live, SVMWorkspace * ws,
+				 gsl_vector * out)
+{
+	if ((start < 0) || (start >= stop) || (n < 1) || !p || !live || !out)
+		return -1;
+	
+	unsigned token;
+	const SVM * svm = acquireLiveSVM(live, &token);
+	
+	predictTimes(start, stop, n, p, dose, svm, ws, out);
+	releaseLiveSVM(live, token);
+	
+	return 0;
+}
+
+int leastReleventLive(LiveSVM * live, const Patient * p)
+{
+	if (!live || !p)
+		return -1;
+	
+	double testFeat[NB_FEATURES];
+	unsigned token;
+	int r, i, j;
+	
+	// The selection runs on the published model, with the replacements being trained and then the ones still
+	// queued overlaid
+	pthread_mutex_lock(&live->lock);
+	
+	PendingSample * overlay = malloc((live->nbTraining + live->nbIncoming + 1) * sizeof(PendingSample));
+	
+	if (!overlay) {
+		pthread_mutex_unlock(&live->lock);
+		return -1;
+	}
+	
+	for (i = 0; i < live->nbTraining; ++i)
+		overlay[i] = live->training[i];
+	
+	for (i = 0; i < live->nbIncoming; ++i)
+		overlay[live->nbTraining + i] = live->incoming[i];
+	
+	const SVM * svm = acquireLiveSVM(live, &token);
+	
+	r = selectLeastRelevent(svm, overlay, live->nbTraining + live->nbIncoming, p, testFeat);
+	releaseLiveSVM(live, token);
+	free(overlay);
+	
+	for (i = 0; (i < live->nbIncoming) && (live->incoming[i].index != r); ++i);
+	
+	if (i == live->incomingCapacity) {
+		int capacity = live->incomingCapacity ? 2 * live->incomingCapacity : 16;
+		PendingSample * incoming = realloc(live->incoming, capacity * sizeof(PendingSample));
+		
+		if (!incoming) {
+			pthread_mutex_unlock(&live->lock);
+			return -1;
+		}
+		
+		live->incoming = incoming;
+		live->incomingCapacity = capacity;
+	}
+	
+	if (i == live->nbIncoming)
+		++live->nbIncoming;
 	
-	for (int j = 0; j < 4; ++j)
-		gsl_matrix_set(svm->trainFeat, largestLoc, j+1, testFeat[j]);
+	live->incoming[i].index = r;
+	live->incoming[i].y = p->concentrations[0];
 	
-	gsl_vector_set(svm->trainY, largestLoc, p->concentrations[0]);
+	for (j = 0; j < NB_FEATURES; ++j)
+		live->incoming[i].feat[j] = testFeat[j];
 	
-	trainGaussianSVM(svm->trainFeat, svm->trainY, &svm->C, &svm->sigma, svm->alpha);
+	pthread_cond_signal(&live->wake);
+	pthread_mutex_unlock(&live->lock);
 	
 	return 0;
 }
+
+void syncLiveSVM(LiveSVM * live)
+{
+	pthread_mutex_lock(&live->lock);
+	
+	while (live->busy || (live->nbIncoming > 0))
+		pthread_cond_wait(&live->idle, &live->lock);
+	
+	pthread_mutex_unlock(&live->lock);
+}